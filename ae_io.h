@@ -29,27 +29,72 @@
 
 #include "lib/ae.h"
 #include "lib/anet.h"
+#include "lib/zmalloc.h"
 
 #include <unistd.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 
 struct ae_io {
+    aeEventLoop *el;
     int fd;
     long long timer_id;
+    int writable;
     struct libmqtt *mqtt;
     void (* disconnect)(aeEventLoop *el, struct ae_io *);
+    struct ae_io *next;
 };
 
+/* connections flushed before their event loop sleeps. one list per thread so that each
+ * thread may run its own event loop, entries name their loop for threads running several. */
+static __thread struct ae_io *ae_io__head = 0;
+
+
+static void *
+ae_io__zmalloc(void *ud, size_t size) {
+    (void)ud;
+    return zmalloc(size);
+}
+
+static void *
+ae_io__zrealloc(void *ud, void *ptr, size_t size) {
+    (void)ud;
+    return zrealloc(ptr, size);
+}
+
+static void
+ae_io__zfree(void *ud, void *ptr) {
+    (void)ud;
+    zfree(ptr);
+}
+
+/* allocate libmqtt memory with zmalloc, so zmalloc_used_memory() covers it. */
+static void
+ae_io__use_zmalloc(void) {
+    libmqtt__set_allocator(ae_io__zmalloc, ae_io__zrealloc, ae_io__zfree, 0);
+}
+
+
 
 static void
 ae_io__close(aeEventLoop *el, struct ae_io *io) {
+    struct ae_io **pp;
+
+    for (pp = &ae_io__head; *pp; pp = &(*pp)->next) {
+        if (*pp == io) {
+            *pp = io->next;
+            break;
+        }
+    }
     if (AE_ERR != io->fd) {
-        aeDeleteFileEvent(el, io->fd, AE_READABLE);
+        aeDeleteFileEvent(el, io->fd, AE_READABLE | AE_WRITABLE);
         close(io->fd);
     }
     if (AE_ERR != io->timer_id)
         aeDeleteTimeEvent(el, io->timer_id);
-    free(io);
+    zfree(io);
 }
 
 static void
@@ -73,6 +118,33 @@ ae_io__read(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+static void
+ae_io__writable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io *io;
+    (void)mask;
+
+    io = (struct ae_io *)privdata;
+    if (LIBMQTT_SUCCESS == libmqtt__flush(io->mqtt)) {
+        aeDeleteFileEvent(el, fd, AE_WRITABLE);
+        io->writable = 0;
+    }
+}
+
+/* flush lingering and owed packets once per loop iteration, waiting for writable when pushed back.
+ * ae_io__connect installs it as the before-sleep proc only when the loop has none, an application
+ * with its own proc must call ae_io__before_sleep(el) from it. */
+static void
+ae_io__before_sleep(aeEventLoop *el) {
+    struct ae_io *io;
+
+    for (io = ae_io__head; io; io = io->next) {
+        if (io->el != el || io->writable || LIBMQTT_SUCCESS == libmqtt__flush(io->mqtt))
+            continue;
+        if (AE_OK == aeCreateFileEvent(el, io->fd, AE_WRITABLE, ae_io__writable, io))
+            io->writable = 1;
+    }
+}
+
 static int
 ae_io__update(aeEventLoop *el, long long id, void *privdata) {
     struct ae_io *io;
@@ -104,7 +176,7 @@ ae_io__connect(aeEventLoop *el, struct libmqtt *mqtt, char *host, int port, void
     anetEnableTcpNoDelay(0, fd);
     anetTcpKeepAlive(0, fd);
 
-    io = (struct ae_io *)malloc(sizeof *io);
+    io = (struct ae_io *)zmalloc(sizeof *io);
     memset(io, 0, sizeof *io);
 
     if (AE_ERR == aeCreateFileEvent(el, fd, AE_READABLE, ae_io__read, io)) {
@@ -118,17 +190,22 @@ ae_io__connect(aeEventLoop *el, struct libmqtt *mqtt, char *host, int port, void
         goto e3;
     }
     
+    io->el = el;
     io->fd = fd;
     io->timer_id = timer_id;
     io->mqtt = mqtt;
     io->disconnect = disconnect;
+    io->next = ae_io__head;
+    ae_io__head = io;
+    if (!el->beforesleep)
+        aeSetBeforeSleepProc(el, ae_io__before_sleep);
     return io;
 
 e3:
     aeDeleteFileEvent(el, fd, AE_READABLE);
 e2:
     close(fd);
-    free(io);
+    zfree(io);
 e1:
     return 0;
 }
@@ -142,4 +219,335 @@ ae_io__write(void *p, const char *data, int size) {
     return write(io->fd, data, size);
 }
 
+/* stats server: every connection to the unix socket gets one dump of the counters of each
+ * ae_io client and of the loop in prometheus text format, then is closed. a request starting
+ * with GET is answered over http, for curl --unix-socket, anything else gets the text, and so
+ * does a connection silent for AE_IO_SCRAPE_WAIT ms. one not done AE_IO_SCRAPE_TIMEOUT ms
+ * after that is closed. */
+
+#define AE_IO_SCRAPE_WAIT       100
+#define AE_IO_SCRAPE_TIMEOUT    5000
+
+struct ae_io_buf {
+    char *s;
+    int n;
+    int size;
+};
+
+struct ae_io_scrape {
+    int fd;
+    long long timer_id;
+    char req[1024];
+    int req_n;
+    struct ae_io_buf out;
+    int off;
+    int answered;
+};
+
+enum {
+    AE_IO_SENT,
+    AE_IO_RECEIVED,
+    AE_IO_SENT_BYTES,
+    AE_IO_RECEIVED_BYTES,
+    AE_IO_WRITE_ERRORS,
+    AE_IO_RETRIES,
+    AE_IO_PARSE_ERRORS,
+    AE_IO_INFLIGHT,
+    AE_IO_INFLIGHT_BYTES,
+    AE_IO_PING_RTT,
+    AE_IO_ACK_LATENCY,
+    AE_IO_MEMORY,
+    AE_IO_FAMILIES
+};
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} ae_io__families[AE_IO_FAMILIES] = {
+    [AE_IO_SENT]            = {"libmqtt_packets_sent_total", "counter", "MQTT packets sent."},
+    [AE_IO_RECEIVED]        = {"libmqtt_packets_received_total", "counter", "MQTT packets received."},
+    [AE_IO_SENT_BYTES]      = {"libmqtt_sent_bytes_total", "counter", "Bytes of MQTT packets sent."},
+    [AE_IO_RECEIVED_BYTES]  = {"libmqtt_received_bytes_total", "counter", "Bytes of MQTT packets received."},
+    [AE_IO_WRITE_ERRORS]    = {"libmqtt_write_errors_total", "counter", "Failed socket writes."},
+    [AE_IO_RETRIES]         = {"libmqtt_retries_total", "counter", "Packets sent again by the retry timer."},
+    [AE_IO_PARSE_ERRORS]    = {"libmqtt_parse_errors_total", "counter", "Reads rejected by the parser."},
+    [AE_IO_INFLIGHT]        = {"libmqtt_inflight", "gauge", "QoS 1 and 2 messages in flight."},
+    [AE_IO_INFLIGHT_BYTES]  = {"libmqtt_inflight_bytes", "gauge", "Payload bytes in flight."},
+    [AE_IO_PING_RTT]        = {"libmqtt_ping_rtt_microseconds", "gauge", "Last PINGREQ to PINGRESP round trip."},
+    [AE_IO_ACK_LATENCY]     = {"libmqtt_ack_latency_microseconds", "summary", "PUBLISH to PUBACK or PUBCOMP latency."},
+    [AE_IO_MEMORY]          = {"libmqtt_memory_bytes", "gauge", "Heap bytes held by the client."},
+};
+
+static void ae_io__printf(struct ae_io_buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+ae_io__printf(struct ae_io_buf *b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(b->s ? b->s + b->n : 0, b->size - b->n, fmt, ap);
+    va_end(ap);
+    if (n >= b->size - b->n) {
+        b->size = (b->n + n + 1) * 2;
+        b->s = (char *)zrealloc(b->s, b->size);
+        va_start(ap, fmt);
+        vsnprintf(b->s + b->n, b->size - b->n, fmt, ap);
+        va_end(ap);
+    }
+    b->n += n;
+}
+
+/* one sample, client escaped as a prometheus label value, labels appended as they are. */
+static void
+ae_io__sample(struct ae_io_buf *b, int family, const char *suffix, const char *client, const char *labels, long long v) {
+    const char *c;
+
+    ae_io__printf(b, "%s%s{client=\"", ae_io__families[family].name, suffix);
+    for (c = client; *c; c++) {
+        if (*c == '\\' || *c == '"')
+            ae_io__printf(b, "\\%c", *c);
+        else if (*c == '\n')
+            ae_io__printf(b, "\\n");
+        else
+            ae_io__printf(b, "%c", *c);
+    }
+    ae_io__printf(b, "\"%s} %lld\n", labels, v);
+}
+
+static void
+ae_io__stats_render(aeEventLoop *el, struct ae_io_buf *out) {
+    static const double quantiles[] = {50, 90, 99, 99.9};
+    static const char *acks[] = {"PUBACK", "PUBCOMP"};
+    struct ae_io_buf fam[AE_IO_FAMILIES];
+    struct libmqtt_stats st;
+    struct libmqtt_memory mem;
+    struct libmqtt_hist h[2];
+    struct ae_io *io;
+    aeStats ls;
+    char labels[64];
+    const char *id;
+    int i, t;
+
+    /* samples of one metric must be together, so one pass fills a buffer per metric. */
+    memset(fam, 0, sizeof fam);
+    for (io = ae_io__head; io; io = io->next) {
+        if (io->el != el)
+            continue;
+        id = libmqtt__client_id(io->mqtt);
+        libmqtt__stats(io->mqtt, &st);
+        libmqtt__memory(io->mqtt, &mem);
+        libmqtt__latency(io->mqtt, &h[0], &h[1]);
+        for (t = 0; t < 16; t++) {
+            snprintf(labels, sizeof labels, ",type=\"%s\"", t < MQTT_MAX_TYPE ? MQTT_TYPE_NAMES[t] : "AUTH");
+            if (st.sent[t]) {
+                ae_io__sample(&fam[AE_IO_SENT], AE_IO_SENT, "", id, labels, st.sent[t]);
+                ae_io__sample(&fam[AE_IO_SENT_BYTES], AE_IO_SENT_BYTES, "", id, labels, st.sent_bytes[t]);
+            }
+            if (st.received[t]) {
+                ae_io__sample(&fam[AE_IO_RECEIVED], AE_IO_RECEIVED, "", id, labels, st.received[t]);
+                ae_io__sample(&fam[AE_IO_RECEIVED_BYTES], AE_IO_RECEIVED_BYTES, "", id, labels, st.received_bytes[t]);
+            }
+        }
+        ae_io__sample(&fam[AE_IO_WRITE_ERRORS], AE_IO_WRITE_ERRORS, "", id, "", st.write_errors);
+        ae_io__sample(&fam[AE_IO_RETRIES], AE_IO_RETRIES, "", id, "", st.retries);
+        ae_io__sample(&fam[AE_IO_PARSE_ERRORS], AE_IO_PARSE_ERRORS, "", id, "", st.parse_errors);
+        ae_io__sample(&fam[AE_IO_INFLIGHT], AE_IO_INFLIGHT, "", id, "", st.inflight);
+        ae_io__sample(&fam[AE_IO_INFLIGHT_BYTES], AE_IO_INFLIGHT_BYTES, "", id, "", st.inflight_bytes);
+        ae_io__sample(&fam[AE_IO_PING_RTT], AE_IO_PING_RTT, "", id, "", st.ping_rtt);
+        for (i = 0; i < 2; i++) {
+            if (h[i].count == 0)
+                continue;
+            for (t = 0; t < (int)(sizeof quantiles / sizeof quantiles[0]); t++) {
+                snprintf(labels, sizeof labels, ",ack=\"%s\",quantile=\"%g\"", acks[i], quantiles[t] / 100);
+                ae_io__sample(&fam[AE_IO_ACK_LATENCY], AE_IO_ACK_LATENCY, "", id, labels,
+                              libmqtt__hist_percentile(&h[i], quantiles[t]));
+            }
+            snprintf(labels, sizeof labels, ",ack=\"%s\"", acks[i]);
+            ae_io__sample(&fam[AE_IO_ACK_LATENCY], AE_IO_ACK_LATENCY, "_sum", id, labels, h[i].sum);
+            ae_io__sample(&fam[AE_IO_ACK_LATENCY], AE_IO_ACK_LATENCY, "_count", id, labels, h[i].count);
+        }
+        ae_io__sample(&fam[AE_IO_MEMORY], AE_IO_MEMORY, "", id, ",category=\"inflight_out\"", mem.inflight_out);
+        ae_io__sample(&fam[AE_IO_MEMORY], AE_IO_MEMORY, "", id, ",category=\"inflight_in\"", mem.inflight_in);
+        ae_io__sample(&fam[AE_IO_MEMORY], AE_IO_MEMORY, "", id, ",category=\"parser\"", mem.parser);
+        ae_io__sample(&fam[AE_IO_MEMORY], AE_IO_MEMORY, "", id, ",category=\"output\"", mem.output);
+        ae_io__sample(&fam[AE_IO_MEMORY], AE_IO_MEMORY, "", id, ",category=\"strings\"", mem.strings);
+    }
+    for (i = 0; i < AE_IO_FAMILIES; i++) {
+        if (!fam[i].n)
+            continue;
+        ae_io__printf(out, "# HELP %s %s\n# TYPE %s %s\n", ae_io__families[i].name, ae_io__families[i].help,
+                      ae_io__families[i].name, ae_io__families[i].type);
+        ae_io__printf(out, "%.*s", fam[i].n, fam[i].s);
+        zfree(fam[i].s);
+    }
+
+    aeGetStats(el, &ls, 0);
+    ae_io__printf(out, "# HELP libmqtt_process_memory_bytes Heap bytes held by all clients of the process.\n"
+                  "# TYPE libmqtt_process_memory_bytes gauge\nlibmqtt_process_memory_bytes %lld\n",
+                  (long long)libmqtt__memory_total());
+    ae_io__printf(out, "# HELP ae_loop_iterations_total Event loop polls that returned.\n"
+                  "# TYPE ae_loop_iterations_total counter\nae_loop_iterations_total %lld\n", ls.iterations);
+    ae_io__printf(out, "# HELP ae_loop_busy_microseconds_total Time spent in callbacks after polling.\n"
+                  "# TYPE ae_loop_busy_microseconds_total counter\nae_loop_busy_microseconds_total %lld\n", ls.busyUs);
+    ae_io__printf(out, "# HELP ae_loop_iteration_max_microseconds Longest loop iteration.\n"
+                  "# TYPE ae_loop_iteration_max_microseconds gauge\nae_loop_iteration_max_microseconds %lld\n",
+                  ls.iterationMaxUs);
+    ae_io__printf(out, "# HELP ae_loop_file_events_total File events fired.\n"
+                  "# TYPE ae_loop_file_events_total counter\nae_loop_file_events_total %lld\n", ls.fileEvents);
+    ae_io__printf(out, "# HELP ae_loop_file_events_max Most file events fired by one poll.\n"
+                  "# TYPE ae_loop_file_events_max gauge\nae_loop_file_events_max %d\n", ls.fileEventsMax);
+    ae_io__printf(out, "# HELP ae_loop_timer_events_total Timers fired.\n"
+                  "# TYPE ae_loop_timer_events_total counter\nae_loop_timer_events_total %lld\n", ls.timeEvents);
+    ae_io__printf(out, "# HELP ae_loop_timer_late_microseconds_total How late timers fired, summed.\n"
+                  "# TYPE ae_loop_timer_late_microseconds_total counter\nae_loop_timer_late_microseconds_total %lld\n",
+                  ls.lateUs);
+    ae_io__printf(out, "# HELP ae_loop_timer_late_max_microseconds Latest timer.\n"
+                  "# TYPE ae_loop_timer_late_max_microseconds gauge\nae_loop_timer_late_max_microseconds %lld\n",
+                  ls.lateMaxUs);
+    ae_io__printf(out, "# HELP ae_loop_slow_calls_total Callbacks reaching the slow threshold.\n"
+                  "# TYPE ae_loop_slow_calls_total counter\nae_loop_slow_calls_total %lld\n", ls.slowCalls);
+    ae_io__printf(out, "# HELP ae_loop_slowest_call_microseconds Slowest callback.\n"
+                  "# TYPE ae_loop_slowest_call_microseconds gauge\nae_loop_slowest_call_microseconds %lld\n",
+                  ls.slowestUs);
+}
+
+static void
+ae_io__scrape_close(aeEventLoop *el, struct ae_io_scrape *sc) {
+    aeDeleteFileEvent(el, sc->fd, AE_READABLE | AE_WRITABLE);
+    aeDeleteTimeEvent(el, sc->timer_id);
+    close(sc->fd);
+    zfree(sc->out.s);
+    zfree(sc);
+}
+
+static void
+ae_io__scrape_reply(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io_scrape *sc;
+    int n;
+    (void)mask;
+
+    sc = (struct ae_io_scrape *)privdata;
+    n = write(fd, sc->out.s + sc->off, sc->out.n - sc->off);
+    if (n == -1 && errno == EAGAIN) {
+        return;
+    }
+    if (n <= 0 || (sc->off += n) == sc->out.n) {
+        ae_io__scrape_close(el, sc);
+    }
+}
+
+/* render the stats and start writing them, as http when the request so far starts with GET. */
+static void
+ae_io__scrape_answer(aeEventLoop *el, struct ae_io_scrape *sc) {
+    struct ae_io_buf body;
+
+    memset(&body, 0, sizeof body);
+    ae_io__stats_render(el, &body);
+    if (!strncmp(sc->req, "GET ", 4)) {
+        ae_io__printf(&sc->out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %d\r\nConnection: close\r\n\r\n", body.n);
+        ae_io__printf(&sc->out, "%.*s", body.n, body.s);
+        zfree(body.s);
+    } else {
+        sc->out = body;
+    }
+    sc->answered = 1;
+    aeDeleteFileEvent(el, sc->fd, AE_READABLE);
+    if (!sc->out.n || AE_ERR == aeCreateFileEvent(el, sc->fd, AE_WRITABLE, ae_io__scrape_reply, sc)) {
+        ae_io__scrape_close(el, sc);
+    }
+}
+
+/* answer a connection that sent no whole request in time, close one whose reply is not taken. */
+static int
+ae_io__scrape_timeout(aeEventLoop *el, long long id, void *privdata) {
+    struct ae_io_scrape *sc;
+    (void)id;
+
+    sc = (struct ae_io_scrape *)privdata;
+    if (sc->answered) {
+        ae_io__scrape_close(el, sc);
+        return AE_NOMORE;
+    }
+    ae_io__scrape_answer(el, sc);
+    return AE_IO_SCRAPE_TIMEOUT;
+}
+
+static void
+ae_io__scrape_request(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io_scrape *sc;
+    int n, http;
+    (void)mask;
+
+    sc = (struct ae_io_scrape *)privdata;
+    n = read(fd, sc->req + sc->req_n, sizeof(sc->req) - 1 - sc->req_n);
+    if (n == -1 && errno == EAGAIN) {
+        return;
+    }
+    if (n < 0) {
+        ae_io__scrape_close(el, sc);
+        return;
+    }
+    sc->req_n += n;
+    sc->req[sc->req_n] = '\0';
+    http = !strncmp(sc->req, "GET ", 4);
+    if (n > 0 && sc->req_n < (int)sizeof(sc->req) - 1) {
+        if (http ? !strstr(sc->req, "\r\n\r\n") && !strstr(sc->req, "\n\n") : !strchr(sc->req, '\n'))
+            return;
+    }
+    ae_io__scrape_answer(el, sc);
+}
+
+static void
+ae_io__stats_accept(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct ae_io_scrape *sc;
+    int cfd;
+    char err[ANET_ERR_LEN];
+    (void)privdata;
+    (void)mask;
+
+    cfd = anetUnixAccept(err, fd);
+    if (ANET_ERR == cfd) {
+        return;
+    }
+    anetNonBlock(0, cfd);
+    sc = (struct ae_io_scrape *)zmalloc(sizeof *sc);
+    memset(sc, 0, sizeof *sc);
+    sc->fd = cfd;
+    sc->timer_id = aeCreateTimeEvent(el, AE_IO_SCRAPE_WAIT, ae_io__scrape_timeout, sc, 0);
+    if (AE_ERR == sc->timer_id) {
+        close(cfd);
+        zfree(sc);
+        return;
+    }
+    if (AE_ERR == aeCreateFileEvent(el, cfd, AE_READABLE, ae_io__scrape_request, sc)) {
+        aeDeleteTimeEvent(el, sc->timer_id);
+        close(cfd);
+        zfree(sc);
+    }
+}
+
+/* listen on the unix socket path, replacing a stale one, and serve stats from el. */
+static int
+ae_io__stats_server(aeEventLoop *el, char *path) {
+    int fd;
+    char err[ANET_ERR_LEN];
+
+    unlink(path);
+    fd = anetUnixServer(err, path, 0660, 16);
+    if (ANET_ERR == fd) {
+        fprintf(stderr, "anetUnixServer: %s\n", err);
+        return AE_ERR;
+    }
+    anetNonBlock(0, fd);
+    if (AE_ERR == aeCreateFileEvent(el, fd, AE_READABLE, ae_io__stats_accept, 0)) {
+        fprintf(stderr, "aeCreateFileEvent: error\n");
+        close(fd);
+        return AE_ERR;
+    }
+    return fd;
+}
+
 #endif // _AE_IO_H_
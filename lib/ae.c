@@ -75,6 +75,9 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->slowUs = 0;
+    eventLoop->slowproc = NULL;
+    aeGetStats(eventLoop, NULL, 1);
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -122,9 +125,20 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    aeTimeEvent *te, *next;
+
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
+
+    /* Free the time events list, deleted ones are only unlinked by the
+     * next processTimeEvents() that never comes. */
+    te = eventLoop->timeEventHead;
+    while (te) {
+        next = te->next;
+        zfree(te);
+        te = next;
+    }
     zfree(eventLoop);
 }
 
@@ -186,6 +200,36 @@ static void aeGetTime(long *seconds, long *milliseconds)
     *milliseconds = tv.tv_usec/1000;
 }
 
+static long long aeUstime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Account a callback that ran from start until now, calling the slow proc
+ * when it took too long. Returns now so consecutive calls chain. */
+static long long aeTrackCall(aeEventLoop *eventLoop, long long start, int fd,
+        long long id, void *clientData)
+{
+    long long now = aeUstime();
+    long long us = now - start;
+
+    if (us > eventLoop->stats.slowestUs) {
+        eventLoop->stats.slowestUs = us;
+        eventLoop->stats.slowestFd = fd;
+        eventLoop->stats.slowestId = id;
+    }
+    if (eventLoop->slowUs > 0 && us >= eventLoop->slowUs) {
+        eventLoop->stats.slowCalls++;
+        if (eventLoop->slowproc)
+            eventLoop->slowproc(eventLoop, fd, id, us, clientData);
+        now = aeUstime();
+    }
+    return now;
+}
+
 static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
     long cur_sec, cur_ms, when_sec, when_ms;
 
@@ -286,6 +330,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
     te = eventLoop->timeEventHead;
     maxId = eventLoop->timeEventNextId-1;
     while(te) {
+        struct timeval tv;
         long now_sec, now_ms;
         long long id;
 
@@ -312,14 +357,29 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
             te = te->next;
             continue;
         }
-        aeGetTime(&now_sec, &now_ms);
+        gettimeofday(&tv, NULL);
+        now_sec = tv.tv_sec;
+        now_ms = tv.tv_usec/1000;
         if (now_sec > te->when_sec ||
             (now_sec == te->when_sec && now_ms >= te->when_ms))
         {
             int retval;
-
+            long long start;
+
+            /* when_sec is zeroed by a clock skew, that is not lateness. */
+            if (te->when_sec) {
+                long long late = (long long)(now_sec - te->when_sec)*1000000 +
+                    tv.tv_usec - (long long)te->when_ms*1000;
+                eventLoop->stats.lateUs += late;
+                if (late > eventLoop->stats.lateMaxUs)
+                    eventLoop->stats.lateMaxUs = late;
+            }
             id = te->id;
+            start = aeUstime();
             retval = te->timeProc(eventLoop, id, te->clientData);
+            aeTrackCall(eventLoop, start, -1, id,
+                    te->id != AE_DELETED_EVENT_ID ? te->clientData : NULL);
+            eventLoop->stats.timeEvents++;
             processed++;
             if (retval != AE_NOMORE) {
                 aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
@@ -349,6 +409,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
     int processed = 0, numevents;
+    long long start = 0, now;
 
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
@@ -398,11 +459,12 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         }
 
         numevents = aeApiPoll(eventLoop, tvp);
+        start = now = aeUstime();
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
             int fd = eventLoop->fired[j].fd;
-            int rfired = 0;
+            int rfired = 0, wfired = 0;
 
 	    /* note the fe->mask & mask & ... code: maybe an already processed
              * event removed an element that fired and we still didn't
@@ -412,16 +474,35 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
                 fe->rfileProc(eventLoop,fd,fe->clientData,mask);
             }
             if (fe->mask & mask & AE_WRITABLE) {
-                if (!rfired || fe->wfileProc != fe->rfileProc)
+                if (!rfired || fe->wfileProc != fe->rfileProc) {
+                    wfired = 1;
                     fe->wfileProc(eventLoop,fd,fe->clientData,mask);
+                }
             }
+            /* a callback that deleted its event may have freed clientData. */
+            if (rfired || wfired)
+                now = aeTrackCall(eventLoop, now, fd, -1,
+                        fe->mask != AE_NONE ? fe->clientData : NULL);
             processed++;
         }
+        eventLoop->stats.fileEvents += numevents > 0 ? numevents : 0;
+        if (numevents > eventLoop->stats.fileEventsMax)
+            eventLoop->stats.fileEventsMax = numevents;
     }
     /* Check time events */
-    if (flags & AE_TIME_EVENTS)
+    if (flags & AE_TIME_EVENTS) {
+        if (!start) start = aeUstime();
         processed += processTimeEvents(eventLoop);
+    }
 
+    if (start) {
+        long long us = aeUstime() - start;
+
+        eventLoop->stats.iterations++;
+        eventLoop->stats.busyUs += us;
+        if (us > eventLoop->stats.iterationMaxUs)
+            eventLoop->stats.iterationMaxUs = us;
+    }
     return processed; /* return the number of processed file/time events */
 }
 
@@ -450,8 +531,12 @@ int aeWait(int fd, int mask, long long milliseconds) {
 void aeMain(aeEventLoop *eventLoop) {
     eventLoop->stop = 0;
     while (!eventLoop->stop) {
-        if (eventLoop->beforesleep != NULL)
+        if (eventLoop->beforesleep != NULL) {
+            long long start = aeUstime();
+
             eventLoop->beforesleep(eventLoop);
+            aeTrackCall(eventLoop, start, -1, -1, NULL);
+        }
         aeProcessEvents(eventLoop, AE_ALL_EVENTS);
     }
 }
@@ -463,3 +548,22 @@ char *aeGetApiName(void) {
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Copy the loop health counters into stats when not NULL, then start a new
+ * period when reset is set. */
+void aeGetStats(aeEventLoop *eventLoop, aeStats *stats, int reset) {
+    if (stats) *stats = eventLoop->stats;
+    if (reset) {
+        memset(&eventLoop->stats, 0, sizeof(eventLoop->stats));
+        eventLoop->stats.slowestFd = -1;
+        eventLoop->stats.slowestId = -1;
+    }
+}
+
+/* Call slowproc after every file event, timer or before sleep proc that
+ * ran for usec microseconds or more, usec 0 turns it off. The slow calls
+ * are counted in aeStats even when slowproc is NULL. */
+void aeSetSlowProc(aeEventLoop *eventLoop, long long usec, aeSlowProc *slowproc) {
+    eventLoop->slowUs = usec;
+    eventLoop->slowproc = slowproc;
+}
@@ -60,6 +60,7 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData,
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeSlowProc(struct aeEventLoop *eventLoop, int fd, long long id, long long usec, void *clientData);
 
 /* File event structure */
 typedef struct aeFileEvent {
@@ -86,6 +87,24 @@ typedef struct aeFiredEvent {
     int mask;
 } aeFiredEvent;
 
+/* Loop health since the loop was created or the last aeGetStats() reset,
+ * times are in microseconds. The slowest callback is a file event when
+ * slowestFd != -1, a timer when slowestId != -1, else the before sleep proc. */
+typedef struct aeStats {
+    long long iterations;     /* polls that returned */
+    long long busyUs;         /* time spent in callbacks after polling */
+    long long iterationMaxUs; /* longest single iteration */
+    long long fileEvents;     /* file events fired */
+    int fileEventsMax;        /* most file events fired by one poll */
+    long long timeEvents;     /* timers fired */
+    long long lateUs;         /* sum of how late timers fired */
+    long long lateMaxUs;      /* latest timer */
+    long long slowCalls;      /* callbacks reaching the slow threshold */
+    long long slowestUs;
+    int slowestFd;
+    long long slowestId;
+} aeStats;
+
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
@@ -98,6 +117,9 @@ typedef struct aeEventLoop {
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
+    aeStats stats;
+    long long slowUs; /* slowproc threshold, 0 is off */
+    aeSlowProc *slowproc;
 } aeEventLoop;
 
 /* Prototypes */
@@ -119,5 +141,7 @@ char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+void aeGetStats(aeEventLoop *eventLoop, aeStats *stats, int reset);
+void aeSetSlowProc(aeEventLoop *eventLoop, long long usec, aeSlowProc *slowproc);
 
 #endif
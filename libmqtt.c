@@ -24,17 +24,37 @@
 
 #include "libmqtt.h"
 
+#define MQTT_ROLE_CLIENT
 #define MQTT_IMPLEMENTATION
 #include "mqtt.h"
+#include "mqtt_topic.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
+#include <stddef.h>
 #include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+/* static probes for bpftrace and perf, compiled in by configure --enable-usdt. the first
+ * argument is always the client id, see bpftrace/ for their arguments and example scripts. */
+#ifdef LIBMQTT_USDT
+#include <sys/sdt.h>
+#define LIBMQTT_PROBE3(name, a, b, c)           DTRACE_PROBE3(libmqtt, name, a, b, c)
+#define LIBMQTT_PROBE4(name, a, b, c, d)        DTRACE_PROBE4(libmqtt, name, a, b, c, d)
+#define LIBMQTT_PROBE5(name, a, b, c, d, e)     DTRACE_PROBE5(libmqtt, name, a, b, c, d, e)
+#else
+#define LIBMQTT_PROBE3(name, a, b, c)           do {} while (0)
+#define LIBMQTT_PROBE4(name, a, b, c, d)        do {} while (0)
+#define LIBMQTT_PROBE5(name, a, b, c, d, e)     do {} while (0)
+#endif
 
 #define LIBMQTT_LOG_BUFF    4096
 
+/* owed bytes keep at most this much room once flushed, room reserved for bigger writes is freed. */
+#define LIBMQTT_OUT_KEEP    65536
+
 enum libmqtt_state {
     LIBMQTT_ST_SEND_PUBLUSH,
     LIBMQTT_ST_SEND_PUBACK,
@@ -52,31 +72,87 @@ enum libmqtt_dir {
     LIBMQTT_DIR_OUT
 };
 
+struct libmqtt_topic {
+    int ref;
+    int n;
+    char *name;
+    char enc[1];
+};
+
 struct libmqtt_pub {
     struct {
         uint16_t packet_id;
         char *topic;
+        struct libmqtt_topic *h;
         enum mqtt_qos qos;
         int retain;
         char *payload;
         int length;
+        uint32_t *sub_id;
+        int sub_n;
     } p;
     enum libmqtt_state s;
     enum libmqtt_dir d;
     int t;
+    int streamed;
+    long long us;
+    int size;
 
     struct libmqtt_pub *next;
 };
 
+struct libmqtt_alias {
+    char *topic;
+    int n;
+    int prev;
+    int next;
+    int hnext;
+};
+
+struct libmqtt_sub {
+    char *topic;
+    int n;
+    uint32_t id;
+    libmqtt__on_publish cb;
+    void *ud;
+
+    struct libmqtt_sub *next;
+};
+
 struct libmqtt {
     struct mqtt_p_connect c;
     struct mqtt_parser p;
     uint16_t packet_id;
 
+    struct {
+        uint16_t cap;
+        uint16_t broker;
+        uint16_t max;
+        int n;
+        int size;
+        int mask;
+        int head;
+        int tail;
+        int *bucket;
+        struct libmqtt_alias *v;
+    } alias;
+
+    struct {
+        int available;
+        int dispatch;
+        int dead;
+        int size;
+        uint32_t last;
+        struct libmqtt_sub **v;
+        struct libmqtt_sub *head;
+        struct mqtt_trie *tree;
+    } sub;
+
     struct {
         int now;
         int ping;
         int send;
+        long long ping_us;
     } t;
 
     int time_retry;
@@ -92,32 +168,460 @@ struct libmqtt {
     void (* log)(void *ud, const char *str);
     char logbuf[LIBMQTT_LOG_BUFF];
 
+    /* single producer ring, head is written by mqtt and tail by libmqtt__trace_drain. */
+    struct {
+        uint32_t seq;
+        uint32_t head;
+        uint32_t tail;
+        uint32_t mask;
+        struct libmqtt_trace *v;
+    } trace;
+
+    /* flight recorder, slots of size bytes overwritten oldest first. pos is written by mqtt only,
+     * a slot's stamp tells libmqtt__recorder_dump whether its copy is whole. */
+    struct {
+        uint32_t pos;
+        uint32_t mask;
+        int size;
+        int payload;
+        char *v;
+        char *path;
+    } rec;
+
     void *io;
     libmqtt__io_write io_write;
+
+    /* bytes io_write did not take yet, or lingering, sent ahead of anything else. */
+    struct {
+        char *s;
+        int n;
+        int size;
+        long long since;
+    } out;
+
+    struct {
+        int usec;
+        int bytes;
+    } linger;
+
+    struct {
+        libmqtt__on_publish_begin begin;
+        libmqtt__on_publish_chunk chunk;
+        libmqtt__on_publish_end end;
+    } stream;
+
+    /* receive temporaries, reset when libmqtt__read returns. */
+    struct mqtt_arena arena;
+
+    /* messages collected for cb.publish_batch during one libmqtt__read, with the QoS 2
+     * messages whose PUBCOMP waits for them. data and size are what is being read. */
+    struct {
+        const char *data;
+        int size;
+        int n;
+        int cap;
+        struct libmqtt_view *v;
+        struct libmqtt_pub **pub;
+    } inbox;
+
+    struct libmqtt_stats stats;
+    struct libmqtt_memory mem;
+
+    struct {
+        struct libmqtt_hist puback;
+        struct libmqtt_hist pubcomp;
+    } latency;
 };
 
 
+static long long
+__now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* __hist_index(UINT32_MAX) must be the last bucket. */
+typedef char __hist_buckets_check[(31 - LIBMQTT_HIST_SUB_BITS) * LIBMQTT_HIST_SUB
+    + (int)(UINT32_MAX >> (31 - LIBMQTT_HIST_SUB_BITS)) + 1 == LIBMQTT_HIST_BUCKETS ? 1 : -1];
+
 static int
-__write(struct libmqtt *mqtt, const char *data, int size) {
-    if (-1 == mqtt->io_write(mqtt->io, data, size)) {
+__hist_index(uint64_t v) {
+    int h;
+
+    if (v < 2 * LIBMQTT_HIST_SUB)
+        return (int)v;
+    h = 63 - __builtin_clzll(v);
+    return (h - LIBMQTT_HIST_SUB_BITS) * LIBMQTT_HIST_SUB + (int)(v >> (h - LIBMQTT_HIST_SUB_BITS));
+}
+
+/* the largest value counted in bucket i. */
+static uint64_t
+__hist_value(int i) {
+    int shift;
+
+    if (i < 2 * LIBMQTT_HIST_SUB)
+        return i;
+    shift = i / LIBMQTT_HIST_SUB - 1;
+    return (((uint64_t)(i % LIBMQTT_HIST_SUB + LIBMQTT_HIST_SUB + 1)) << shift) - 1;
+}
+
+static void
+__hist_add(struct libmqtt_hist *h, long long us) {
+    uint64_t v;
+
+    v = us < 0 ? 0 : (uint64_t)us;
+    if (v > UINT32_MAX)
+        v = UINT32_MAX;
+    h->v[__hist_index(v)]++;
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+}
+
+/* bytes held by every client, libmqtt__memory_total. */
+static int64_t __memory_total = 0;
+
+/* move a category of mqtt memory by delta bytes. */
+static void
+__memory(struct libmqtt *mqtt, int64_t *v, int64_t delta) {
+    *v += delta;
+    mqtt->mem.total += delta;
+    __atomic_add_fetch(&__memory_total, delta, __ATOMIC_RELAXED);
+}
+
+static void
+__memory_strings(struct libmqtt *mqtt) {
+    int64_t n;
+
+    n = mqtt->c.will_payload.n;
+    if (mqtt->c.client_id.s) n += mqtt->c.client_id.n + 1;
+    if (mqtt->c.username.s) n += mqtt->c.username.n + 1;
+    if (mqtt->c.password.s) n += mqtt->c.password.n + 1;
+    if (mqtt->c.will_topic.s) n += mqtt->c.will_topic.n + 1;
+    __memory(mqtt, &mqtt->mem.strings, n - mqtt->mem.strings);
+}
+
+/* room to owe size more bytes. taken before bytes go to io_write, since once part of a
+ * packet is on the wire its tail must follow and can no longer fail. */
+static int
+__reserve(struct libmqtt *mqtt, int size) {
+    char *s;
+    int n;
+
+    if (mqtt->out.n + size <= mqtt->out.size)
+        return 0;
+    n = mqtt->out.size ? mqtt->out.size : 256;
+    while (n < mqtt->out.n + size)
+        n *= 2;
+    s = mqtt__realloc(mqtt->out.s, n);
+    if (!s) return -1;
+    __memory(mqtt, &mqtt->mem.output, n - mqtt->out.size);
+    mqtt->out.s = s;
+    mqtt->out.size = n;
+    return 0;
+}
+
+static int
+__owe(struct libmqtt *mqtt, const char *data, int size) {
+    if (__reserve(mqtt, size)) return -1;
+    memcpy(mqtt->out.s + mqtt->out.n, data, size);
+    mqtt->out.n += size;
+    return 0;
+}
+
+static void
+__trim(struct libmqtt *mqtt) {
+    if (mqtt->out.n == 0 && mqtt->out.size > LIBMQTT_OUT_KEEP) {
+        __memory(mqtt, &mqtt->mem.output, -mqtt->out.size);
+        mqtt__free(mqtt->out.s);
+        mqtt->out.s = 0;
+        mqtt->out.size = 0;
+    }
+}
+
+/* a failed io_write, pushed back by a full socket unless errno says otherwise. */
+static void
+__write_failed(struct libmqtt *mqtt, int n) {
+    if (n == -1 && errno != EAGAIN)
+        mqtt->stats.write_errors++;
+}
+
+static int
+__flush(struct libmqtt *mqtt) {
+    int n;
+
+    if (mqtt->out.n == 0)
+        return 0;
+    n = mqtt->io_write(mqtt->io, mqtt->out.s, mqtt->out.n);
+    if (n <= 0) {
+        __write_failed(mqtt, n);
+        return -1;
+    }
+    mqtt->t.send = mqtt->t.now;
+    mqtt->out.n -= n;
+    memmove(mqtt->out.s, mqtt->out.s + n, mqtt->out.n);
+    if (mqtt->out.n > 0)
+        return -1;
+    __trim(mqtt);
+    return 0;
+}
+
+/* write data, or fail and write nothing. the tail of a short write is owed and flushed first next time.
+ * with linger set, data is queued until the byte or time bound, libmqtt__flush or the next owed flush. */
+static int
+__send(struct libmqtt *mqtt, const char *data, int size) {
+    int n;
+
+    if (mqtt->linger.usec > 0 || mqtt->linger.bytes > 0) {
+        if (mqtt->out.n == 0)
+            mqtt->out.since = mqtt->linger.usec > 0 ? __now_us() : 0;
+        if (__owe(mqtt, data, size)) {
+            return -1;
+        }
+        if ((mqtt->linger.bytes > 0 && mqtt->out.n >= mqtt->linger.bytes)
+            || (mqtt->linger.usec > 0 && __now_us() - mqtt->out.since >= mqtt->linger.usec)) {
+            __flush(mqtt);
+        }
+        return 0;
+    }
+    if (__flush(mqtt) || __reserve(mqtt, size)) {
+        return -1;
+    }
+    n = mqtt->io_write(mqtt->io, data, size);
+    if (n == -1) {
+        __write_failed(mqtt, n);
         return -1;
     }
+    if (n < size)
+        __owe(mqtt, data + n, size - n);
+    else
+        __trim(mqtt);
     mqtt->t.send = mqtt->t.now;
     return 0;
 }
 
+/* __send one packet, counted by its type. */
+static int
+__write(struct libmqtt *mqtt, const char *data, int size) {
+    int type;
+
+    type = (uint8_t)data[0] >> 4;
+    if (__send(mqtt, data, size)) {
+        LIBMQTT_PROBE4(write, mqtt->c.client_id.s, type, size, 0);
+        return -1;
+    }
+    LIBMQTT_PROBE4(write, mqtt->c.client_id.s, type, size, 1);
+    mqtt->stats.sent[type]++;
+    mqtt->stats.sent_bytes[type] += size;
+    return 0;
+}
+
+/* topic is only known while the packet is at hand, records keep its length. */
+static int
+__trace_format(const struct libmqtt_trace *t, const char *topic, char *buf, int size) {
+    static const char *events[] = {
+        [LIBMQTT_TRACE_SEND]    = "sending",
+        [LIBMQTT_TRACE_RESEND]  = "resending",
+        [LIBMQTT_TRACE_RECV]    = "received",
+    };
+    const char *ev, *name, *q;
+    char tn[32];
+    int n;
+
+    ev = t->event <= LIBMQTT_TRACE_RECV ? events[t->event] : "unknown";
+    name = MQTT_IS_TYPE(t->type) ? MQTT_TYPE_NAMES[t->type] : MQTT_TYPE_NAMES[RESERVED];
+    n = t->topic_n;
+    q = "\'";
+    if (!topic) {
+        n = snprintf(tn, sizeof tn, "<%"PRIu16" bytes>", t->topic_n);
+        topic = tn;
+        q = "";
+    }
+
+    switch (t->type) {
+    case CONNECT:
+        return snprintf(buf, size, "%s CONNECT (%s, c%d, k%"PRIu16")", ev,
+                        MQTT_IS_VER(t->flags >> 8) ? MQTT_PROTOCOL_NAMES[t->flags >> 8] : "?", t->flags & 1, t->id);
+    case CONNACK:
+        return snprintf(buf, size, "%s CONNACK (a%d, c%d)", ev, t->flags >> 8, t->flags & 0xff);
+    case PUBLISH:
+        return snprintf(buf, size, "%s PUBLISH (d%d, q%d, r%d, m%"PRIu16", %s%.*s%s, ...(%"PRId32" bytes%s))", ev,
+                        (t->flags >> 3) & 1, (t->flags >> 1) & 3, t->flags & 1, t->id, q, n, topic, q, t->size,
+                        (t->flags & LIBMQTT_TRACE_STREAMED) ? " streamed" : "");
+    case SUBSCRIBE:
+        return snprintf(buf, size, "%s SUBSCRIBE (id: %"PRIu16", topic: %.*s, qos: %d)", ev, t->id, n, topic, t->flags);
+    case SUBACK:
+        return snprintf(buf, size, "%s SUBACK (id: %"PRIu16", QoS: %d)", ev, t->id, t->flags);
+    case UNSUBSCRIBE:
+        return snprintf(buf, size, "%s UNSUBSCRIBE (id: %"PRIu16", topic: %.*s)", ev, t->id, n, topic);
+    case PINGREQ:
+    case PINGRESP:
+    case DISCONNECT:
+        return snprintf(buf, size, "%s %s", ev, name);
+    default:
+        return snprintf(buf, size, "%s %s (id: %"PRIu16")", ev, name, t->id);
+    }
+}
+
+#define __rec_slot(mqtt, i) \
+    ((struct libmqtt_record *)((mqtt)->rec.v + (size_t)((i) & (mqtt)->rec.mask) * (mqtt)->rec.size))
+
+static void
+__record(struct libmqtt *mqtt, const struct libmqtt_trace *t, const char *payload) {
+    struct libmqtt_record *r;
+    uint32_t pos;
+
+    pos = mqtt->rec.pos;
+    r = __rec_slot(mqtt, pos);
+    __atomic_store_n(&r->stamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->t = *t;
+    r->kept = 0;
+    if (payload && t->size > 0) {
+        r->kept = t->size < mqtt->rec.payload ? t->size : mqtt->rec.payload;
+        memcpy(r + 1, payload, r->kept);
+    }
+    __atomic_store_n(&r->stamp, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&mqtt->rec.pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* copies each slot between two reads of its stamp, so it neither takes a lock nor allocates. */
+static int
+__recorder_dump(struct libmqtt *mqtt, const char *path, int reason) {
+    struct libmqtt_recorder_header h;
+    struct libmqtt_record *r;
+    struct timespec ts;
+    char buf[sizeof(struct libmqtt_record) + LIBMQTT_RECORDER_PAYLOAD + 8];
+    uint32_t head, i, stamp;
+    FILE *f;
+    int rc;
+
+    f = fopen(path, "wb");
+    if (!f) return LIBMQTT_ERROR_WRITE;
+    memset(&h, 0, sizeof h);
+    h.magic = LIBMQTT_RECORDER_MAGIC;
+    h.version = LIBMQTT_RECORDER_VERSION;
+    h.record_size = mqtt->rec.size;
+    h.mono_us = __now_us();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h.real_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    h.reason = reason;
+    h.client_id_n = mqtt->c.client_id.n;
+    fwrite(&h, sizeof h, 1, f);
+    fwrite(mqtt->c.client_id.s, 1, h.client_id_n, f);
+    if (mqtt->rec.v) {
+        head = __atomic_load_n(&mqtt->rec.pos, __ATOMIC_ACQUIRE);
+        for (i = head - mqtt->rec.mask - 1; i != head; i++) {
+            r = __rec_slot(mqtt, i);
+            stamp = __atomic_load_n(&r->stamp, __ATOMIC_ACQUIRE);
+            if (stamp == 0 || stamp != i + 1)
+                continue;
+            memcpy(buf, r, mqtt->rec.size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r->stamp, __ATOMIC_RELAXED) != stamp)
+                continue;
+            fwrite(buf, mqtt->rec.size, 1, f);
+            h.count++;
+        }
+        fseek(f, 0, SEEK_SET);
+        fwrite(&h, sizeof h, 1, f);
+    }
+    rc = ferror(f);
+    if (fclose(f) || rc) return LIBMQTT_ERROR_WRITE;
+    return LIBMQTT_SUCCESS;
+}
+
+/* a topic_n of -1 takes strlen(topic). */
 static void
-__log(struct libmqtt *mqtt, const char *fmt, ...) {
+__trace(struct libmqtt *mqtt, enum libmqtt_trace_event event, enum mqtt_p_type type, int flags, uint16_t id,
+        const char *topic, int topic_n, const char *payload, int size) {
+    struct libmqtt_trace t;
+    uint32_t head;
     int n;
-    va_list ap;
 
-    if (!mqtt->log) return;
-    n = snprintf(mqtt->logbuf, LIBMQTT_LOG_BUFF, "Client %.*s ", mqtt->c.client_id.n, mqtt->c.client_id.s);
-    va_start(ap, fmt);
-    n += vsnprintf(mqtt->logbuf+n, LIBMQTT_LOG_BUFF-n, fmt, ap);
-    va_end(ap);
-    mqtt->logbuf[n] = '\0';
-    mqtt->log(mqtt->ud, mqtt->logbuf);
+    if (event == LIBMQTT_TRACE_RECV)
+        LIBMQTT_PROBE4(receive, mqtt->c.client_id.s, type, id, size);
+    else if (event == LIBMQTT_TRACE_RESEND)
+        LIBMQTT_PROBE4(retry, mqtt->c.client_id.s, type, id, size);
+    if (!mqtt->trace.v && !mqtt->log && !mqtt->rec.v) return;
+    if (topic && topic_n < 0)
+        topic_n = strlen(topic);
+    t.us = __now_us();
+    t.seq = mqtt->trace.seq++;
+    t.size = size;
+    t.id = id;
+    t.flags = flags;
+    t.event = event;
+    t.type = type;
+    t.topic_n = topic ? topic_n : 0;
+    if (mqtt->trace.v) {
+        head = mqtt->trace.head;
+        if (head - __atomic_load_n(&mqtt->trace.tail, __ATOMIC_ACQUIRE) <= mqtt->trace.mask) {
+            mqtt->trace.v[head & mqtt->trace.mask] = t;
+            __atomic_store_n(&mqtt->trace.head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (mqtt->rec.v)
+        __record(mqtt, &t, payload);
+    if (mqtt->log) {
+        n = snprintf(mqtt->logbuf, LIBMQTT_LOG_BUFF, "Client %.*s ", mqtt->c.client_id.n, mqtt->c.client_id.s);
+        __trace_format(&t, topic, mqtt->logbuf + n, LIBMQTT_LOG_BUFF - n);
+        mqtt->log(mqtt->ud, mqtt->logbuf);
+    }
+}
+
+/* a topic name to publish on, LIBMQTT_ERROR_UTF8 when it is not well formed utf-8. */
+static int
+__topic_check(const char *topic, int n) {
+    if (mqtt__topic_valid(topic, n, 0))
+        return LIBMQTT_SUCCESS;
+    if (__mqtt_utf8 && n > 0 && !mqtt__utf8_valid(topic, n))
+        return LIBMQTT_ERROR_UTF8;
+    return LIBMQTT_ERROR_TOPIC;
+}
+
+static void
+__release_topic(struct libmqtt_topic *h) {
+    if (--h->ref == 0)
+        mqtt__free(h);
+}
+
+/* topic, payload and subscription ids live in the same allocation as pub. */
+static void
+__free_pub(struct libmqtt_pub *pub) {
+    if (pub->p.h)
+        __release_topic(pub->p.h);
+    mqtt__free(pub);
+}
+
+/* unlink and free *pp, keeping the tail valid for the next insert. */
+static void
+__unlink_pub(struct libmqtt *mqtt, struct libmqtt_pub **pp) {
+    struct libmqtt_pub *pub;
+
+    pub = *pp;
+    *pp = pub->next;
+    LIBMQTT_PROBE5(delete, mqtt->c.client_id.s, pub->p.packet_id, pub->d, pub->s, pub->p.length);
+    __memory(mqtt, pub->d == LIBMQTT_DIR_OUT ? &mqtt->mem.inflight_out : &mqtt->mem.inflight_in, -pub->size);
+    mqtt->stats.inflight--;
+    mqtt->stats.inflight_bytes -= pub->p.length;
+    if (mqtt->pub.tail == pub) {
+        mqtt->pub.tail = pp == &mqtt->pub.head ? 0
+            : (struct libmqtt_pub *)((char *)pp - offsetof(struct libmqtt_pub, next));
+    }
+    __free_pub(pub);
+}
+
+static void
+__update_pub(struct libmqtt *mqtt, struct libmqtt_pub *pub, enum libmqtt_state s) {
+    LIBMQTT_PROBE5(state, mqtt->c.client_id.s, pub->p.packet_id, pub->d, pub->s, s);
+    pub->s = s;
+    pub->t = mqtt->t.now;
 }
 
 static void
@@ -139,12 +643,18 @@ __check_retry(struct libmqtt *mqtt) {
 
                     memset(&p, 0, sizeof p);
                     p.h.type = PUBLISH;
+                    p.vsn = mqtt->c.proto_ver;
                     p.h.dup = 1;
                     p.h.retain = pub->p.retain;
                     p.h.qos = pub->p.qos;
                     p.v.publish.packet_id = pub->p.packet_id;
                     p.v.publish.topic_name.s = pub->p.topic;
-                    p.v.publish.topic_name.n = strlen(pub->p.topic);
+                    if (pub->p.h) {
+                        p.v.publish.topic_name.n = pub->p.h->n;
+                        p.v.publish.topic_enc = pub->p.h->enc;
+                    } else {
+                        p.v.publish.topic_name.n = strlen(pub->p.topic);
+                    }
                     p.payload.s = pub->p.payload;
                     p.payload.n = pub->p.length;
 
@@ -153,20 +663,18 @@ __check_retry(struct libmqtt *mqtt) {
                     }
 
                     if (0 == __write(mqtt, b.s, b.n)) {
-                        __log(mqtt, "sending PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
-                              1, pub->p.qos, pub->p.retain, pub->p.packet_id, pub->p.topic, pub->p.length);
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBLISH, 1 << 3 | pub->p.qos << 1 | pub->p.retain, pub->p.packet_id,
+                                pub->p.topic, -1, pub->p.payload, pub->p.length);
                         if (pub->p.qos == MQTT_QOS_0) {
-                            *pp = (*pp)->next;
-                            free(pub->p.topic);
-                            if (pub->p.payload)
-                                free(pub->p.payload);
-                            free(pub);
+                            mqtt_b_free(&b);
+                            __unlink_pub(mqtt, pp);
                             pub = 0;
                             break;
                         } else if (pub->p.qos == MQTT_QOS_1) {
-                            pub->s = LIBMQTT_ST_WAIT_PUBACK;
+                            __update_pub(mqtt, pub, LIBMQTT_ST_WAIT_PUBACK);
                         } else {
-                            pub->s = LIBMQTT_ST_WAIT_PUBREC;
+                            __update_pub(mqtt, pub, LIBMQTT_ST_WAIT_PUBREC);
                         }
                     }
                     pub->t = mqtt->t.now;
@@ -177,12 +685,9 @@ __check_retry(struct libmqtt *mqtt) {
                 {
                     char puback[] = MQTT_PUBACK(pub->p.packet_id);
                     if (0 == __write(mqtt, puback, sizeof puback)) {
-                        __log(mqtt, "sending PUBACK (id: %"PRIu16")", pub->p.packet_id);
-                        *pp = (*pp)->next;
-                        free(pub->p.topic);
-                        if (pub->p.payload)
-                            free(pub->p.payload);
-                        free(pub);
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBACK, 0, pub->p.packet_id, 0, 0, 0, 0);
+                        __unlink_pub(mqtt, pp);
                         pub = 0;
                     } else {
                         pub->t = mqtt->t.now;
@@ -193,8 +698,9 @@ __check_retry(struct libmqtt *mqtt) {
                 {
                     char pubrec[] = MQTT_PUBREC(pub->p.packet_id);
                     if (0 == __write(mqtt, pubrec, sizeof pubrec)) {
-                        __log(mqtt, "sending PUBREC (id: %"PRIu16")", pub->p.packet_id);
-                        pub->s = LIBMQTT_ST_WAIT_PUBREL;
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBREC, 0, pub->p.packet_id, 0, 0, 0, 0);
+                        __update_pub(mqtt, pub, LIBMQTT_ST_WAIT_PUBREL);
                     }
                     pub->t = mqtt->t.now;
                 }
@@ -203,8 +709,9 @@ __check_retry(struct libmqtt *mqtt) {
                 {
                     char pubrel[] = MQTT_PUBREL(pub->p.packet_id);
                     if (0 == __write(mqtt, pubrel, sizeof pubrel)) {
-                        __log(mqtt, "sending PUBREL (id: %"PRIu16")", pub->p.packet_id);
-                        pub->s = LIBMQTT_ST_WAIT_PUBCOMP;
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBREL, 0, pub->p.packet_id, 0, 0, 0, 0);
+                        __update_pub(mqtt, pub, LIBMQTT_ST_WAIT_PUBCOMP);
                     }
                     pub->t = mqtt->t.now;
                 }
@@ -213,12 +720,9 @@ __check_retry(struct libmqtt *mqtt) {
                 {
                     char pubcomp[] = MQTT_PUBCOMP(pub->p.packet_id);
                     if (0 == __write(mqtt, pubcomp, sizeof pubcomp)) {
-                        __log(mqtt, "sending PUBCOMP (id: %"PRIu16")", pub->p.packet_id);
-                        *pp = (*pp)->next;
-                        free(pub->p.topic);
-                        if (pub->p.payload)
-                            free(pub->p.payload);
-                        free(pub);
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBCOMP, 0, pub->p.packet_id, 0, 0, 0, 0);
+                        __unlink_pub(mqtt, pp);
                         pub = 0;
                     } else {
                         pub->t = mqtt->t.now;
@@ -229,7 +733,8 @@ __check_retry(struct libmqtt *mqtt) {
                 {
                     char pubrec[] = MQTT_PUBREC(pub->p.packet_id);
                     if (0 == __write(mqtt, pubrec, sizeof pubrec)) {
-                        __log(mqtt, "sending PUBREC (id: %"PRIu16")", pub->p.packet_id);
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBREC, 0, pub->p.packet_id, 0, 0, 0, 0);
                     }
                     pub->t = mqtt->t.now;
                 }
@@ -238,7 +743,8 @@ __check_retry(struct libmqtt *mqtt) {
                 {
                     char pubrel[] = MQTT_PUBREL(pub->p.packet_id);
                     if (0 == __write(mqtt, pubrel, sizeof pubrel)) {
-                        __log(mqtt, "sending PUBREL (id: %"PRIu16")", pub->p.packet_id);
+                        mqtt->stats.retries++;
+                        __trace(mqtt, LIBMQTT_TRACE_RESEND, PUBREL, 0, pub->p.packet_id, 0, 0, 0, 0);
                     }
                     pub->t = mqtt->t.now;
                 }
@@ -250,6 +756,199 @@ __check_retry(struct libmqtt *mqtt) {
     }
 }
 
+static uint32_t
+__topic_hash(const char *topic, int n) {
+    uint64_t h, w;
+    int i;
+
+    h = n;
+    for (i = 0; i + 8 <= n; i += 8) {
+        memcpy(&w, topic + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    if (i < n) {
+        w = 0;
+        memcpy(&w, topic + i, n - i);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void
+__alias_reset(struct libmqtt *mqtt) {
+    int i;
+
+    for (i = 0; i < mqtt->alias.n; i++)
+        mqtt__free(mqtt->alias.v[i].topic);
+    mqtt__free(mqtt->alias.v);
+    mqtt__free(mqtt->alias.bucket);
+    mqtt->alias.v = 0;
+    mqtt->alias.bucket = 0;
+    mqtt->alias.n = 0;
+    mqtt->alias.size = 0;
+    mqtt->alias.mask = 0;
+    mqtt->alias.head = -1;
+    mqtt->alias.tail = -1;
+    mqtt->alias.broker = 0;
+    mqtt->alias.max = 0;
+}
+
+static void
+__alias_unlink(struct libmqtt *mqtt, int i) {
+    struct libmqtt_alias *a;
+
+    a = &mqtt->alias.v[i];
+    if (a->prev >= 0) mqtt->alias.v[a->prev].next = a->next;
+    else mqtt->alias.head = a->next;
+    if (a->next >= 0) mqtt->alias.v[a->next].prev = a->prev;
+    else mqtt->alias.tail = a->prev;
+}
+
+static void
+__alias_push(struct libmqtt *mqtt, int i) {
+    struct libmqtt_alias *a;
+
+    a = &mqtt->alias.v[i];
+    a->prev = -1;
+    a->next = mqtt->alias.head;
+    if (mqtt->alias.head >= 0) mqtt->alias.v[mqtt->alias.head].prev = i;
+    mqtt->alias.head = i;
+    if (mqtt->alias.tail < 0) mqtt->alias.tail = i;
+}
+
+static void
+__alias_unhash(struct libmqtt *mqtt, int i) {
+    int *pi;
+
+    pi = &mqtt->alias.bucket[__topic_hash(mqtt->alias.v[i].topic, mqtt->alias.v[i].n) & mqtt->alias.mask];
+    while (*pi != i)
+        pi = &mqtt->alias.v[*pi].hnext;
+    *pi = mqtt->alias.v[i].hnext;
+}
+
+static void
+__alias_hash(struct libmqtt *mqtt, int i) {
+    int *pi;
+
+    pi = &mqtt->alias.bucket[__topic_hash(mqtt->alias.v[i].topic, mqtt->alias.v[i].n) & mqtt->alias.mask];
+    mqtt->alias.v[i].hnext = *pi;
+    *pi = i;
+}
+
+static int
+__alias_grow(struct libmqtt *mqtt) {
+    struct libmqtt_alias *v;
+    int *bucket;
+    int size, buckets, i;
+
+    /* slots stop at the broker's limit, buckets stay a power of two at least twice the slots. */
+    size = mqtt->alias.size ? mqtt->alias.size * 2 : 16;
+    if (size > mqtt->alias.max) size = mqtt->alias.max;
+    for (buckets = 1; buckets < 2 * size; buckets <<= 1)
+        ;
+    v = mqtt__realloc(mqtt->alias.v, size * sizeof *v);
+    if (!v) return -1;
+    mqtt->alias.v = v;
+    bucket = mqtt__malloc(buckets * sizeof *bucket);
+    if (!bucket) return -1;
+    mqtt__free(mqtt->alias.bucket);
+    mqtt->alias.bucket = bucket;
+    mqtt->alias.size = size;
+    mqtt->alias.mask = buckets - 1;
+    for (i = 0; i < buckets; i++)
+        bucket[i] = -1;
+    for (i = 0; i < mqtt->alias.n; i++)
+        __alias_hash(mqtt, i);
+    return 0;
+}
+
+/* return the alias for topic, 0 if none. *hit is set when the broker
+ * already knows the mapping and the topic name can be left out. */
+static uint16_t
+__alias_get(struct libmqtt *mqtt, const char *topic, int n, int *hit) {
+    struct libmqtt_alias *a;
+    char *s;
+    int i;
+
+    *hit = 0;
+    if (mqtt->alias.max == 0) return 0;
+    if (mqtt->alias.size > 0) {
+        i = mqtt->alias.bucket[__topic_hash(topic, n) & mqtt->alias.mask];
+        while (i >= 0) {
+            a = &mqtt->alias.v[i];
+            if (a->n == n && 0 == memcmp(a->topic, topic, n)) {
+                if (mqtt->alias.head != i) {
+                    __alias_unlink(mqtt, i);
+                    __alias_push(mqtt, i);
+                }
+                *hit = 1;
+                return i + 1;
+            }
+            i = a->hnext;
+        }
+    }
+    s = mqtt__malloc(n);
+    if (!s) return 0;
+    memcpy(s, topic, n);
+    if (mqtt->alias.n < mqtt->alias.max) {
+        if (mqtt->alias.n == mqtt->alias.size && __alias_grow(mqtt)) {
+            mqtt__free(s);
+            return 0;
+        }
+        i = mqtt->alias.n++;
+    } else {
+        i = mqtt->alias.tail;
+        __alias_unlink(mqtt, i);
+        __alias_unhash(mqtt, i);
+        mqtt__free(mqtt->alias.v[i].topic);
+    }
+    a = &mqtt->alias.v[i];
+    a->topic = s;
+    a->n = n;
+    __alias_hash(mqtt, i);
+    __alias_push(mqtt, i);
+    return i + 1;
+}
+
+/* the mapping never reached the broker, forget it. */
+static void
+__alias_drop(struct libmqtt *mqtt, uint16_t alias) {
+    struct libmqtt_alias *a;
+    int i;
+
+    i = alias - 1;
+    a = &mqtt->alias.v[i];
+    __alias_unlink(mqtt, i);
+    __alias_unhash(mqtt, i);
+    a->n = -1;
+    __alias_hash(mqtt, i);
+    /* a negative length never matches. the slot goes to the LRU end, so it is the first
+     * one evicted once the table is full, until then new aliases take fresh slots. */
+    a->next = -1;
+    a->prev = mqtt->alias.tail;
+    if (mqtt->alias.tail >= 0) mqtt->alias.v[mqtt->alias.tail].next = i;
+    mqtt->alias.tail = i;
+    if (mqtt->alias.head < 0) mqtt->alias.head = i;
+}
+
+/* lower the alias limit to max and forget the aliases above it, the broker keeps those
+ * mappings but they are never sent again. */
+static void
+__alias_trim(struct libmqtt *mqtt, uint16_t max) {
+    int i;
+
+    for (i = max; i < mqtt->alias.n; i++) {
+        __alias_unlink(mqtt, i);
+        __alias_unhash(mqtt, i);
+        mqtt__free(mqtt->alias.v[i].topic);
+    }
+    if (mqtt->alias.n > max)
+        mqtt->alias.n = max;
+    mqtt->alias.max = max;
+}
+
 static uint16_t
 __generate_packet_id(struct libmqtt *mqtt) {
     uint16_t id;
@@ -271,35 +970,71 @@ const char *libmqtt__strerror(int rc) {
         "mqtt packet parse error",
         "mqtt timeout error",
         "mqtt max topic/qos per subscribe or unsubscribe",
+        "mqtt invalid topic or topic filter",
+        "mqtt string is not well formed utf-8",
     };
 
-    if (-rc <= 0 || (size_t)-rc > sizeof(__libmqtt_error_strings)/sizeof(char *))
+    if (-rc <= 0 || (size_t)-rc >= sizeof(__libmqtt_error_strings)/sizeof(char *))
         return 0;
     return __libmqtt_error_strings[-rc];
 }
 
 static int
 __insert_pub(struct libmqtt *mqtt, struct mqtt_packet *p, enum libmqtt_dir d,
-             enum libmqtt_state s) {
+             enum libmqtt_state s, struct libmqtt_topic *h) {
     struct libmqtt_pub *pub;
-
-    pub = (struct libmqtt_pub *)malloc(sizeof *pub);
-    if (!pub) goto e;
+    size_t size;
+    char *c;
+    int sub_n;
+
+    sub_n = d == LIBMQTT_DIR_IN ? p->props.subscription_identifier_n : 0;
+    size = sizeof *pub + sub_n * sizeof(uint32_t) + p->payload.n;
+    if (!h)
+        size += p->v.publish.topic_name.n + 1;
+    pub = (struct libmqtt_pub *)mqtt__malloc(size);
+    if (!pub) return -1;
     memset(pub, 0, sizeof *pub);
+    c = (char *)(pub + 1);
     pub->p.packet_id = p->v.publish.packet_id;
     pub->p.qos = p->h.qos;
     pub->p.retain = p->h.retain;
-    pub->p.topic = strndup(p->v.publish.topic_name.s, p->v.publish.topic_name.n);
-    if (!pub->p.topic) goto e;
+    if (sub_n > 0) {
+        pub->p.sub_n = sub_n;
+        pub->p.sub_id = (uint32_t *)c;
+        memcpy(c, p->props.subscription_identifier, sub_n * sizeof(uint32_t));
+        c += sub_n * sizeof(uint32_t);
+    }
     if (p->payload.n > 0) {
-        pub->p.payload = malloc(p->payload.n);
-        if (!pub->p.payload) goto e;
-        memcpy(pub->p.payload, p->payload.s, p->payload.n);
+        pub->p.payload = c;
+        memcpy(c, p->payload.s, p->payload.n);
+        c += p->payload.n;
     }
     pub->p.length = p->payload.n;
+    if (h) {
+        pub->p.h = h;
+        pub->p.topic = h->name;
+        h->ref++;
+    } else {
+        pub->p.topic = c;
+        if (p->v.publish.topic_name.n > 0)
+            memcpy(c, p->v.publish.topic_name.s, p->v.publish.topic_name.n);
+        c[p->v.publish.topic_name.n] = '\0';
+    }
     pub->d = d;
     pub->s = s;
     pub->t = mqtt->t.now;
+    pub->size = size;
+    __memory(mqtt, d == LIBMQTT_DIR_OUT ? &mqtt->mem.inflight_out : &mqtt->mem.inflight_in, size);
+    if (d == LIBMQTT_DIR_OUT)
+        pub->us = __now_us();
+    LIBMQTT_PROBE5(insert, mqtt->c.client_id.s, pub->p.packet_id, d, s, pub->p.length);
+
+    mqtt->stats.inflight++;
+    if (mqtt->stats.inflight > mqtt->stats.inflight_peak)
+        mqtt->stats.inflight_peak = mqtt->stats.inflight;
+    mqtt->stats.inflight_bytes += pub->p.length;
+    if (mqtt->stats.inflight_bytes > mqtt->stats.inflight_bytes_peak)
+        mqtt->stats.inflight_bytes_peak = mqtt->stats.inflight_bytes;
 
     if (!mqtt->pub.head) {
         mqtt->pub.head = mqtt->pub.tail = pub;
@@ -309,16 +1044,6 @@ __insert_pub(struct libmqtt *mqtt, struct mqtt_packet *p, enum libmqtt_dir d,
     }
 
     return 0;
-
-e:
-    if (pub) {
-        if (pub->p.topic)
-            free(pub->p.topic);
-        if (pub->p.payload)
-            free(pub->p.payload);
-        free(pub);
-    }
-    return -1;
 }
 
 static void
@@ -328,23 +1053,13 @@ __delete_pub(struct libmqtt *mqtt, struct libmqtt_pub *pub) {
     pp = &mqtt->pub.head;
     while (*pp) {
         if (*pp == pub) {
-            *pp = (*pp)->next;
-            free(pub->p.topic);
-            if (pub->p.payload)
-                free(pub->p.payload);
-            free(pub);
+            __unlink_pub(mqtt, pp);
         } else {
             pp = &(*pp)->next;
         }
     }
 }
 
-static void
-__update_pub(struct libmqtt *mqtt, struct libmqtt_pub *pub, enum libmqtt_state s) {
-    pub->s = s;
-    pub->t = mqtt->t.now;
-}
-
 static struct libmqtt_pub *
 __find_pub(struct libmqtt *mqtt, uint16_t packet_id, enum libmqtt_dir d,
            enum libmqtt_state s) {
@@ -361,12 +1076,233 @@ __find_pub(struct libmqtt *mqtt, uint16_t packet_id, enum libmqtt_dir d,
     return 0;
 }
 
+static struct libmqtt_sub *
+__find_sub(struct libmqtt *mqtt, const char *topic, int n) {
+    struct libmqtt_sub *sub;
+
+    sub = mqtt__trie_find(mqtt->sub.tree, topic, n);
+    if (sub && sub->cb)
+        return sub;
+    return 0;
+}
+
+static struct libmqtt_sub *
+__insert_sub(struct libmqtt *mqtt, const char *topic, int n) {
+    struct libmqtt_sub *sub;
+    uint32_t id, i;
+
+    /* round robin from the last id handed out, so a publish the broker routed by an id
+     * freed by unsubscribe does not reach the subscription that took it next. */
+    id = 0;
+    for (i = 0; i + 1 < (uint32_t)mqtt->sub.size; i++) {
+        id = 1 + (mqtt->sub.last + i) % (mqtt->sub.size - 1);
+        if (!mqtt->sub.v[id])
+            break;
+    }
+    if (i + 1 >= (uint32_t)mqtt->sub.size) {
+        struct libmqtt_sub **v;
+        int size;
+
+        id = mqtt->sub.size ? mqtt->sub.size : 1;
+        size = mqtt->sub.size ? mqtt->sub.size * 2 : 16;
+        v = mqtt__realloc(mqtt->sub.v, size * sizeof *v);
+        if (!v) return 0;
+        memset(v + mqtt->sub.size, 0, (size - mqtt->sub.size) * sizeof *v);
+        mqtt->sub.v = v;
+        mqtt->sub.size = size;
+    }
+    sub = mqtt__malloc(sizeof *sub);
+    if (!sub) return 0;
+    memset(sub, 0, sizeof *sub);
+    sub->topic = mqtt__malloc(n);
+    if (!sub->topic) {
+        mqtt__free(sub);
+        return 0;
+    }
+    memcpy(sub->topic, topic, n);
+    sub->n = n;
+    sub->id = id;
+    if (mqtt__trie_insert(mqtt->sub.tree, topic, n, sub)) {
+        mqtt__free(sub->topic);
+        mqtt__free(sub);
+        return 0;
+    }
+    sub->next = mqtt->sub.head;
+    mqtt->sub.head = sub;
+    mqtt->sub.v[id] = sub;
+    mqtt->sub.last = id;
+    return sub;
+}
+
+static void
+__sweep_sub(struct libmqtt *mqtt) {
+    struct libmqtt_sub **pp;
+
+    pp = &mqtt->sub.head;
+    while (*pp) {
+        struct libmqtt_sub *sub;
+        sub = *pp;
+        if (!sub->cb) {
+            *pp = sub->next;
+            /* the filter may have been subscribed again while this one was dying. */
+            if (mqtt__trie_find(mqtt->sub.tree, sub->topic, sub->n) == sub)
+                mqtt__trie_remove(mqtt->sub.tree, sub->topic, sub->n);
+            mqtt__free(sub->topic);
+            mqtt__free(sub);
+        } else {
+            pp = &sub->next;
+        }
+    }
+    mqtt->sub.dead = 0;
+}
+
+/* removed subscriptions are swept once no callback can still reference them. */
+static void
+__delete_sub(struct libmqtt *mqtt, struct libmqtt_sub *sub) {
+    mqtt->sub.v[sub->id] = 0;
+    sub->cb = 0;
+    mqtt->sub.dead = 1;
+    if (!mqtt->sub.dispatch)
+        __sweep_sub(mqtt);
+}
+
+struct libmqtt_match {
+    struct libmqtt *mqtt;
+    uint16_t id;
+    const char *topic;
+    enum mqtt_qos qos;
+    int retain;
+    const char *payload;
+    int length;
+    int found;
+};
+
+static void
+__on_match(void *ud, void *value) {
+    struct libmqtt_match *m;
+    struct libmqtt_sub *sub;
+
+    m = (struct libmqtt_match *)ud;
+    sub = (struct libmqtt_sub *)value;
+    if (sub->cb) {
+        sub->cb(m->mqtt, sub->ud, m->id, m->topic, m->qos, m->retain, m->payload, m->length);
+        m->found = 1;
+    }
+}
+
+static int
+__collect(struct libmqtt *mqtt, uint16_t id, const char *topic, int n, enum mqtt_qos qos, int retain,
+          const char *payload, int length) {
+    struct libmqtt_view *v;
+
+    if (mqtt->inbox.n == mqtt->inbox.cap) {
+        struct libmqtt_pub **pub;
+        int cap;
+
+        cap = mqtt->inbox.cap ? mqtt->inbox.cap * 2 : 16;
+        v = mqtt__realloc(mqtt->inbox.v, cap * sizeof *v);
+        if (!v) return -1;
+        mqtt->inbox.v = v;
+        pub = mqtt__realloc(mqtt->inbox.pub, cap * sizeof *pub);
+        if (!pub) return -1;
+        mqtt->inbox.pub = pub;
+        mqtt->inbox.cap = cap;
+    }
+    v = &mqtt->inbox.v[mqtt->inbox.n];
+    v->id = id;
+    v->qos = qos;
+    v->retain = retain;
+    v->topic = topic;
+    v->topic_n = n;
+    v->payload = payload;
+    v->length = length;
+    mqtt->inbox.pub[mqtt->inbox.n++] = 0;
+    return 0;
+}
+
+/* deliver the collected messages, then send the acks held back for them. */
+static void
+__deliver(struct libmqtt *mqtt) {
+    int i, n;
+
+    n = mqtt->inbox.n;
+    if (n == 0)
+        return;
+    mqtt->cb.publish_batch(mqtt, mqtt->ud, mqtt->inbox.v, n);
+    mqtt->inbox.n = 0;
+    for (i = 0; i < n; i++) {
+        uint16_t id = mqtt->inbox.v[i].id;
+
+        if (mqtt->inbox.v[i].qos == MQTT_QOS_1) {
+            char puback[] = MQTT_PUBACK(id);
+
+            if (__write(mqtt, puback, sizeof puback)) {
+                struct mqtt_packet p;
+
+                memset(&p, 0, sizeof p);
+                p.h.qos = MQTT_QOS_1;
+                p.v.publish.packet_id = id;
+                __insert_pub(mqtt, &p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBACK, 0);
+            } else {
+                __trace(mqtt, LIBMQTT_TRACE_SEND, PUBACK, 0, id, 0, 0, 0, 0);
+            }
+        } else if (mqtt->inbox.pub[i]) {
+            char pubcomp[] = MQTT_PUBCOMP(id);
+
+            /* left in LIBMQTT_ST_SEND_PUBCOMP for a retry when the write fails. */
+            if (!__write(mqtt, pubcomp, sizeof pubcomp)) {
+                __trace(mqtt, LIBMQTT_TRACE_SEND, PUBCOMP, 0, id, 0, 0, 0, 0);
+                __delete_pub(mqtt, mqtt->inbox.pub[i]);
+            }
+        }
+    }
+}
+
+/* 1 when the message was collected for cb.publish_batch, -1 on error. */
+static int
+__dispatch(struct libmqtt *mqtt, uint16_t id, const char *topic, int n, enum mqtt_qos qos, int retain,
+           const char *payload, int length, uint32_t *sub_id, int sub_n) {
+    struct libmqtt_sub *sub;
+    int i, found, rc;
+
+    found = 0;
+    mqtt->sub.dispatch++;
+    if (sub_n > 0) {
+        for (i = 0; i < sub_n; i++) {
+            if (sub_id[i] < (uint32_t)mqtt->sub.size && (sub = mqtt->sub.v[sub_id[i]]) != 0) {
+                sub->cb(mqtt, sub->ud, id, topic, qos, retain, payload, length);
+                found = 1;
+            }
+        }
+    } else if (mqtt->sub.head && (mqtt->c.proto_ver != MQTT_PROTO_V5 || !mqtt->sub.available)) {
+        struct libmqtt_match m = {mqtt, id, topic, qos, retain, payload, length, 0};
+
+        mqtt__trie_match(mqtt->sub.tree, topic, n, __on_match, &m);
+        found = m.found;
+    }
+    rc = 0;
+    if (!found && mqtt->cb.publish_batch)
+        rc = __collect(mqtt, id, topic, n, qos, retain, payload, length) ? -1 : 1;
+    else if (!found && mqtt->cb.publish)
+        mqtt->cb.publish(mqtt, mqtt->ud, id, topic, qos, retain, payload, length);
+    if (--mqtt->sub.dispatch == 0 && mqtt->sub.dead)
+        __sweep_sub(mqtt);
+    return rc;
+}
+
 static int
 __on_connack(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
 
     mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received CONNACK (a%d, c%d)", p->v.connack.ack_flags, p->v.connack.return_code);
+    __trace(mqtt, LIBMQTT_TRACE_RECV, CONNACK, p->v.connack.ack_flags << 8 | p->v.connack.return_code, 0, 0, 0, 0, 0);
+    if (MQTT_PROPERTY_HAS(&p->props, PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE)) {
+        mqtt->sub.available = p->props.subscription_identifier_available;
+    }
+    if (MQTT_PROPERTY_HAS(&p->props, PROPERTY_TOPIC_ALIAS_MAXIMUM)) {
+        mqtt->alias.broker = p->props.topic_alias_maximum;
+        mqtt->alias.max = mqtt->alias.broker < mqtt->alias.cap ? mqtt->alias.broker : mqtt->alias.cap;
+    }
     if (mqtt->cb.connack)
         mqtt->cb.connack(mqtt, mqtt->ud, p->v.connack.ack_flags, p->v.connack.return_code);
     return 0;
@@ -379,7 +1315,7 @@ __on_suback(void *ud, struct mqtt_packet *p) {
 
     mqtt = (struct libmqtt *)ud;
     for (i = 0; i < p->v.suback.n; i++) {
-        __log(mqtt, "received SUBACK (id: %"PRIu16", QoS: %d)", p->v.suback.packet_id, p->v.suback.qos[i]);
+        __trace(mqtt, LIBMQTT_TRACE_RECV, SUBACK, p->v.suback.qos[i], p->v.suback.packet_id, 0, 0, 0, 0);
     }
     if (mqtt->cb.suback)
         mqtt->cb.suback(mqtt, mqtt->ud, p->v.suback.packet_id, p->v.suback.n, p->v.suback.qos);
@@ -391,49 +1327,145 @@ __on_unsuback(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
 
     mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received UNSUBACK (id: %"PRIu16")", p->v.unsuback.packet_id);
+    __trace(mqtt, LIBMQTT_TRACE_RECV, UNSUBACK, 0, p->v.unsuback.packet_id, 0, 0, 0, 0);
     if (mqtt->cb.unsuback)
         mqtt->cb.unsuback(mqtt, mqtt->ud, p->v.unsuback.packet_id);
     return 0;
 }
 
+/* the received topic NUL terminated in the read arena. the client announces no Topic Alias
+ * Maximum and keeps no inbound alias map, so an inbound alias is a protocol error. */
+static char *
+__topic(struct libmqtt *mqtt, struct mqtt_packet *p) {
+    char *topic;
+
+    if (MQTT_PROPERTY_HAS(&p->props, PROPERTY_TOPIC_ALIAS) || p->v.publish.topic_name.n == 0)
+        return 0;
+    topic = mqtt__arena_alloc(&mqtt->arena, p->v.publish.topic_name.n + 1);
+    if (topic) {
+        if (p->v.publish.topic_name.n > 0)
+            memcpy(topic, p->v.publish.topic_name.s, p->v.publish.topic_name.n);
+        topic[p->v.publish.topic_name.n] = '\0';
+    }
+    return topic;
+}
+
+/* collected payloads must outlive a packet reassembled in the parser buffer. */
+static int
+__keep_payload(struct libmqtt *mqtt, struct mqtt_packet *p) {
+    char *s;
+
+    if (!mqtt->cb.publish_batch || p->payload.n == 0
+        || (p->payload.s >= mqtt->inbox.data && p->payload.s < mqtt->inbox.data + mqtt->inbox.size))
+        return 0;
+    s = mqtt__arena_alloc(&mqtt->arena, p->payload.n);
+    if (!s) return -1;
+    memcpy(s, p->payload.s, p->payload.n);
+    p->payload.s = s;
+    return 0;
+}
+
 static int
 __on_publish(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
     char puback[] = MQTT_PUBACK(p->v.publish.packet_id);
     char pubrec[] = MQTT_PUBREC(p->v.publish.packet_id);
-    char topic[p->v.publish.topic_name.n+1];
+    char *topic;
+    int rc;
 
-    strncpy(topic, p->v.publish.topic_name.s, p->v.publish.topic_name.n);
-    topic[p->v.publish.topic_name.n] = '\0';
     mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
-          p->h.dup, p->h.qos, p->h.retain, p->v.publish.packet_id, topic, p->payload.n);
+    if (!(topic = __topic(mqtt, p)))
+        return -1;
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PUBLISH, p->h.dup << 3 | p->h.qos << 1 | p->h.retain, p->v.publish.packet_id,
+            topic, -1, p->payload.s, p->payload.n);
     switch (p->h.qos) {
         case MQTT_QOS_0:
-            if (mqtt->cb.publish)
-                mqtt->cb.publish(mqtt, mqtt->ud, p->v.publish.packet_id, topic, p->h.qos, p->h.retain, p->payload.s, p->payload.n);
-            return 0;
+            if (__keep_payload(mqtt, p))
+                return -1;
+            rc = __dispatch(mqtt, p->v.publish.packet_id, topic, p->v.publish.topic_name.n, p->h.qos, p->h.retain,
+                            p->payload.s, p->payload.n, p->props.subscription_identifier, p->props.subscription_identifier_n);
+            return rc < 0 ? -1 : 0;
         case MQTT_QOS_1:
-            if (mqtt->cb.publish)
-                mqtt->cb.publish(mqtt, mqtt->ud, p->v.publish.packet_id, topic, p->h.qos, p->h.retain, p->payload.s, p->payload.n);
+            if (__keep_payload(mqtt, p))
+                return -1;
+            rc = __dispatch(mqtt, p->v.publish.packet_id, topic, p->v.publish.topic_name.n, p->h.qos, p->h.retain,
+                            p->payload.s, p->payload.n, p->props.subscription_identifier, p->props.subscription_identifier_n);
+            if (rc) {
+                /* PUBACK is sent by __deliver. */
+                return rc < 0 ? -1 : 0;
+            }
             if (__write(mqtt, puback, sizeof puback)) {
-                return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBACK);
+                return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBACK, 0);
             }
-            __log(mqtt, "sending PUBACK (id: %"PRIu16")", p->v.publish.packet_id);
+            __trace(mqtt, LIBMQTT_TRACE_SEND, PUBACK, 0, p->v.publish.packet_id, 0, 0, 0, 0);
             return 0;
         case MQTT_QOS_2:
             if (__write(mqtt, pubrec, sizeof pubrec)) {
-                return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBREC);
+                return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBREC, 0);
             }
-            __log(mqtt, "sending PUBREC (id: %"PRIu16")", p->v.publish.packet_id);
-            return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_WAIT_PUBREL);
+            __trace(mqtt, LIBMQTT_TRACE_SEND, PUBREC, 0, p->v.publish.packet_id, 0, 0, 0, 0);
+            return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_WAIT_PUBREL, 0);
         case MQTT_QOS_F:
             return -1;
     }
     return 0;
 }
 
+static int
+__on_publish_begin(void *ud, struct mqtt_packet *p) {
+    struct libmqtt *mqtt;
+    char *topic;
+
+    mqtt = (struct libmqtt *)ud;
+    if (!(topic = __topic(mqtt, p)))
+        return -1;
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PUBLISH, LIBMQTT_TRACE_STREAMED | p->h.dup << 3 | p->h.qos << 1 | p->h.retain,
+            p->v.publish.packet_id, topic, -1, 0, p->payload.n);
+    mqtt->stream.begin(mqtt, mqtt->ud, p->v.publish.packet_id, topic, p->h.qos, p->h.retain, p->payload.n);
+    return 0;
+}
+
+static int
+__on_publish_chunk(void *ud, struct mqtt_packet *p) {
+    struct libmqtt *mqtt;
+
+    mqtt = (struct libmqtt *)ud;
+    mqtt->stream.chunk(mqtt, mqtt->ud, p->v.publish.packet_id, p->payload.s, p->payload.n);
+    return 0;
+}
+
+/* the message is delivered at end, PUBREL of a streamed QoS 2 only completes the handshake. */
+static int
+__on_publish_end(void *ud, struct mqtt_packet *p) {
+    struct libmqtt *mqtt;
+    char puback[] = MQTT_PUBACK(p->v.publish.packet_id);
+    char pubrec[] = MQTT_PUBREC(p->v.publish.packet_id);
+
+    mqtt = (struct libmqtt *)ud;
+    mqtt->stream.end(mqtt, mqtt->ud, p->v.publish.packet_id);
+    switch (p->h.qos) {
+        case MQTT_QOS_1:
+            if (__write(mqtt, puback, sizeof puback)) {
+                return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBACK, 0);
+            }
+            __trace(mqtt, LIBMQTT_TRACE_SEND, PUBACK, 0, p->v.publish.packet_id, 0, 0, 0, 0);
+            return 0;
+        case MQTT_QOS_2:
+            if (__write(mqtt, pubrec, sizeof pubrec)) {
+                if (__insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBREC, 0))
+                    return -1;
+            } else {
+                __trace(mqtt, LIBMQTT_TRACE_SEND, PUBREC, 0, p->v.publish.packet_id, 0, 0, 0, 0);
+                if (__insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_WAIT_PUBREL, 0))
+                    return -1;
+            }
+            mqtt->pub.tail->streamed = 1;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
 static int
 __on_puback(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
@@ -441,9 +1473,10 @@ __on_puback(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.puback.packet_id;
 
     mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received PUBACK (id: %"PRIu16")", packet_id);
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PUBACK, 0, packet_id, 0, 0, 0, 0);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBACK);
     if (pub) {
+        __hist_add(&mqtt->latency.puback, __now_us() - pub->us);
         if (mqtt->cb.puback)
             mqtt->cb.puback(mqtt, mqtt->ud, packet_id);
         __delete_pub(mqtt, pub);
@@ -459,14 +1492,14 @@ __on_pubrec(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.pubrec.packet_id;
 
     mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received PUBREC (id: %"PRIu16")", packet_id);
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PUBREC, 0, packet_id, 0, 0, 0, 0);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBREC);
     if (pub) {
         char pubrel[] = MQTT_PUBREL(packet_id);
         if (__write(mqtt, pubrel, sizeof pubrel)) {
             __update_pub(mqtt, pub, LIBMQTT_ST_SEND_PUBREL);
         } else {
-            __log(mqtt, "sending PUBREL (id: %"PRIu16")", packet_id);
+            __trace(mqtt, LIBMQTT_TRACE_SEND, PUBREL, 0, packet_id, 0, 0, 0, 0);
             __update_pub(mqtt, pub, LIBMQTT_ST_WAIT_PUBCOMP);
         }
         return 0;
@@ -481,54 +1514,178 @@ __on_pubrel(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.pubrel.packet_id;
 
     mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received PUBREL (id: %"PRIu16")", packet_id);
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PUBREL, 0, packet_id, 0, 0, 0, 0);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_IN, LIBMQTT_ST_WAIT_PUBREL);
     if (pub) {
         char pubcomp[] = MQTT_PUBCOMP(packet_id);
-        if (mqtt->cb.publish)
-            mqtt->cb.publish(mqtt, mqtt->ud, packet_id, pub->p.topic, pub->p.qos, pub->p.retain, pub->p.payload, pub->p.length);
+        int rc;
+
+        rc = 0;
+        if (!pub->streamed)
+            rc = __dispatch(mqtt, packet_id, pub->p.topic, strlen(pub->p.topic), pub->p.qos, pub->p.retain,
+                            pub->p.payload, pub->p.length, pub->p.sub_id, pub->p.sub_n);
+        if (rc < 0)
+            return -1;
+        if (rc) {
+            /* the message stays alive until __deliver sends PUBCOMP. */
+            mqtt->inbox.pub[mqtt->inbox.n - 1] = pub;
+            __update_pub(mqtt, pub, LIBMQTT_ST_SEND_PUBCOMP);
+            return 0;
+        }
         if (__write(mqtt, pubcomp, sizeof pubcomp)) {
             __update_pub(mqtt, pub, LIBMQTT_ST_SEND_PUBCOMP);
         } else {
-            __log(mqtt, "sending PUBCOMP (id: %"PRIu16")", packet_id);
+            __trace(mqtt, LIBMQTT_TRACE_SEND, PUBCOMP, 0, packet_id, 0, 0, 0, 0);
             __delete_pub(mqtt, pub);
         }
         return 0;
     }
-    return -1;
+    return -1;
+}
+
+static int
+__on_pubcomp(void *ud, struct mqtt_packet *p) {
+    struct libmqtt *mqtt;
+    struct libmqtt_pub *pub;
+    uint16_t packet_id = p->v.pubcomp.packet_id;
+
+    mqtt = (struct libmqtt *)ud;
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PUBCOMP, 0, packet_id, 0, 0, 0, 0);
+    pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBCOMP);
+    if (pub) {
+        __hist_add(&mqtt->latency.pubcomp, __now_us() - pub->us);
+        if (mqtt->cb.puback)
+            mqtt->cb.puback(mqtt, mqtt->ud, packet_id);
+        __delete_pub(mqtt, pub);
+        return 0;
+    }
+    return -1;
+}
+
+static int
+__on_pingresp(void *ud, struct mqtt_packet *p) {
+    struct libmqtt *mqtt;
+    (void)p;
+
+    mqtt = (struct libmqtt *)ud;
+    __trace(mqtt, LIBMQTT_TRACE_RECV, PINGRESP, 0, 0, 0, 0, 0, 0);
+    mqtt->t.ping = 0;
+    if (mqtt->t.ping_us > 0) {
+        mqtt->stats.ping_rtt = __now_us() - mqtt->t.ping_us;
+        mqtt->t.ping_us = 0;
+    }
+    return 0;
+}
+
+const char *libmqtt__client_id(struct libmqtt *mqtt) {
+    return mqtt->c.client_id.s;
+}
+
+void libmqtt__debug(struct libmqtt *mqtt, void (* log)(void *ud, const char *str)) {
+    mqtt->log = log;
+}
+
+int libmqtt__trace(struct libmqtt *mqtt, int records) {
+    struct libmqtt_trace *v;
+    uint32_t cap;
+
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (records > (1 << 24))
+        records = 1 << 24;
+    v = 0;
+    cap = 0;
+    if (records > 0) {
+        for (cap = 1; cap < (uint32_t)records; cap <<= 1)
+            ;
+        v = (struct libmqtt_trace *)mqtt__malloc(cap * sizeof *v);
+        if (!v) {
+            return LIBMQTT_ERROR_MALLOC;
+        }
+    }
+    mqtt__free(mqtt->trace.v);
+    mqtt->trace.v = v;
+    mqtt->trace.mask = cap - 1;
+    mqtt->trace.head = 0;
+    mqtt->trace.tail = 0;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__trace_drain(struct libmqtt *mqtt, struct libmqtt_trace *v, int n) {
+    uint32_t head, tail;
+    int i;
+
+    if (!mqtt || !v) {
+        return 0;
+    }
+    if (!mqtt->trace.v) {
+        return 0;
+    }
+    tail = mqtt->trace.tail;
+    head = __atomic_load_n(&mqtt->trace.head, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n && tail != head; i++, tail++)
+        v[i] = mqtt->trace.v[tail & mqtt->trace.mask];
+    __atomic_store_n(&mqtt->trace.tail, tail, __ATOMIC_RELEASE);
+    return i;
 }
 
-static int
-__on_pubcomp(void *ud, struct mqtt_packet *p) {
-    struct libmqtt *mqtt;
-    struct libmqtt_pub *pub;
-    uint16_t packet_id = p->v.pubcomp.packet_id;
+int libmqtt__trace_format(const struct libmqtt_trace *t, char *buf, int size) {
+    return __trace_format(t, 0, buf, size);
+}
 
-    mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received PUBCOMP (id: %"PRIu16")", packet_id);
-    pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBCOMP);
-    if (pub) {
-        if (mqtt->cb.puback)
-            mqtt->cb.puback(mqtt, mqtt->ud, packet_id);
-        __delete_pub(mqtt, pub);
-        return 0;
+int libmqtt__recorder(struct libmqtt *mqtt, int records, int payload, const char *path) {
+    char *v, *p;
+    uint32_t cap;
+    int size;
+
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
     }
-    return -1;
+    if (records > (1 << 20))
+        records = 1 << 20;
+    if (payload < 0)
+        payload = 0;
+    if (payload > LIBMQTT_RECORDER_PAYLOAD)
+        payload = LIBMQTT_RECORDER_PAYLOAD;
+    size = (sizeof(struct libmqtt_record) + payload + 7) & ~7;
+    v = 0;
+    p = 0;
+    cap = 0;
+    if (records > 0) {
+        for (cap = 1; cap < (uint32_t)records; cap <<= 1)
+            ;
+        v = (char *)mqtt__malloc((size_t)cap * size);
+        if (!v) {
+            return LIBMQTT_ERROR_MALLOC;
+        }
+        memset(v, 0, (size_t)cap * size);
+        if (path && !(p = mqtt__strdup(path))) {
+            mqtt__free(v);
+            return LIBMQTT_ERROR_MALLOC;
+        }
+    }
+    mqtt__free(mqtt->rec.v);
+    mqtt__free(mqtt->rec.path);
+    mqtt->rec.v = v;
+    mqtt->rec.path = p;
+    mqtt->rec.mask = cap - 1;
+    mqtt->rec.size = size;
+    mqtt->rec.payload = payload;
+    mqtt->rec.pos = 0;
+    return LIBMQTT_SUCCESS;
 }
 
-static int
-__on_pingresp(void *ud, struct mqtt_packet *p) {
-    struct libmqtt *mqtt;
-    (void)p;
-
-    mqtt = (struct libmqtt *)ud;
-    __log(mqtt, "received PINGRESP");
-    mqtt->t.ping = 0;
-    return 0;
+int libmqtt__recorder_dump(struct libmqtt *mqtt, const char *path) {
+    if (!mqtt || !path) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    return __recorder_dump(mqtt, path, 0);
 }
 
-void libmqtt__debug(struct libmqtt *mqtt, void (* log)(void *ud, const char *str)) {
-    mqtt->log = log;
+int libmqtt__set_allocator(mqtt_malloc_fn m, mqtt_realloc_fn r, mqtt_free_fn f, void *ud) {
+    mqtt__set_allocator(m, r, f, ud);
+    return LIBMQTT_SUCCESS;
 }
 
 int libmqtt__create(struct libmqtt **mqtt, const char *client_id, void *ud, struct libmqtt_cb *cb) {
@@ -539,19 +1696,28 @@ int libmqtt__create(struct libmqtt **mqtt, const char *client_id, void *ud, stru
         rc = LIBMQTT_ERROR_NULL;
         goto e1;
     }
+    if (__mqtt_utf8 && !mqtt__utf8_valid(client_id, strlen(client_id))) {
+        rc = LIBMQTT_ERROR_UTF8;
+        goto e1;
+    }
 
-    if ((*mqtt = malloc(sizeof(struct libmqtt))) == 0) {
+    if ((*mqtt = mqtt__malloc(sizeof(struct libmqtt))) == 0) {
         rc = LIBMQTT_ERROR_MALLOC;
         goto e1;
     }
     memset(*mqtt, 0, sizeof(struct libmqtt));
 
-    mqtt_b_dup(&(*mqtt)->c.client_id, client_id);
-    if (mqtt_b_empty(&(*mqtt)->c.client_id)) {
+    if (mqtt_b_dup(&(*mqtt)->c.client_id, client_id)) {
         rc = LIBMQTT_ERROR_MALLOC;
         goto e2;
     }
 
+    (*mqtt)->sub.tree = mqtt__trie_create();
+    if (!(*mqtt)->sub.tree) {
+        rc = LIBMQTT_ERROR_MALLOC;
+        goto e3;
+    }
+
     mqtt__parse_init(&(*mqtt)->p);
     mqtt__parse_cb(&(*mqtt)->p, CONNACK, __on_connack);
     mqtt__parse_cb(&(*mqtt)->p, SUBACK, __on_suback);
@@ -571,11 +1737,18 @@ int libmqtt__create(struct libmqtt **mqtt, const char *client_id, void *ud, stru
     (*mqtt)->c.keep_alive = LIBMQTT_DEF_KEEPALIVE;
     (*mqtt)->c.clean_sess = 1;
     (*mqtt)->c.proto_ver = MQTT_PROTO_V4;
+    (*mqtt)->alias.cap = LIBMQTT_DEF_TOPIC_ALIAS;
+    (*mqtt)->sub.available = 1;
+    (*mqtt)->alias.head = -1;
+    (*mqtt)->alias.tail = -1;
+    __memory_strings(*mqtt);
 
     return LIBMQTT_SUCCESS;
 
+e3:
+    mqtt_b_free(&(*mqtt)->c.client_id);
 e2:
-    free(*mqtt);
+    mqtt__free(*mqtt);
 e1:
     return rc;
 }
@@ -590,7 +1763,28 @@ int libmqtt__destroy(struct libmqtt *mqtt) {
     mqtt_b_free(&mqtt->c.password);
     mqtt_b_free(&mqtt->c.will_topic);
     mqtt_b_free(&mqtt->c.will_payload);
-    free(mqtt);
+    __alias_reset(mqtt);
+    while (mqtt->pub.head)
+        __unlink_pub(mqtt, &mqtt->pub.head);
+    while (mqtt->sub.head) {
+        struct libmqtt_sub *sub;
+        sub = mqtt->sub.head;
+        mqtt->sub.head = sub->next;
+        mqtt__free(sub->topic);
+        mqtt__free(sub);
+    }
+    mqtt__free(mqtt->sub.v);
+    mqtt__trie_destroy(mqtt->sub.tree);
+    mqtt__free(mqtt->out.s);
+    mqtt__parse_free(&mqtt->p);
+    mqtt__arena_free(&mqtt->arena);
+    mqtt__free(mqtt->inbox.v);
+    mqtt__free(mqtt->inbox.pub);
+    mqtt__free(mqtt->trace.v);
+    mqtt__free(mqtt->rec.v);
+    mqtt__free(mqtt->rec.path);
+    __atomic_sub_fetch(&__memory_total, mqtt->mem.total, __ATOMIC_RELAXED);
+    mqtt__free(mqtt);
     return LIBMQTT_SUCCESS;
 }
 
@@ -618,6 +1812,145 @@ int libmqtt__clean_sess(struct libmqtt *mqtt, int clean_sess) {
     return LIBMQTT_SUCCESS;
 }
 
+int libmqtt__topic_alias(struct libmqtt *mqtt, uint16_t max) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->alias.cap = max;
+    if (mqtt->alias.max > max)
+        __alias_trim(mqtt, max);
+    else
+        mqtt->alias.max = mqtt->alias.broker < max ? mqtt->alias.broker : max;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__linger(struct libmqtt *mqtt, int usec, int bytes) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->linger.usec = usec > 0 ? usec : 0;
+    mqtt->linger.bytes = bytes > 0 ? bytes : 0;
+    if (mqtt->out.n > 0)
+        mqtt->out.since = __now_us();
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__publish_stream(struct libmqtt *mqtt, int size, libmqtt__on_publish_begin begin,
+                            libmqtt__on_publish_chunk chunk, libmqtt__on_publish_end end) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (size > 0 && (!begin || !chunk || !end)) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->stream.begin = begin;
+    mqtt->stream.chunk = chunk;
+    mqtt->stream.end = end;
+    mqtt__parse_stream(&mqtt->p, size, __on_publish_begin, __on_publish_chunk, __on_publish_end);
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__max_packet(struct libmqtt *mqtt, int size, int skip) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt__parse_limit(&mqtt->p, size, skip);
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__budget(struct libmqtt *mqtt, struct mqtt_budget *budget) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt__parse_budget(&mqtt->p, budget);
+    return LIBMQTT_SUCCESS;
+}
+
+const struct mqtt_parse_stats *libmqtt__parse_stats(struct libmqtt *mqtt) {
+    if (!mqtt) {
+        return 0;
+    }
+    return &mqtt->p.stats;
+}
+
+int libmqtt__stats(struct libmqtt *mqtt, struct libmqtt_stats *stats) {
+    if (!mqtt || !stats) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    *stats = mqtt->stats;
+    memcpy(stats->received, mqtt->p.stats.type, sizeof stats->received);
+    memcpy(stats->received_bytes, mqtt->p.stats.bytes, sizeof stats->received_bytes);
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__memory(struct libmqtt *mqtt, struct libmqtt_memory *mem) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    *mem = mqtt->mem;
+    return LIBMQTT_SUCCESS;
+}
+
+int64_t libmqtt__memory_total(void) {
+    return __atomic_load_n(&__memory_total, __ATOMIC_RELAXED);
+}
+
+int libmqtt__latency(struct libmqtt *mqtt, struct libmqtt_hist *puback, struct libmqtt_hist *pubcomp) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (puback)
+        *puback = mqtt->latency.puback;
+    if (pubcomp)
+        *pubcomp = mqtt->latency.pubcomp;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__latency_reset(struct libmqtt *mqtt) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    memset(&mqtt->latency, 0, sizeof mqtt->latency);
+    return LIBMQTT_SUCCESS;
+}
+
+void libmqtt__hist_add(struct libmqtt_hist *h, int64_t us) {
+    __hist_add(h, us);
+}
+
+void libmqtt__hist_merge(struct libmqtt_hist *to, const struct libmqtt_hist *from) {
+    int i;
+
+    if (from->count == 0)
+        return;
+    if (to->count == 0 || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->count += from->count;
+    to->sum += from->sum;
+    for (i = 0; i < LIBMQTT_HIST_BUCKETS; i++)
+        to->v[i] += from->v[i];
+}
+
+uint64_t libmqtt__hist_percentile(const struct libmqtt_hist *h, double percentile) {
+    uint64_t want, seen;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    want = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (want < 1)
+        want = 1;
+    seen = 0;
+    for (i = 0; i < LIBMQTT_HIST_BUCKETS; i++) {
+        seen += h->v[i];
+        if (seen >= want)
+            return __hist_value(i) < h->max ? __hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
 int libmqtt__version(struct libmqtt *mqtt, enum mqtt_vsn vsn) {
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
@@ -633,40 +1966,51 @@ int libmqtt__auth(struct libmqtt *mqtt, const char *username, const char *passwo
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
     }
+    if (__mqtt_utf8 && username && !mqtt__utf8_valid(username, strlen(username))) {
+        return LIBMQTT_ERROR_UTF8;
+    }
     mqtt_b_free(&mqtt->c.username);
     mqtt_b_free(&mqtt->c.password);
-    if (username) {
-        mqtt_b_dup(&mqtt->c.username, username);
-        if (mqtt_b_empty(&mqtt->c.username)) {
-            return LIBMQTT_ERROR_MALLOC;
-        }
-    }
-    if (password) {
-        mqtt_b_dup(&mqtt->c.password, password);
-        if (mqtt_b_empty(&mqtt->c.username)) {
-            return LIBMQTT_ERROR_MALLOC;
-        }
+    if (mqtt_b_dup(&mqtt->c.username, username) || mqtt_b_dup(&mqtt->c.password, password)) {
+        mqtt_b_free(&mqtt->c.username);
+        __memory_strings(mqtt);
+        return LIBMQTT_ERROR_MALLOC;
     }
+    __memory_strings(mqtt);
     return LIBMQTT_SUCCESS;
 }
 
 int libmqtt__will(struct libmqtt *mqtt, int retain, enum mqtt_qos qos, const char *topic,
                   const char *payload, int payload_len) {
+    int rc;
+
     if (!topic) {
         mqtt->c.will_flag = 0;
         return LIBMQTT_SUCCESS;
     }
-    mqtt->c.will_flag = 1;
-    mqtt->c.will_retain = retain;
-    mqtt->c.will_qos = qos;
+    if ((rc = __topic_check(topic, strlen(topic)))) {
+        return rc;
+    }
     mqtt_b_free(&mqtt->c.will_topic);
     mqtt_b_free(&mqtt->c.will_payload);
-    mqtt_b_dup(&mqtt->c.will_topic, topic);
+    mqtt->c.will_flag = 0;
+    if (mqtt_b_dup(&mqtt->c.will_topic, topic)) {
+        __memory_strings(mqtt);
+        return LIBMQTT_ERROR_MALLOC;
+    }
     if (payload && payload_len > 0) {
-        mqtt->c.will_payload.s = malloc(payload_len);
+        if (!(mqtt->c.will_payload.s = mqtt__malloc(payload_len))) {
+            mqtt_b_free(&mqtt->c.will_topic);
+            __memory_strings(mqtt);
+            return LIBMQTT_ERROR_MALLOC;
+        }
         memcpy(mqtt->c.will_payload.s, payload, payload_len);
         mqtt->c.will_payload.n = payload_len;
     }
+    mqtt->c.will_flag = 1;
+    mqtt->c.will_retain = retain;
+    mqtt->c.will_qos = qos;
+    __memory_strings(mqtt);
     return LIBMQTT_SUCCESS;
 }
 
@@ -680,12 +2024,21 @@ int libmqtt__connect(struct libmqtt *mqtt, void *io, libmqtt__io_write write) {
     }
     mqtt->io = io;
     mqtt->io_write = write;
+    mqtt->out.n = 0;
+    mqtt->p.vsn = mqtt->c.proto_ver;
+    mqtt->sub.available = 1;
+    __alias_reset(mqtt);
 
     memset(&p, 0, sizeof p);
     p.h.type = CONNECT;
+    p.vsn = mqtt->c.proto_ver;
     p.v.connect = mqtt->c;
     p.v.connect.proto_name.s = (char *)MQTT_PROTOCOL_NAMES[mqtt->c.proto_ver];
     p.v.connect.proto_name.n = strlen(p.v.connect.proto_name.s);
+    if (mqtt->p.max_size > 0) {
+        p.props.mask |= MQTT_PROPERTY_BIT(PROPERTY_MAXIMUM_PACKET_SIZE);
+        p.props.maximum_packet_size = mqtt->p.max_size;
+    }
 
     if (mqtt__serialize(&p, &b)) {
         return LIBMQTT_ERROR_MALLOC;
@@ -696,25 +2049,25 @@ int libmqtt__connect(struct libmqtt *mqtt, void *io, libmqtt__io_write write) {
     if (rc) {
         return LIBMQTT_ERROR_WRITE;
     }
-    __log(mqtt, "sending CONNECT (%s, c%d, k%d, u\'%.*s\', p\'%.*s\')", MQTT_PROTOCOL_NAMES[mqtt->c.proto_ver],
-          mqtt->c.clean_sess, mqtt->c.keep_alive, mqtt->c.username.n, mqtt->c.username.s,
-          mqtt->c.password.n, mqtt->c.password.s);
+    __trace(mqtt, LIBMQTT_TRACE_SEND, CONNECT, mqtt->c.proto_ver << 8 | (mqtt->c.clean_sess ? 1 : 0), mqtt->c.keep_alive,
+            0, 0, 0, 0);
     return LIBMQTT_SUCCESS;
 }
 
-int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[], enum mqtt_qos qos[]) {
+static int
+__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[], enum mqtt_qos qos[], uint32_t sub_id) {
     struct mqtt_packet p;
     struct mqtt_b b;
     int rc, i;
 
-    if (!mqtt) {
-        return LIBMQTT_ERROR_NULL;
-    }
-    if (count > MQTT_MAX_SUB) {
-        return LIBMQTT_ERROR_MAXSUB;
-    }
     memset(&p, 0, sizeof p);
     p.h.type = SUBSCRIBE;
+    p.vsn = mqtt->c.proto_ver;
+    if (sub_id > 0) {
+        p.props.mask |= MQTT_PROPERTY_BIT(PROPERTY_SUBSCRIPTION_IDENTIFIER);
+        p.props.subscription_identifier[0] = sub_id;
+        p.props.subscription_identifier_n = 1;
+    }
     p.v.subscribe.packet_id = __generate_packet_id(mqtt);
     for (i = 0; i < count; i++) {
         p.v.subscribe.topic_name[i].s = (char *)topic[i];
@@ -736,12 +2089,55 @@ int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char
         return LIBMQTT_ERROR_WRITE;
     }
     for (i = 0; i < count; i++) {
-        __log(mqtt, "Sending SUBSCRIBE (id: %"PRIu16", topic: %s, qos: %d)",
-              p.v.subscribe.packet_id, topic[i], qos[i]);
+        __trace(mqtt, LIBMQTT_TRACE_SEND, SUBSCRIBE, qos[i], p.v.subscribe.packet_id, topic[i], -1, 0, 0);
     }
     return LIBMQTT_SUCCESS;
 }
 
+int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[], enum mqtt_qos qos[]) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (count > MQTT_MAX_SUB) {
+        return LIBMQTT_ERROR_MAXSUB;
+    }
+    return __subscribe(mqtt, id, count, topic, qos, 0);
+}
+
+int libmqtt__subscribe_cb(struct libmqtt *mqtt, uint16_t *id, const char *topic, enum mqtt_qos qos,
+                          libmqtt__on_publish cb, void *ud) {
+    struct libmqtt_sub *sub;
+    uint32_t sub_id;
+    int rc, n, created;
+
+    if (!mqtt || !topic || !cb) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    n = strlen(topic);
+    if (!mqtt__topic_valid(topic, n, 1)) {
+        return LIBMQTT_ERROR_TOPIC;
+    }
+    created = 0;
+    sub = __find_sub(mqtt, topic, n);
+    if (!sub) {
+        sub = __insert_sub(mqtt, topic, n);
+        if (!sub) {
+            return LIBMQTT_ERROR_MALLOC;
+        }
+        created = 1;
+    }
+    sub->cb = cb;
+    sub->ud = ud;
+    sub_id = 0;
+    if (mqtt->c.proto_ver == MQTT_PROTO_V5 && mqtt->sub.available)
+        sub_id = sub->id;
+    rc = __subscribe(mqtt, id, 1, &topic, &qos, sub_id);
+    if (rc && created) {
+        __delete_sub(mqtt, sub);
+    }
+    return rc;
+}
+
 int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[]) {
     struct mqtt_packet p;
     struct mqtt_b b;
@@ -755,6 +2151,7 @@ int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const ch
     }
     memset(&p, 0, sizeof p);
     p.h.type = UNSUBSCRIBE;
+    p.vsn = mqtt->c.proto_ver;
     p.v.unsubscribe.packet_id = __generate_packet_id(mqtt);
     for (i = 0; i < count; i++) {
         p.v.unsubscribe.topic_name[i].s = (char *)topic[i];
@@ -775,48 +2172,69 @@ int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const ch
         return LIBMQTT_ERROR_WRITE;
     }
     for (i = 0; i < count; i++) {
-        __log(mqtt, "Sending UNSUBSCRIBE (id: %"PRIu16", topic: %s)",
-              p.v.unsubscribe.packet_id, topic[i]);
+        struct libmqtt_sub *sub;
+
+        __trace(mqtt, LIBMQTT_TRACE_SEND, UNSUBSCRIBE, 0, p.v.unsubscribe.packet_id, topic[i], -1, 0, 0);
+        sub = __find_sub(mqtt, topic[i], p.v.unsubscribe.topic_name[i].n);
+        if (sub)
+            __delete_sub(mqtt, sub);
     }
     return LIBMQTT_SUCCESS;
 }
 
-int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic,
-                     enum mqtt_qos qos, int retain, const char *payload, int length) {
+static int
+__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic, int n, struct libmqtt_topic *h,
+          enum mqtt_qos qos, int retain, const char *payload, int length) {
+    struct mqtt_p_publish *c;
     struct mqtt_packet p;
     struct mqtt_b b;
     enum libmqtt_state s;
-    int rc;
+    uint16_t alias;
+    int rc, hit;
 
-    if (!mqtt) {
-        return LIBMQTT_ERROR_NULL;
-    }
     if (!MQTT_IS_QOS(qos)) {
         return LIBMQTT_ERROR_QOS;
     }
     memset(&p, 0, sizeof p);
+    c = &p.v.publish;
     p.h.type = PUBLISH;
     p.h.dup = 0;
     p.h.retain = retain;
     p.h.qos = qos;
-    p.v.publish.packet_id = __generate_packet_id(mqtt);
-    p.v.publish.topic_name.s = (char *)topic;
-    p.v.publish.topic_name.n = strlen(topic);
+    p.vsn = mqtt->c.proto_ver;
+    c->packet_id = __generate_packet_id(mqtt);
+    c->topic_name.s = (char *)topic;
+    c->topic_name.n = n;
+    if (h)
+        c->topic_enc = h->enc;
     p.payload.s = (char *)payload;
     p.payload.n = length;
 
+    alias = __alias_get(mqtt, topic, n, &hit);
+    if (alias) {
+        p.props.mask |= MQTT_PROPERTY_BIT(PROPERTY_TOPIC_ALIAS);
+        p.props.topic_alias = alias;
+        if (hit)
+            c->topic_name.n = 0;
+    }
+
     if (mqtt__serialize(&p, &b)) {
+        if (alias && !hit)
+            __alias_drop(mqtt, alias);
         return LIBMQTT_ERROR_MALLOC;
     }
+    c->topic_name.n = n;
 
     if (id) {
-        *id = p.v.publish.packet_id;
+        *id = c->packet_id;
     }
     rc = __write(mqtt, b.s, b.n);
     mqtt_b_free(&b);
+    if (rc && alias && !hit) {
+        __alias_drop(mqtt, alias);
+    }
     if (!rc) {
-        __log(mqtt, "sending PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
-              0, qos, retain, p.v.publish.packet_id, topic, length);
+        __trace(mqtt, LIBMQTT_TRACE_SEND, PUBLISH, qos << 1 | retain, p.v.publish.packet_id, topic, -1, payload, length);
     }
     if (!rc && qos == MQTT_QOS_0) {
         if (mqtt->cb.puback)
@@ -832,12 +2250,219 @@ int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic,
     } else {
         return LIBMQTT_ERROR_QOS;
     }
-    if (__insert_pub(mqtt, &p, LIBMQTT_DIR_OUT, s)) {
+    if (__insert_pub(mqtt, &p, LIBMQTT_DIR_OUT, s, h)) {
+        return LIBMQTT_ERROR_MALLOC;
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic,
+                     enum mqtt_qos qos, int retain, const char *payload, int length) {
+    int n, rc;
+
+    if (!mqtt || !topic) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    n = strlen(topic);
+    if ((rc = __topic_check(topic, n))) {
+        return rc;
+    }
+    return __publish(mqtt, id, topic, n, 0, qos, retain, payload, length);
+}
+
+struct libmqtt_batch {
+    uint16_t id;
+    uint16_t alias;
+    int hit;
+    int size;
+    struct libmqtt_pub *pub;
+};
+
+static void
+__batch_packet(struct libmqtt *mqtt, const struct libmqtt_msg *msg, struct libmqtt_batch *m,
+               uint16_t packet_id, struct mqtt_packet *p) {
+    struct mqtt_p_publish *c;
+
+    memset(&p->h, 0, sizeof p->h);
+    p->props.mask = 0;
+    p->h.type = PUBLISH;
+    p->h.retain = msg->retain;
+    p->h.qos = msg->qos;
+    p->vsn = mqtt->c.proto_ver;
+    c = &p->v.publish;
+    c->packet_id = packet_id;
+    if (msg->h) {
+        c->topic_name.s = msg->h->name;
+        c->topic_name.n = msg->h->n;
+        c->topic_enc = msg->h->enc;
+    } else {
+        c->topic_name.s = (char *)msg->topic;
+        c->topic_name.n = strlen(msg->topic);
+        c->topic_enc = 0;
+    }
+    p->payload.s = (char *)msg->payload;
+    p->payload.n = msg->length;
+    if (m->alias) {
+        p->props.mask |= MQTT_PROPERTY_BIT(PROPERTY_TOPIC_ALIAS);
+        p->props.topic_alias = m->alias;
+    }
+}
+
+int libmqtt__publish_batch(struct libmqtt *mqtt, const struct libmqtt_msg *msgs, int n, uint16_t *ids) {
+    struct libmqtt_batch *batch;
+    struct mqtt_packet p;
+    struct mqtt_b b;
+    int i, total, sent, accepted, rc;
+
+    if (!mqtt || (n > 0 && !msgs)) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (!msgs[i].topic && !msgs[i].h) {
+            return LIBMQTT_ERROR_NULL;
+        }
+        if (!MQTT_IS_QOS(msgs[i].qos)) {
+            return LIBMQTT_ERROR_QOS;
+        }
+        if (!msgs[i].h && (rc = __topic_check(msgs[i].topic, strlen(msgs[i].topic)))) {
+            return rc;
+        }
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    batch = mqtt__malloc(n * sizeof *batch);
+    if (!batch) {
+        return LIBMQTT_ERROR_MALLOC;
+    }
+
+    /* size every PUBLISH up front, aliases are assigned in message order like single publishes. */
+    memset(&p, 0, sizeof p);
+    total = 0;
+    for (i = 0; i < n; i++) {
+        const char *topic;
+        int tn;
+
+        topic = msgs[i].h ? msgs[i].h->name : msgs[i].topic;
+        tn = msgs[i].h ? msgs[i].h->n : (int)strlen(topic);
+        batch[i].alias = __alias_get(mqtt, topic, tn, &batch[i].hit);
+        batch[i].pub = 0;
+        batch[i].id = __generate_packet_id(mqtt);
+        __batch_packet(mqtt, &msgs[i], &batch[i], batch[i].id, &p);
+        if (batch[i].hit)
+            p.v.publish.topic_name.n = 0;
+        batch[i].size = mqtt__publish_size(&p);
+        total += batch[i].size;
+    }
+    rc = LIBMQTT_ERROR_MALLOC;
+    accepted = 0;
+    b.s = mqtt__malloc(total);
+    if (!b.s) {
+        goto e;
+    }
+
+    /* encode back to back, registering QoS > 0 in flight before anything is sent. */
+    b.n = 0;
+    for (i = 0; i < n; i++) {
+        __batch_packet(mqtt, &msgs[i], &batch[i], batch[i].id, &p);
+        if (msgs[i].qos > MQTT_QOS_0) {
+            if (__insert_pub(mqtt, &p, LIBMQTT_DIR_OUT,
+                             msgs[i].qos == MQTT_QOS_1 ? LIBMQTT_ST_WAIT_PUBACK : LIBMQTT_ST_WAIT_PUBREC, msgs[i].h)) {
+                goto e;
+            }
+            batch[i].pub = mqtt->pub.tail;
+        }
+        if (batch[i].hit)
+            p.v.publish.topic_name.n = 0;
+        mqtt__publish_write(&p, &b);
+    }
+    rc = 0;
+
+    /* one write, the message cut by a short write is owed and counts as accepted. */
+    sent = 0;
+    if (mqtt->linger.usec > 0 || mqtt->linger.bytes > 0) {
+        if (0 == __send(mqtt, b.s, b.n))
+            sent = b.n;
+    } else if (0 == __flush(mqtt) && 0 == __reserve(mqtt, b.n)) {
+        sent = mqtt->io_write(mqtt->io, b.s, b.n);
+        if (sent < 0) {
+            __write_failed(mqtt, sent);
+            sent = 0;
+        }
+    }
+    for (accepted = 0, total = 0; accepted < n && total < sent; accepted++)
+        total += batch[accepted].size;
+    if (total > sent)
+        __owe(mqtt, b.s + sent, total - sent);
+    else
+        __trim(mqtt);
+    LIBMQTT_PROBE4(write, mqtt->c.client_id.s, PUBLISH, total, accepted);
+    mqtt->stats.sent[PUBLISH] += accepted;
+    mqtt->stats.sent_bytes[PUBLISH] += total;
+    if (accepted > 0)
+        mqtt->t.send = mqtt->t.now;
+    for (i = 0; i < accepted; i++) {
+        if (ids)
+            ids[i] = batch[i].id;
+        __trace(mqtt, LIBMQTT_TRACE_SEND, PUBLISH, msgs[i].qos << 1 | msgs[i].retain, batch[i].id,
+                msgs[i].h ? msgs[i].h->name : msgs[i].topic, -1, msgs[i].payload, msgs[i].length);
+        if (msgs[i].qos == MQTT_QOS_0 && mqtt->cb.puback)
+            mqtt->cb.puback(mqtt, mqtt->ud, batch[i].id);
+    }
+
+e:
+    for (i = accepted; i < n; i++) {
+        if (batch[i].pub)
+            __delete_pub(mqtt, batch[i].pub);
+        if (batch[i].alias && !batch[i].hit)
+            __alias_drop(mqtt, batch[i].alias);
+    }
+    mqtt__free(b.s);
+    mqtt__free(batch);
+    return rc ? rc : accepted;
+}
+
+int libmqtt__topic_register(struct libmqtt *mqtt, struct libmqtt_topic **topic, const char *name) {
+    struct libmqtt_topic *h;
+    int n, rc;
+
+    if (!mqtt || !topic || !name) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    n = strlen(name);
+    if ((rc = __topic_check(name, n))) {
+        return rc;
+    }
+    h = mqtt__malloc(sizeof *h + n + 2);
+    if (!h) {
         return LIBMQTT_ERROR_MALLOC;
     }
+    h->ref = 1;
+    h->n = n;
+    h->enc[0] = (char)((n >> 8) & 0xff);
+    h->enc[1] = (char)(n & 0xff);
+    memcpy(h->enc + 2, name, n + 1);
+    h->name = h->enc + 2;
+    *topic = h;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__topic_unregister(struct libmqtt *mqtt, struct libmqtt_topic *topic) {
+    if (!mqtt || !topic) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    __release_topic(topic);
     return LIBMQTT_SUCCESS;
 }
 
+int libmqtt__publish_h(struct libmqtt *mqtt, uint16_t *id, struct libmqtt_topic *topic,
+                       enum mqtt_qos qos, int retain, const char *payload, int length) {
+    if (!mqtt || !topic) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    return __publish(mqtt, id, topic->name, topic->n, topic, qos, retain, payload, length);
+}
+
 int libmqtt__disconnect(struct libmqtt *mqtt) {
     char b[] = MQTT_DISCONNECT;
 
@@ -847,16 +2472,42 @@ int libmqtt__disconnect(struct libmqtt *mqtt) {
     if (__write(mqtt, b, sizeof b)) {
         return LIBMQTT_ERROR_WRITE;
     }
-    __log(mqtt, "sending DISCONNECT");
+    __trace(mqtt, LIBMQTT_TRACE_SEND, DISCONNECT, 0, 0, 0, 0, 0, 0);
+    __flush(mqtt);
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__flush(struct libmqtt *mqtt) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (__flush(mqtt)) {
+        return LIBMQTT_ERROR_WRITE;
+    }
     return LIBMQTT_SUCCESS;
 }
 
 int libmqtt__read(struct libmqtt *mqtt, const char *data, int size) {
     struct mqtt_b b;
+    int rc;
 
     b.s = (char *)data;
     b.n = size;
-    if (mqtt__parse(&mqtt->p, mqtt, &b)) {
+    mqtt->inbox.data = data;
+    mqtt->inbox.size = size;
+    rc = mqtt__parse(&mqtt->p, mqtt, &b);
+    if (rc) {
+        mqtt->stats.parse_errors++;
+        if (mqtt->rec.path)
+            __recorder_dump(mqtt, mqtt->rec.path, LIBMQTT_ERROR_PARSE);
+    }
+    /* messages parsed before an error are still delivered and acked. */
+    __deliver(mqtt);
+    mqtt->inbox.data = 0;
+    mqtt->inbox.size = 0;
+    mqtt__arena_reset(&mqtt->arena);
+    __memory(mqtt, &mqtt->mem.parser, mqtt->p.buf.size + mqtt->arena.size - mqtt->mem.parser);
+    if (rc) {
         return LIBMQTT_ERROR_PARSE;
     }
     return LIBMQTT_SUCCESS;
@@ -867,18 +2518,23 @@ int libmqtt__update(struct libmqtt *mqtt) {
 
     if (mqtt->c.keep_alive > 0) {
         if (mqtt->t.ping > 0 && (mqtt->t.now - mqtt->t.ping) > mqtt->c.keep_alive) {
-        return LIBMQTT_ERROR_TIMEOUT;
+            LIBMQTT_PROBE3(timeout, mqtt->c.client_id.s, mqtt->c.keep_alive, mqtt->t.now - mqtt->t.ping);
+            if (mqtt->rec.path)
+                __recorder_dump(mqtt, mqtt->rec.path, LIBMQTT_ERROR_TIMEOUT);
+            return LIBMQTT_ERROR_TIMEOUT;
         }
 
         if (mqtt->t.ping == 0 && (mqtt->t.now - mqtt->t.send) >= mqtt->c.keep_alive) {
             char b[] = MQTT_PINGREQ;
             if (0 == __write(mqtt, b, sizeof b)) {
                 mqtt->t.ping = mqtt->t.now;
-                __log(mqtt, "sending PINGREQ");
+                mqtt->t.ping_us = __now_us();
+                __trace(mqtt, LIBMQTT_TRACE_SEND, PINGREQ, 0, 0, 0, 0, 0, 0);
             }
         }
     }
 
+    __flush(mqtt);
     __check_retry(mqtt);
     return LIBMQTT_SUCCESS;
 }
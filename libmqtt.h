@@ -34,6 +34,7 @@ extern "C" {
 #include <sys/types.h>
 
 #include "mqtt.h"
+#include "mqtt_topic.h"
 
 #if defined(__GNUC__) && (__GNUC__ >= 4)
 # define LIBMQTT_API __attribute__((visibility("default")))
@@ -53,6 +54,8 @@ extern "C" {
 #define LIBMQTT_ERROR_PARSE			-6		/* mqtt packet parse error. */
 #define LIBMQTT_ERROR_TIMEOUT		-7		/* mqtt timeout error. */
 #define LIBMQTT_ERROR_MAXSUB        -8      /* mqtt max topic/qos per subscribe or unsubscribe. */
+#define LIBMQTT_ERROR_TOPIC         -9      /* mqtt invalid topic or topic filter. */
+#define LIBMQTT_ERROR_UTF8          -10     /* mqtt string is not well formed utf-8. */
 
 /* default mqtt keep alive. */
 #define LIBMQTT_DEF_KEEPALIVE       30
@@ -60,10 +63,16 @@ extern "C" {
 /* default mqtt packet retry time. */
 #define LIBMQTT_DEF_TIMERETRY       3
 
+/* default max outbound topic alias, bounded by the broker's topic alias maximum. */
+#define LIBMQTT_DEF_TOPIC_ALIAS     65535
+
 /* libmqtt data structure. */
 struct libmqtt;
 
-/* libmqtt io write. */
+/* registered publish topic, owned by the client it was registered on. */
+struct libmqtt_topic;
+
+/* libmqtt io write, bytes taken or -1 with errno set, EAGAIN when the transport is full. */
 typedef int (* libmqtt__io_write)(void *io, const char *data, int size);
 
 /* libmqtt callbacks. */
@@ -73,6 +82,122 @@ typedef void (* libmqtt__on_unsuback)(struct libmqtt *, void *ud, uint16_t id);
 typedef void (* libmqtt__on_puback)(struct libmqtt *, void *ud, uint16_t id);
 typedef void (* libmqtt__on_publish)(struct libmqtt *, void *ud, uint16_t id, const char *topic, enum mqtt_qos qos, int retain, const char *payload, int length);
 
+/* streamed publish callbacks, length is the whole payload, each chunk is valid during the call only. */
+typedef void (* libmqtt__on_publish_begin)(struct libmqtt *, void *ud, uint16_t id, const char *topic, enum mqtt_qos qos, int retain, int length);
+typedef void (* libmqtt__on_publish_chunk)(struct libmqtt *, void *ud, uint16_t id, const char *data, int size);
+typedef void (* libmqtt__on_publish_end)(struct libmqtt *, void *ud, uint16_t id);
+
+/* one received message of libmqtt_cb.publish_batch, topic is NUL terminated.
+ * topic and payload point into the read buffer and are valid during the call only. */
+struct libmqtt_view {
+    uint16_t id;
+    enum mqtt_qos qos;
+    int retain;
+    const char *topic;
+    int topic_n;
+    const char *payload;
+    int length;
+};
+
+typedef void (* libmqtt__on_publish_batch)(struct libmqtt *, void *ud, const struct libmqtt_view *msgs, int n);
+
+/* one message of libmqtt__publish_batch, h is used instead of topic when set. */
+struct libmqtt_msg {
+    const char *topic;
+    struct libmqtt_topic *h;
+    enum mqtt_qos qos;
+    int retain;
+    const char *payload;
+    int length;
+};
+
+/* counters kept since libmqtt__create, read with libmqtt__stats. packet types index by enum mqtt_p_type. */
+struct libmqtt_stats {
+    uint64_t sent[16];              /* packets accepted by io_write or queued. */
+    uint64_t sent_bytes[16];
+    uint64_t received[16];          /* packets parsed, dropped ones included. */
+    uint64_t received_bytes[16];
+    uint64_t write_errors;          /* io_write calls failed with errno other than EAGAIN. */
+    uint64_t retries;               /* packets sent again by libmqtt__update. */
+    uint64_t parse_errors;          /* libmqtt__read calls failed on malformed input. */
+    int inflight;                   /* messages held for a QoS exchange or an unsent packet. */
+    int inflight_peak;
+    int64_t inflight_bytes;         /* payload bytes of those messages. */
+    int64_t inflight_bytes_peak;
+    int64_t ping_rtt;               /* microseconds from the last PINGREQ to its PINGRESP, 0 before one. */
+};
+
+/* heap bytes held by one client, by what they are held for. total is the sum of the others. */
+struct libmqtt_memory {
+    int64_t inflight_out;   /* outgoing QoS 1 and 2 messages waiting to be sent or acked. */
+    int64_t inflight_in;    /* incoming QoS 2 messages waiting for PUBREL, and acks to retry. */
+    int64_t parser;         /* partially received packet and receive temporaries. */
+    int64_t output;         /* buffer of bytes owed to io_write or lingering. */
+    int64_t strings;        /* client id, username, password and will. */
+    int64_t total;
+};
+
+/* log-linear latency histogram in microseconds, HdrHistogram style. values below 2 * LIBMQTT_HIST_SUB
+ * have a bucket each, above that every power of two is split into LIBMQTT_HIST_SUB buckets, up to
+ * 2^32 - 1, which takes the last bucket. */
+#define LIBMQTT_HIST_SUB_BITS       4
+#define LIBMQTT_HIST_SUB            (1 << LIBMQTT_HIST_SUB_BITS)
+#define LIBMQTT_HIST_BUCKETS        ((33 - LIBMQTT_HIST_SUB_BITS) * LIBMQTT_HIST_SUB)
+
+struct libmqtt_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t v[LIBMQTT_HIST_BUCKETS];
+};
+
+enum libmqtt_trace_event {
+    LIBMQTT_TRACE_SEND,
+    LIBMQTT_TRACE_RESEND,
+    LIBMQTT_TRACE_RECV
+};
+
+/* PUBLISH flags is the fixed header dup, qos and retain bits, or'ed with this for a streamed payload. */
+#define LIBMQTT_TRACE_STREAMED      0x100
+
+/* one fixed size trace record. flags is type specific: fixed header bits for PUBLISH, qos for
+ * SUBSCRIBE and SUBACK, ack flags << 8 | return code for CONNACK, version << 8 | clean for CONNECT
+ * whose id is the keep alive. seq counts every record of the client, a gap means records were lost. */
+struct libmqtt_trace {
+    int64_t us;
+    uint32_t seq;
+    int32_t size;
+    uint16_t id;
+    uint16_t flags;
+    uint8_t event;
+    uint8_t type;
+    uint16_t topic_n;
+};
+
+/* flight recorder dump: the header, client_id_n bytes of client id, then count records of
+ * record_size bytes, each a struct libmqtt_record followed by its kept payload, in host byte order. */
+#define LIBMQTT_RECORDER_MAGIC      0x524d514c
+#define LIBMQTT_RECORDER_VERSION    1
+#define LIBMQTT_RECORDER_PAYLOAD    4096
+
+struct libmqtt_recorder_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t record_size;
+    int64_t mono_us;        /* clock of libmqtt_trace.us at the dump. */
+    int64_t real_us;        /* wall clock at the dump, microseconds since the epoch. */
+    int32_t reason;         /* LIBMQTT_ERROR_* that triggered the dump, 0 on demand. */
+    int32_t client_id_n;
+};
+
+struct libmqtt_record {
+    uint32_t stamp;         /* position in the recorder plus one, 0 while being written. */
+    uint32_t kept;          /* PUBLISH payload bytes following the record. */
+    struct libmqtt_trace t;
+};
+
 /* libmqtt callback structure. */
 struct libmqtt_cb {
     libmqtt__on_connack connack;
@@ -80,14 +205,47 @@ struct libmqtt_cb {
     libmqtt__on_unsuback unsuback;
     libmqtt__on_puback puback;
     libmqtt__on_publish publish;
+
+    /* when set, messages for publish are collected during one libmqtt__read and delivered
+     * here at once in arrival order before it returns. their acks are sent after it returns. */
+    libmqtt__on_publish_batch publish_batch;
 };
 
 /* string error message for a libmqtt return code. */
 extern LIBMQTT_API const char *libmqtt__strerror(int rc);
 
+/* the client id mqtt was created with. */
+extern LIBMQTT_API const char *libmqtt__client_id(struct libmqtt *mqtt);
+
 /* set a log callback for debug libmqtt. */
 extern LIBMQTT_API void libmqtt__debug(struct libmqtt *mqtt, void (* log)(void *ud, const char *str));
 
+/* record every packet sent and received into a ring of records slots, rounded up to a power of two,
+ * without formatting. records are dropped while the ring is full, 0 frees the ring. */
+extern LIBMQTT_API int libmqtt__trace(struct libmqtt *mqtt, int records);
+
+/* move up to n of the oldest records into v, returns the number moved. one thread may drain
+ * while another drives mqtt, but not while libmqtt__trace resizes the ring. */
+extern LIBMQTT_API int libmqtt__trace_drain(struct libmqtt *mqtt, struct libmqtt_trace *v, int n);
+
+/* format a record the way libmqtt__debug logs it, returns the length as snprintf. */
+extern LIBMQTT_API int libmqtt__trace_format(const struct libmqtt_trace *t, char *buf, int size);
+
+/* keep the last records packets sent and received, rounded up to a power of two, with up to payload
+ * bytes of each PUBLISH payload, in memory allocated once. when path is set the recorder is dumped
+ * there on LIBMQTT_ERROR_TIMEOUT and parse errors. 0 records frees it. resizing or freeing replaces
+ * the memory a concurrent libmqtt__recorder_dump reads, so it must not run while a dump does. */
+extern LIBMQTT_API int libmqtt__recorder(struct libmqtt *mqtt, int records, int payload, const char *path);
+
+/* write the recorded packets to path, oldest first, for libmqtt_flight to decode. it may run on
+ * another thread than the one driving mqtt, records overwritten meanwhile are left out, but not
+ * alongside libmqtt__recorder or libmqtt__destroy. */
+extern LIBMQTT_API int libmqtt__recorder_dump(struct libmqtt *mqtt, const char *path);
+
+/* allocate everything in libmqtt and the codec with m, r and f, each called with ud.
+ * call before libmqtt__create, 0 functions restore malloc, realloc and free. */
+extern LIBMQTT_API int libmqtt__set_allocator(mqtt_malloc_fn m, mqtt_realloc_fn r, mqtt_free_fn f, void *ud);
+
 /* generic libmqtt functions. */
 extern LIBMQTT_API int libmqtt__create(struct libmqtt **mqtt, const char *client_id, void *ud, struct libmqtt_cb *cb);
 extern LIBMQTT_API int libmqtt__destroy(struct libmqtt *mqtt);
@@ -95,6 +253,48 @@ extern LIBMQTT_API int libmqtt__destroy(struct libmqtt *mqtt);
 extern LIBMQTT_API int libmqtt__time_retry(struct libmqtt *mqtt, int time_retry);
 extern LIBMQTT_API int libmqtt__keep_alive(struct libmqtt *mqtt, uint16_t keep_alive);
 extern LIBMQTT_API int libmqtt__clean_sess(struct libmqtt *mqtt, int clean_sess);
+extern LIBMQTT_API int libmqtt__topic_alias(struct libmqtt *mqtt, uint16_t max);
+
+/* queue outbound packets until usec passed since the first one or bytes are queued, 0 disables a bound.
+ * with any bound set, call libmqtt__flush when the caller's event loop is about to sleep. */
+extern LIBMQTT_API int libmqtt__linger(struct libmqtt *mqtt, int usec, int bytes);
+
+/* deliver publish packets of at least size bytes through begin, chunk and end straight from
+ * the read buffer instead of buffering them, bypassing libmqtt__subscribe_cb routing.
+ * acks are sent after end, size 0 turns it off. */
+extern LIBMQTT_API int libmqtt__publish_stream(struct libmqtt *mqtt, int size, libmqtt__on_publish_begin begin,
+                                               libmqtt__on_publish_chunk chunk, libmqtt__on_publish_end end);
+/* packets above size bytes are skipped when skip is set, or fail libmqtt__read, without being
+ * buffered. mqtt v5 also announces size to the broker as its maximum packet size. */
+extern LIBMQTT_API int libmqtt__max_packet(struct libmqtt *mqtt, int size, int skip);
+
+/* charge received packets to a budget shared with other clients of the same event loop,
+ * publishes that do not fit are dropped unacknowledged. */
+extern LIBMQTT_API int libmqtt__budget(struct libmqtt *mqtt, struct mqtt_budget *budget);
+extern LIBMQTT_API const struct mqtt_parse_stats *libmqtt__parse_stats(struct libmqtt *mqtt);
+
+/* copy the counters of mqtt into stats, they are plain increments kept whether read or not. */
+extern LIBMQTT_API int libmqtt__stats(struct libmqtt *mqtt, struct libmqtt_stats *stats);
+
+/* the bytes mqtt holds now, to find clients hoarding memory. */
+extern LIBMQTT_API int libmqtt__memory(struct libmqtt *mqtt, struct libmqtt_memory *mem);
+
+/* the sum of libmqtt_memory.total over every client of the process. */
+extern LIBMQTT_API int64_t libmqtt__memory_total(void);
+
+/* snapshot PUBLISH to PUBACK latency of QoS 1 and PUBLISH to PUBCOMP latency of QoS 2 messages,
+ * timed from the first send, since libmqtt__create or libmqtt__latency_reset. either may be 0. */
+extern LIBMQTT_API int libmqtt__latency(struct libmqtt *mqtt, struct libmqtt_hist *puback, struct libmqtt_hist *pubcomp);
+extern LIBMQTT_API int libmqtt__latency_reset(struct libmqtt *mqtt);
+
+/* count one sample of us microseconds, negative ones as 0, to time anything else the same way. */
+extern LIBMQTT_API void libmqtt__hist_add(struct libmqtt_hist *h, int64_t us);
+
+/* add the samples of from to to, for example to aggregate the clients of a process. */
+extern LIBMQTT_API void libmqtt__hist_merge(struct libmqtt_hist *to, const struct libmqtt_hist *from);
+
+/* the latency below which percentile percent of samples fall, the upper bound of its bucket. */
+extern LIBMQTT_API uint64_t libmqtt__hist_percentile(const struct libmqtt_hist *h, double percentile);
 extern LIBMQTT_API int libmqtt__version(struct libmqtt *mqtt, enum mqtt_vsn vsn);
 extern LIBMQTT_API int libmqtt__auth(struct libmqtt *mqtt, const char *username, const char *password);
 extern LIBMQTT_API int libmqtt__will(struct libmqtt *mqtt, int retain, enum mqtt_qos qos, const char *topic, const char *payload, int payload_len);
@@ -103,10 +303,30 @@ extern LIBMQTT_API int libmqtt__connect(struct libmqtt *mqtt, void *io, libmqtt_
 extern LIBMQTT_API int libmqtt__disconnect(struct libmqtt *mqtt);
 
 extern LIBMQTT_API int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[], enum mqtt_qos qos[]);
+
+/* subscribe a topic filter with its own publish callback, ud is passed to cb instead of the client ud.
+ * mqtt v5 routes by subscription identifier, older versions match the filter locally
+ * against a topic trie, in time proportional to the topic depth.
+ * messages matching no such subscription go to libmqtt_cb.publish. */
+extern LIBMQTT_API int libmqtt__subscribe_cb(struct libmqtt *mqtt, uint16_t *id, const char *topic, enum mqtt_qos qos, libmqtt__on_publish cb, void *ud);
+
 extern LIBMQTT_API int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[]);
 extern LIBMQTT_API int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic, enum mqtt_qos qos, int retain, const char *payload, int length);
 
+/* register a topic encoded once for libmqtt__publish_h, in-flight messages keep it alive after unregister. */
+extern LIBMQTT_API int libmqtt__topic_register(struct libmqtt *mqtt, struct libmqtt_topic **topic, const char *name);
+extern LIBMQTT_API int libmqtt__topic_unregister(struct libmqtt *mqtt, struct libmqtt_topic *topic);
+extern LIBMQTT_API int libmqtt__publish_h(struct libmqtt *mqtt, uint16_t *id, struct libmqtt_topic *topic, enum mqtt_qos qos, int retain, const char *payload, int length);
+
+/* encode n messages into one buffer and send them with one write, QoS > 0 ones are tracked in flight.
+ * returns how many leading messages the transport accepted, the rest are dropped and may be retried.
+ * ids, when set, receives the packet id of each accepted message. */
+extern LIBMQTT_API int libmqtt__publish_batch(struct libmqtt *mqtt, const struct libmqtt_msg *msgs, int n, uint16_t *ids);
+
 extern LIBMQTT_API int libmqtt__read(struct libmqtt *mqtt, const char *data, int size);
+
+/* send queued bytes, LIBMQTT_ERROR_WRITE when the transport did not take them all. */
+extern LIBMQTT_API int libmqtt__flush(struct libmqtt *mqtt);
 extern LIBMQTT_API int libmqtt__update(struct libmqtt *mqtt);
 
 #ifdef __cplusplus
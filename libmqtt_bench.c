@@ -0,0 +1,876 @@
+/*
+ * libmqtt_bench.c -- mqtt throughput and end to end latency benchmark client.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "libmqtt.h"
+#include "ae_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* every payload starts with a stamp, the rest is filler. */
+#define STAMP_MAGIC     0x4c42514d
+
+struct stamp {
+    uint32_t magic;
+    uint32_t publisher;
+    uint64_t seq;
+    int64_t us;
+};
+
+/* catching up after a stall is bounded to this many milliseconds of the target rate,
+ * without a rate each publisher sends up to BURST messages per tick. */
+#define CATCH_UP_MS     100
+#define BURST           256
+
+enum phase {
+    PHASE_CONNECT,
+    PHASE_RUN,
+    PHASE_STOP
+};
+
+struct bench_loop;
+
+struct bench_client {
+    struct bench_loop *loop;
+    struct libmqtt *mqtt;
+    struct ae_io *io;
+    int publisher;      /* index among publishers, -1 for subscribers. */
+    int index;          /* index among clients of the same role. */
+    int closed;
+    int publishing;
+    int inflight;
+    uint64_t seq;
+};
+
+/* counters are written by the loop thread only and read by the main thread while it runs. */
+struct bench_counters {
+    uint64_t sent;
+    uint64_t sent_bytes;
+    uint64_t received;
+    uint64_t received_bytes;
+    uint64_t missed;
+    uint64_t errors;
+    uint64_t window_sent;
+    uint64_t window_sent_bytes;
+    uint64_t window_received;
+    uint64_t window_received_bytes;
+};
+
+struct bench_loop {
+    pthread_t thread;
+    int index;
+    aeEventLoop *el;
+    struct bench_client *c;
+    int n;
+    int pubs;
+    int next;
+    int open;
+    int stopping;
+    int measuring;
+    int64_t stop_us;
+    double rate;
+    uint64_t due;
+    uint64_t rng;
+    char *payload;
+    struct bench_counters count;
+    struct libmqtt_hist latency;
+    struct libmqtt_hist puback;
+    struct libmqtt_hist pubcomp;
+};
+
+static char *host = 0;
+static int port = 1883;
+static enum mqtt_vsn proto_ver = MQTT_PROTO_V4;
+static int keepalive = 60;
+static char *username = 0;
+static char *password = 0;
+static char *prefix = 0;
+static int publishers = 1;
+static int subscribers = 1;
+static int loops = 1;
+static int rate = 10000;
+static int duration = 10;
+static int warmup = 1;
+static int drain = 2;
+static int size_min = 64;
+static int size_max = 64;
+static int qos_mix[3] = {1, 0, 0};
+static int topics = 1;
+static int zipf = 0;
+static int inflight = 1024;
+static int quiet = 0;
+static char *stats_socket = 0;
+
+static char **topic_names = 0;
+static double *topic_cdf = 0;
+
+static int phase = PHASE_CONNECT;
+static int ready = 0;
+static int failed = 0;
+static int64_t start_us = 0;
+static int64_t window_begin = 0;
+static int64_t window_end = 0;
+
+/* the loop run by this thread, for ae_io callbacks which only know the connection. */
+static __thread struct bench_loop *self = 0;
+
+#define COUNT(v, n) __atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+
+static void
+usage(void) {
+    printf("libmqtt_bench runs mqtt publishers and subscribers against a broker and reports sustained\n");
+    printf("throughput and end to end latency.\n");
+    printf("libmqtt_bench version %s running on libmqtt %d.%d.%d.\n\n", "0.0.0", 0, 2, 0);
+    printf("Usage: libmqtt_bench [-h host] [-p port] [-k keepalive] [-V protocol_version] [-t prefix]\n");
+    printf("                     [--pub n] [--sub n] [--loops n] [--rate msgs] [--inflight n]\n");
+    printf("                     [--duration s] [--warmup s] [--drain s]\n");
+    printf("                     [-q qos | -q w0:w1:w2] [--size bytes[:max]] [--topics n [--zipf]]\n");
+    printf("                     [-u username [-P password]] [--quiet] [--stats-socket path]\n");
+    printf("       libmqtt_bench --help\n\n");
+    printf(" -h : mqtt host to connect to. Defaults to localhost.\n");
+    printf(" -k : keep alive in seconds for each client. Defaults to 60.\n");
+    printf(" -p : network port to connect to. Defaults to 1883.\n");
+    printf(" -P : provide a password (requires MQTT 3.1 broker)\n");
+    printf(" -q : quality of service level of every message, or the weights of QoS 0, 1 and 2\n");
+    printf("      messages, for example 70:20:10. Defaults to 0.\n");
+    printf(" -t : topic prefix, messages are published on prefix/n and subscribed on prefix/#.\n");
+    printf("      Defaults to libmqtt_bench/ appended with the process id.\n");
+    printf(" -u : provide a username (requires MQTT 3.1 broker)\n");
+    printf(" -V : specify the version of the MQTT protocol to use when connecting.\n");
+    printf("      Can be mqttv31, mqttv311 or mqttv5. Defaults to mqttv311.\n");
+    printf(" --drain : seconds to wait for messages in flight after publishing stops. Defaults to 2.\n");
+    printf(" --duration : seconds measured after the warmup. Defaults to 10.\n");
+    printf(" --help : display this message.\n");
+    printf(" --inflight : QoS 1 and 2 messages a publisher may have unacknowledged. Defaults to 1024.\n");
+    printf(" --loops : event loops, each on its own thread, clients are spread over them. Defaults to 1.\n");
+    printf(" --pub : publishing clients. Defaults to 1.\n");
+    printf(" --quiet : don't print the per second progress nor error messages.\n");
+    printf(" --rate : messages per second over all publishers, 0 publishes as fast as the broker\n");
+    printf("          takes them. Defaults to 10000.\n");
+    printf(" --size : payload bytes, or a range drawn uniformly. At least %d. Defaults to 64.\n", (int)sizeof(struct stamp));
+    printf(" --stats-socket : serve client and event loop counters of the first loop in prometheus\n");
+    printf("                  text format on this unix socket path.\n");
+    printf(" --sub : subscribing clients, each receives every message. Defaults to 1.\n");
+    printf(" --topics : topics published on, drawn uniformly. Defaults to 1.\n");
+    printf(" --warmup : seconds run before measuring. Defaults to 1.\n");
+    printf(" --zipf : draw topics from a zipf distribution, topic 0 the most frequent.\n");
+    printf("\nSee https://github.com/zhoukk/libmqtt for more information.\n\n");
+    exit(0);
+}
+
+static int64_t
+__now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, one state per loop. */
+static uint64_t
+__rand(struct bench_loop *l) {
+    l->rng ^= l->rng >> 12;
+    l->rng ^= l->rng << 25;
+    l->rng ^= l->rng >> 27;
+    return l->rng * 2685821657736338717ULL;
+}
+
+static int
+__int_arg(int argc, char *argv[], int i, int min, int *v) {
+    if (i == argc-1) {
+        fprintf(stderr, "Error: %s argument given but no value specified.\n\n", argv[i]);
+        return -1;
+    }
+    *v = atoi(argv[i+1]);
+    if (*v < min) {
+        fprintf(stderr, "Error: Invalid %s given: %s\n", argv[i], argv[i+1]);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+config(int argc, char *argv[]) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--port")) {
+            if (__int_arg(argc, argv, i, 1, &port) || port > 65535)
+                goto e;
+            i++;
+        } else if (!strcmp(argv[i], "--help")) {
+            usage();
+        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--host")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -h argument given but no host specified.\n\n");
+                goto e;
+            }
+            host = strdup(argv[++i]);
+        } else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keepalive")) {
+            if (__int_arg(argc, argv, i, 0, &keepalive) || keepalive > 65535)
+                goto e;
+            i++;
+        } else if (!strcmp(argv[i], "-V") || !strcmp(argv[i], "--protocol-version")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --protocol-version argument given but no version specified.\n\n");
+                goto e;
+            }
+            if (!strcmp(argv[i+1], "mqttv31")) {
+                proto_ver = MQTT_PROTO_V3;
+            } else if (!strcmp(argv[i+1], "mqttv311")) {
+                proto_ver = MQTT_PROTO_V4;
+            } else if (!strcmp(argv[i+1], "mqttv5")) {
+                proto_ver = MQTT_PROTO_V5;
+            } else {
+                fprintf(stderr, "Error: Invalid protocol version argument given.\n\n");
+                goto e;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--qos")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -q argument given but no QoS specified.\n\n");
+                goto e;
+            }
+            if (strchr(argv[i+1], ':')) {
+                if (3 != sscanf(argv[i+1], "%d:%d:%d", &qos_mix[0], &qos_mix[1], &qos_mix[2])
+                    || qos_mix[0] < 0 || qos_mix[1] < 0 || qos_mix[2] < 0
+                    || qos_mix[0] + qos_mix[1] + qos_mix[2] == 0) {
+                    fprintf(stderr, "Error: Invalid QoS weights given: %s\n", argv[i+1]);
+                    goto e;
+                }
+            } else {
+                int qos = atoi(argv[i+1]);
+                if (qos < 0 || qos > 2) {
+                    fprintf(stderr, "Error: Invalid QoS given: %d\n", qos);
+                    goto e;
+                }
+                qos_mix[0] = qos_mix[1] = qos_mix[2] = 0;
+                qos_mix[qos] = 1;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--topic")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -t argument given but no topic prefix specified.\n\n");
+                goto e;
+            }
+            prefix = strdup(argv[++i]);
+        } else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--username")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -u argument given but no username specified.\n\n");
+                goto e;
+            }
+            username = strdup(argv[++i]);
+        } else if (!strcmp(argv[i], "-P") || !strcmp(argv[i], "--pw")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: -P argument given but no password specified.\n\n");
+                goto e;
+            }
+            password = strdup(argv[++i]);
+        } else if (!strcmp(argv[i], "--pub")) {
+            if (__int_arg(argc, argv, i++, 0, &publishers)) goto e;
+        } else if (!strcmp(argv[i], "--sub")) {
+            if (__int_arg(argc, argv, i++, 0, &subscribers)) goto e;
+        } else if (!strcmp(argv[i], "--loops")) {
+            if (__int_arg(argc, argv, i++, 1, &loops)) goto e;
+        } else if (!strcmp(argv[i], "--rate")) {
+            if (__int_arg(argc, argv, i++, 0, &rate)) goto e;
+        } else if (!strcmp(argv[i], "--inflight")) {
+            if (__int_arg(argc, argv, i++, 1, &inflight)) goto e;
+        } else if (!strcmp(argv[i], "--duration")) {
+            if (__int_arg(argc, argv, i++, 1, &duration)) goto e;
+        } else if (!strcmp(argv[i], "--warmup")) {
+            if (__int_arg(argc, argv, i++, 0, &warmup)) goto e;
+        } else if (!strcmp(argv[i], "--drain")) {
+            if (__int_arg(argc, argv, i++, 0, &drain)) goto e;
+        } else if (!strcmp(argv[i], "--topics")) {
+            if (__int_arg(argc, argv, i++, 1, &topics)) goto e;
+        } else if (!strcmp(argv[i], "--zipf")) {
+            zipf = 1;
+        } else if (!strcmp(argv[i], "--size")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --size argument given but no size specified.\n\n");
+                goto e;
+            }
+            if (2 != sscanf(argv[i+1], "%d:%d", &size_min, &size_max))
+                size_max = size_min = atoi(argv[i+1]);
+            if (size_min < (int)sizeof(struct stamp) || size_max < size_min || size_max > 268435455) {
+                fprintf(stderr, "Error: Invalid size given: %s\n", argv[i+1]);
+                goto e;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--quiet")) {
+            quiet = 1;
+        } else if (!strcmp(argv[i], "--stats-socket")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --stats-socket argument given but no path specified.\n\n");
+                goto e;
+            }
+            stats_socket = strdup(argv[++i]);
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[i]);
+            goto e;
+        }
+    }
+    if (publishers + subscribers == 0) {
+        fprintf(stderr, "Error: Neither publishers nor subscribers given.\n");
+        goto e;
+    }
+    return;
+
+e:
+    fprintf(stderr, "\nUse 'libmqtt_bench --help' to see usage.\n");
+    exit(0);
+}
+
+static int
+__topic(struct bench_loop *l) {
+    double u;
+    int lo, hi, mid;
+
+    if (topics == 1)
+        return 0;
+    if (!zipf)
+        return __rand(l) % topics;
+    u = (__rand(l) >> 11) * (1.0 / 9007199254740992.0);
+    lo = 0;
+    hi = topics - 1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (topic_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static enum mqtt_qos
+__qos(struct bench_loop *l) {
+    int r;
+
+    r = __rand(l) % (qos_mix[0] + qos_mix[1] + qos_mix[2]);
+    if (r < qos_mix[0])
+        return MQTT_QOS_0;
+    if (r < qos_mix[0] + qos_mix[1])
+        return MQTT_QOS_1;
+    return MQTT_QOS_2;
+}
+
+static int
+__publish(struct bench_loop *l, struct bench_client *c, int64_t now) {
+    struct stamp s;
+    enum mqtt_qos qos;
+    int size, rc;
+
+    size = size_min;
+    if (size_max > size_min)
+        size += __rand(l) % (size_max - size_min + 1);
+    qos = __qos(l);
+    s.magic = STAMP_MAGIC;
+    s.publisher = c->publisher;
+    s.seq = c->seq++;
+    s.us = now;
+    memcpy(l->payload, &s, sizeof s);
+    c->publishing = 1;
+    rc = libmqtt__publish(c->mqtt, 0, topic_names[__topic(l)], qos, 0, l->payload, size);
+    c->publishing = 0;
+    if (rc != LIBMQTT_SUCCESS) {
+        COUNT(l->count.errors, 1);
+        return rc;
+    }
+    if (qos != MQTT_QOS_0)
+        c->inflight++;
+    COUNT(l->count.sent, 1);
+    COUNT(l->count.sent_bytes, size);
+    if (now >= window_begin && now < window_end) {
+        COUNT(l->count.window_sent, 1);
+        COUNT(l->count.window_sent_bytes, size);
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+/* a publisher pushed back by its socket or out of inflight window is skipped. */
+static struct bench_client *
+__next_publisher(struct bench_loop *l) {
+    struct bench_client *c;
+    int i;
+
+    for (i = 0; i < l->pubs; i++) {
+        c = &l->c[l->next];
+        l->next = (l->next + 1) % l->pubs;
+        if (!c->closed && !c->io->writable && c->inflight < inflight)
+            return c;
+    }
+    return 0;
+}
+
+static void
+__drive(struct bench_loop *l, int64_t now) {
+    struct bench_client *c;
+    uint64_t target, behind;
+
+    if (l->pubs == 0)
+        return;
+    if (l->rate > 0) {
+        target = (uint64_t)(l->rate * (now - start_us) / 1000000.0);
+        behind = (uint64_t)(l->rate * CATCH_UP_MS / 1000.0);
+        if (target > l->due + behind) {
+            COUNT(l->count.missed, target - behind - l->due);
+            l->due = target - behind;
+        }
+    } else {
+        target = l->due + (uint64_t)BURST * l->pubs;
+    }
+    while (l->due < target) {
+        c = __next_publisher(l);
+        if (!c || __publish(l, c, now))
+            break;
+        l->due++;
+    }
+}
+
+static int
+__tick(aeEventLoop *el, long long id, void *privdata) {
+    struct bench_loop *l;
+    int64_t now;
+    int i;
+    (void)id;
+
+    l = (struct bench_loop *)privdata;
+    now = __now_us();
+    switch (__atomic_load_n(&phase, __ATOMIC_ACQUIRE)) {
+    case PHASE_RUN:
+        if (!l->measuring && now >= window_begin) {
+            l->measuring = 1;
+            for (i = 0; i < l->pubs; i++)
+                libmqtt__latency_reset(l->c[i].mqtt);
+        }
+        if (now < window_end)
+            __drive(l, now);
+        break;
+    case PHASE_STOP:
+        if (!l->stopping) {
+            l->stopping = 1;
+            l->stop_us = now;
+            for (i = 0; i < l->n; i++)
+                if (!l->c[i].closed)
+                    libmqtt__disconnect(l->c[i].mqtt);
+        }
+        if (l->open == 0 || now - l->stop_us > 1000000) {
+            aeStop(el);
+            return AE_NOMORE;
+        }
+        break;
+    }
+    return 1;
+}
+
+static void
+__connack(struct libmqtt *mqtt, void *ud, int ack_flags, enum mqtt_connack return_code) {
+    struct bench_client *c;
+    const char *topic[1];
+    enum mqtt_qos qos[1];
+    char filter[256];
+    (void)ack_flags;
+
+    c = (struct bench_client *)ud;
+    if (return_code != CONNACK_ACCEPTED) {
+        if (!quiet) {
+            if (MQTT_IS_CONNACK(return_code))
+                fprintf(stderr, "%s\n", MQTT_CONNACK_NAMES[return_code]);
+            else
+                fprintf(stderr, "Connection refused (reason code: %d)\n", return_code);
+        }
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (c->publisher >= 0) {
+        __atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    snprintf(filter, sizeof filter, "%s/#", prefix);
+    topic[0] = filter;
+    qos[0] = MQTT_QOS_2;
+    if (LIBMQTT_SUCCESS != libmqtt__subscribe(mqtt, 0, 1, topic, qos))
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void
+__suback(struct libmqtt *mqtt, void *ud, uint16_t id, int count, enum mqtt_qos *qos) {
+    (void)mqtt;
+    (void)ud;
+    (void)id;
+
+    if (count != 1 || qos[0] > MQTT_QOS_2) {
+        if (!quiet) fprintf(stderr, "Subscription refused.\n");
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+}
+
+/* libmqtt__publish acks QoS 0 messages before returning, those were never counted in flight. */
+static void
+__puback(struct libmqtt *mqtt, void *ud, uint16_t id) {
+    struct bench_client *c;
+    (void)mqtt;
+    (void)id;
+
+    c = (struct bench_client *)ud;
+    if (!c->publishing && c->inflight > 0)
+        c->inflight--;
+}
+
+static void
+__publish_cb(struct libmqtt *mqtt, void *ud, uint16_t id, const char *topic, enum mqtt_qos qos, int retain, const char *payload, int length) {
+    struct bench_client *c;
+    struct bench_loop *l;
+    struct stamp s;
+    (void)mqtt;
+    (void)id;
+    (void)topic;
+    (void)qos;
+    (void)retain;
+
+    c = (struct bench_client *)ud;
+    l = c->loop;
+    COUNT(l->count.received, 1);
+    COUNT(l->count.received_bytes, length);
+    if (length < (int)sizeof s)
+        return;
+    memcpy(&s, payload, sizeof s);
+    if (s.magic != STAMP_MAGIC || s.us < window_begin || s.us >= window_end)
+        return;
+    COUNT(l->count.window_received, 1);
+    COUNT(l->count.window_received_bytes, length);
+    libmqtt__hist_add(&l->latency, __now_us() - s.us);
+}
+
+static void
+__disconnect(aeEventLoop *el, struct ae_io *io) {
+    struct bench_loop *l;
+    int i;
+
+    l = self;
+    for (i = 0; i < l->n; i++) {
+        if (l->c[i].io == io) {
+            l->c[i].closed = 1;
+            l->open--;
+            break;
+        }
+    }
+    if (!l->stopping) {
+        COUNT(l->count.errors, 1);
+        if (!quiet) fprintf(stderr, "Client %s disconnected.\n", libmqtt__client_id(io->mqtt));
+    }
+    ae_io__close(el, io);
+}
+
+static void *
+__run(void *arg) {
+    struct bench_loop *l;
+    struct bench_client *c;
+    struct libmqtt_hist puback, pubcomp;
+    struct libmqtt_cb cb = {
+        .connack = __connack,
+        .suback = __suback,
+        .puback = __puback,
+        .publish = __publish_cb,
+    };
+    char client_id[64];
+    int i, rc;
+
+    l = (struct bench_loop *)arg;
+    self = l;
+    l->el = aeCreateEventLoop(l->n + 64);
+    for (i = 0; i < l->n; i++) {
+        c = &l->c[i];
+        snprintf(client_id, sizeof client_id, "libmqtt_bench_%d_%s%d", getpid(), c->publisher >= 0 ? "pub" : "sub", c->index);
+        rc = libmqtt__create(&c->mqtt, client_id, c, &cb);
+        if (!rc) rc = libmqtt__version(c->mqtt, proto_ver);
+        if (!rc) rc = libmqtt__keep_alive(c->mqtt, keepalive);
+        if (username) {
+            if (!rc) rc = libmqtt__auth(c->mqtt, username, password);
+        }
+        if (rc != LIBMQTT_SUCCESS) {
+            if (!quiet) fprintf(stderr, "%s\n", libmqtt__strerror(rc));
+            goto e;
+        }
+        c->io = ae_io__connect(l->el, c->mqtt, host, port, __disconnect);
+        if (!c->io) {
+            goto e;
+        }
+        l->open++;
+        rc = libmqtt__connect(c->mqtt, c->io, ae_io__write);
+        if (rc != LIBMQTT_SUCCESS) {
+            if (!quiet) fprintf(stderr, "%s\n", libmqtt__strerror(rc));
+            goto e;
+        }
+    }
+    if (l->index == 0 && stats_socket && AE_ERR == ae_io__stats_server(l->el, stats_socket)) {
+        goto e;
+    }
+    if (AE_ERR == aeCreateTimeEvent(l->el, 1, __tick, l, 0)) {
+        fprintf(stderr, "aeCreateTimeEvent: error\n");
+        goto e;
+    }
+    aeMain(l->el);
+    goto done;
+
+e:
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+done:
+    for (i = 0; i < l->n; i++) {
+        c = &l->c[i];
+        if (c->io && !c->closed)
+            ae_io__close(l->el, c->io);
+        if (!c->mqtt)
+            continue;
+        if (c->publisher >= 0 && LIBMQTT_SUCCESS == libmqtt__latency(c->mqtt, &puback, &pubcomp)) {
+            libmqtt__hist_merge(&l->puback, &puback);
+            libmqtt__hist_merge(&l->pubcomp, &pubcomp);
+        }
+        libmqtt__destroy(c->mqtt);
+    }
+    aeDeleteEventLoop(l->el);
+    return 0;
+}
+
+static void
+__sum(struct bench_loop *v, struct bench_counters *t) {
+    int i;
+
+    memset(t, 0, sizeof *t);
+    for (i = 0; i < loops; i++) {
+        t->sent += LOAD(v[i].count.sent);
+        t->sent_bytes += LOAD(v[i].count.sent_bytes);
+        t->received += LOAD(v[i].count.received);
+        t->received_bytes += LOAD(v[i].count.received_bytes);
+        t->missed += LOAD(v[i].count.missed);
+        t->errors += LOAD(v[i].count.errors);
+        t->window_sent += LOAD(v[i].count.window_sent);
+        t->window_sent_bytes += LOAD(v[i].count.window_sent_bytes);
+        t->window_received += LOAD(v[i].count.window_received);
+        t->window_received_bytes += LOAD(v[i].count.window_received_bytes);
+    }
+}
+
+static void
+__sleep_until(int64_t us) {
+    struct timespec ts;
+    int64_t d;
+
+    d = us - __now_us();
+    if (d <= 0)
+        return;
+    ts.tv_sec = d / 1000000;
+    ts.tv_nsec = (d % 1000000) * 1000;
+    nanosleep(&ts, 0);
+}
+
+static void
+__latency(const char *name, const struct libmqtt_hist *h) {
+    if (h->count == 0)
+        return;
+    printf("%-10s min %"PRIu64" p50 %"PRIu64" p90 %"PRIu64" p99 %"PRIu64" p99.9 %"PRIu64" max %"PRIu64" mean %.0f us, %"PRIu64" samples\n",
+           name, h->min, libmqtt__hist_percentile(h, 50), libmqtt__hist_percentile(h, 90),
+           libmqtt__hist_percentile(h, 99), libmqtt__hist_percentile(h, 99.9), h->max,
+           (double)h->sum / h->count, h->count);
+}
+
+int
+main(int argc, char *argv[]) {
+    struct bench_loop *v, *l;
+    struct bench_counters t, last;
+    struct libmqtt_hist latency, puback, pubcomp;
+    uint64_t expected;
+    int64_t t0;
+    double sum;
+    int i, j, k, second, rc;
+
+    ae_io__use_zmalloc();
+    config(argc, argv);
+    if (!host) {
+        host = strdup("127.0.0.1");
+    }
+    if (!prefix) {
+        prefix = malloc(32);
+        snprintf(prefix, 32, "libmqtt_bench/%d", getpid());
+    }
+    if (loops > 1) {
+        zmalloc_enable_thread_safeness();
+    }
+
+    topic_names = calloc(topics, sizeof *topic_names);
+    topic_cdf = calloc(topics, sizeof *topic_cdf);
+    v = calloc(loops, sizeof *v);
+    if (!topic_names || !topic_cdf || !v) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    sum = 0;
+    for (k = 0; k < topics; k++) {
+        topic_names[k] = malloc(strlen(prefix) + 16);
+        sprintf(topic_names[k], "%s/%d", prefix, k);
+        sum += 1.0 / (k + 1);
+        topic_cdf[k] = sum;
+    }
+    for (k = 0; k < topics; k++)
+        topic_cdf[k] /= sum;
+
+    /* client k of each role runs on loop k % loops, publishers first. */
+    for (i = 0; i < loops; i++) {
+        l = &v[i];
+        l->index = i;
+        l->pubs = publishers / loops + (i < publishers % loops);
+        l->n = l->pubs + subscribers / loops + (i < subscribers % loops);
+        l->c = calloc(l->n ? l->n : 1, sizeof *l->c);
+        l->payload = malloc(size_max);
+        if (!l->c || !l->payload) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            return 1;
+        }
+        memset(l->payload, 'x', size_max);
+        l->rate = publishers ? (double)rate * l->pubs / publishers : 0;
+        l->rng = 0x9e3779b97f4a7c15ULL * (i + 1) ^ (uint64_t)getpid();
+        for (j = 0, k = i; j < l->n; j++, k += loops) {
+            if (j == l->pubs)
+                k = i;
+            l->c[j].loop = l;
+            l->c[j].index = k;
+            l->c[j].publisher = j < l->pubs ? k : -1;
+        }
+    }
+
+    /* settle the simd kernel the codec detects lazily before the loops share it. */
+    mqtt__simd_get();
+
+    rc = 0;
+    for (i = 0; i < loops; i++) {
+        if (pthread_create(&v[i].thread, 0, __run, &v[i])) {
+            fprintf(stderr, "Error: Unable to start loop %d.\n", i);
+            exit(1);
+        }
+    }
+
+    t0 = __now_us();
+    while (__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < publishers + subscribers) {
+        if (__atomic_load_n(&failed, __ATOMIC_RELAXED) || __now_us() - t0 > 10000000) {
+            fprintf(stderr, "Error: %d of %d clients connected to %s:%d.\n",
+                    __atomic_load_n(&ready, __ATOMIC_RELAXED), publishers + subscribers, host, port);
+            rc = 1;
+            goto stop;
+        }
+        usleep(1000);
+    }
+    printf("%d publishers and %d subscribers on %d loops to %s:%d, ", publishers, subscribers, loops, host, port);
+    if (rate)
+        printf("%d msg/s", rate);
+    else
+        printf("unlimited rate");
+    printf(" of %d", size_min);
+    if (size_max > size_min)
+        printf(" to %d", size_max);
+    printf(" bytes, QoS %d:%d:%d, %d %stopics\n", qos_mix[0], qos_mix[1], qos_mix[2], topics, zipf ? "zipf " : "");
+
+    start_us = __now_us();
+    window_begin = start_us + warmup * 1000000LL;
+    window_end = window_begin + duration * 1000000LL;
+    __atomic_store_n(&phase, PHASE_RUN, __ATOMIC_RELEASE);
+
+    memset(&last, 0, sizeof last);
+    for (second = 1; second <= warmup + duration; second++) {
+        __sleep_until(start_us + second * 1000000LL);
+        __sum(v, &t);
+        if (!quiet) {
+            printf("%4ds %-6s sent %9"PRIu64" msg/s %8.2f MB/s  received %9"PRIu64" msg/s %8.2f MB/s\n",
+                   second, second <= warmup ? "warmup" : "", t.sent - last.sent, (t.sent_bytes - last.sent_bytes) / 1e6,
+                   t.received - last.received, (t.received_bytes - last.received_bytes) / 1e6);
+        }
+        last = t;
+    }
+
+    t0 = __now_us();
+    for (;;) {
+        __sum(v, &t);
+        if (t.window_received >= t.window_sent * subscribers || __now_us() - t0 >= drain * 1000000LL)
+            break;
+        usleep(10000);
+    }
+
+stop:
+    __atomic_store_n(&phase, PHASE_STOP, __ATOMIC_RELEASE);
+    for (i = 0; i < loops; i++)
+        pthread_join(v[i].thread, 0);
+
+    memset(&latency, 0, sizeof latency);
+    memset(&puback, 0, sizeof puback);
+    memset(&pubcomp, 0, sizeof pubcomp);
+    for (i = 0; i < loops; i++) {
+        libmqtt__hist_merge(&latency, &v[i].latency);
+        libmqtt__hist_merge(&puback, &v[i].puback);
+        libmqtt__hist_merge(&pubcomp, &v[i].pubcomp);
+    }
+    if (!rc) {
+        __sum(v, &t);
+        expected = t.window_sent * subscribers;
+        printf("\n");
+        printf("sent       %10"PRIu64" msgs %10.0f msg/s %8.2f MB/s\n", t.window_sent,
+               (double)t.window_sent / duration, t.window_sent_bytes / 1e6 / duration);
+        printf("received   %10"PRIu64" msgs %10.0f msg/s %8.2f MB/s, %"PRIu64" expected\n", t.window_received,
+               (double)t.window_received / duration, t.window_received_bytes / 1e6 / duration, expected);
+        if (t.missed)
+            printf("missed     %10"PRIu64" msgs the publishers fell behind the target rate\n", t.missed);
+        if (t.errors)
+            printf("errors     %10"PRIu64"\n", t.errors);
+        __latency("latency", &latency);
+        __latency("puback", &puback);
+        __latency("pubcomp", &pubcomp);
+    }
+
+    for (i = 0; i < loops; i++) {
+        free(v[i].c);
+        free(v[i].payload);
+    }
+    free(v);
+    for (k = 0; k < topics; k++)
+        free(topic_names[k]);
+    free(topic_names);
+    free(topic_cdf);
+    free(host);
+    free(prefix);
+    free(stats_socket);
+    if (username)
+        free(username);
+    if (password)
+        free(password);
+    return rc;
+}
@@ -0,0 +1,153 @@
+/*
+ * libmqtt_bench_alias.c -- benchmark publish bytes and rate with mqtt v5 topic alias.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "libmqtt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int count = 1000000;
+static int topic_count = 100;
+static int payload_length = 20;
+
+static long long bytes = 0;
+
+static char **topics = 0;
+
+
+static void
+usage(void) {
+    printf("libmqtt_bench_alias measures publish bytes and rate with and without mqtt v5 topic alias.\n\n");
+    printf("Usage: libmqtt_bench_alias [-n count] [-t topics] [-s payload_size]\n\n");
+    printf(" -n : messages to publish for each case. Defaults to 1000000.\n");
+    printf(" -t : distinct topics to publish to. Defaults to 100.\n");
+    printf(" -s : payload size in bytes. Defaults to 20.\n");
+    exit(0);
+}
+
+static void
+config(int argc, char *argv[]) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i < argc-1) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i < argc-1) {
+            topic_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i < argc-1) {
+            payload_length = atoi(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (count < 1 || topic_count < 1 || payload_length < 0)
+        usage();
+}
+
+static int
+__write(void *io, const char *data, int size) {
+    (void)io;
+    (void)data;
+
+    bytes += size;
+    return size;
+}
+
+static double
+__now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *name, enum mqtt_vsn vsn, int alias_max, const char *payload) {
+    struct libmqtt *mqtt;
+    struct libmqtt_cb cb;
+    char connack[] = {0x20, 0x06, 0x00, 0x00, 0x03, PROPERTY_TOPIC_ALIAS_MAXIMUM,
+                      (alias_max >> 8) & 0xff, alias_max & 0xff};
+    double t;
+    int i, rc;
+
+    memset(&cb, 0, sizeof cb);
+    rc = libmqtt__create(&mqtt, "libmqtt_bench_alias", 0, &cb);
+    if (!rc) rc = libmqtt__version(mqtt, vsn);
+    if (!rc) rc = libmqtt__connect(mqtt, 0, __write);
+    if (!rc && vsn == MQTT_PROTO_V5) {
+        rc = libmqtt__read(mqtt, connack, sizeof connack);
+    }
+    if (rc) {
+        fprintf(stderr, "%s: %s\n", name, libmqtt__strerror(rc));
+        exit(1);
+    }
+
+    bytes = 0;
+    srand(1);
+    t = __now();
+    for (i = 0; i < count; i++) {
+        libmqtt__publish(mqtt, 0, topics[rand() % topic_count], MQTT_QOS_0, 0, payload, payload_length);
+    }
+    t = __now() - t;
+
+    printf("%-24s %10d msgs %8.1f bytes/msg %12.0f msgs/s %8.1f MB/s\n",
+           name, count, (double)bytes / count, count / t, bytes / t / 1e6);
+    libmqtt__destroy(mqtt);
+}
+
+int
+main(int argc, char *argv[]) {
+    char *payload;
+    char name[64];
+    int i;
+
+    config(argc, argv);
+
+    topics = malloc(topic_count * sizeof(char *));
+    for (i = 0; i < topic_count; i++) {
+        topics[i] = malloc(128);
+        snprintf(topics[i], 128, "fleet/region-%02d/site-%03d/%08x-%04x-%04x-%04x-%012x/sensor/temperature",
+                 i % 16, i % 1000, i * 2654435761u, i & 0xffff, 0x4000 | (i & 0x0fff), 0x8000 | (i & 0x3fff), i);
+    }
+    payload = malloc(payload_length + 1);
+    memset(payload, 'x', payload_length);
+
+    printf("%d topics of %d bytes, %d bytes payload, qos 0\n", topic_count, (int)strlen(topics[0]), payload_length);
+    bench("mqttv311", MQTT_PROTO_V4, 0, payload);
+    bench("mqttv5 no alias", MQTT_PROTO_V5, 0, payload);
+    snprintf(name, sizeof name, "mqttv5 alias max %d", topic_count);
+    bench(name, MQTT_PROTO_V5, topic_count < 65535 ? topic_count : 65535, payload);
+    if (topic_count > 1) {
+        snprintf(name, sizeof name, "mqttv5 alias max %d", topic_count / 2);
+        bench(name, MQTT_PROTO_V5, topic_count / 2 < 65535 ? topic_count / 2 : 65535, payload);
+    }
+
+    for (i = 0; i < topic_count; i++)
+        free(topics[i]);
+    free(topics);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,541 @@
+/*
+ * libmqtt_bench_codec.c -- benchmark mqtt packet serializing and parsing.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* the codec is built header only with both roles, libmqtt.la carries the client side only. */
+#define MQTT_IMPLEMENTATION
+#include "mqtt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* parse streams hold at least this many bytes of back to back packets. */
+#define STREAM  65536
+
+enum format {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+};
+
+static double seconds = 0.05;
+static enum mqtt_vsn vsn = MQTT_PROTO_V4;
+static enum format format = FORMAT_TEXT;
+static int max_payload = 16 * 1024 * 1024;
+static const char *only = 0;
+static int utf8 = 1;
+static int check_only = 0;
+
+static const int payload_sizes[] = {0, 16, 256, 4096, 65536, 1024 * 1024, 16 * 1024 * 1024};
+static const int topic_sizes[] = {8, 64, 512};
+static const int read_sizes[] = {1, 16, 256, 4096, 0};
+
+#define COUNT(a) (int)(sizeof(a) / sizeof(a[0]))
+
+static char *payload = 0;
+static char topic[512];
+
+static long long allocs = 0;
+static long long packets = 0;
+
+
+static void
+usage(void) {
+    printf("libmqtt_bench_codec measures mqtt__serialize and mqtt__parse for every packet type.\n\n");
+    printf("Usage: libmqtt_bench_codec [-t seconds] [-v 4|5] [-f text|csv|json] [-m max_payload] [-p type] [-u 0|1] [-c]\n\n");
+    printf(" -t : minimum time spent on each case. Defaults to 0.05.\n");
+    printf(" -v : mqtt protocol version. Defaults to 4.\n");
+    printf(" -f : output format, csv and json (one object per line) are meant for tracking. Defaults to text.\n");
+    printf(" -m : largest PUBLISH payload in bytes. Defaults to 16777216.\n");
+    printf(" -p : only run one packet type, for example PUBLISH.\n");
+    printf(" -u : utf-8 checking of topics, client ids and usernames. Defaults to 1.\n");
+    printf(" -c : only run the utf-8 kernel equivalence check against the scalar reference.\n");
+    printf("\nread is the bytes handed to mqtt__parse per call, 0 is the whole stream at once.\n");
+    exit(0);
+}
+
+static void
+config(int argc, char *argv[]) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i < argc-1) {
+            seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-v") && i < argc-1) {
+            vsn = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-f") && i < argc-1) {
+            i++;
+            if (!strcmp(argv[i], "text")) {
+                format = FORMAT_TEXT;
+            } else if (!strcmp(argv[i], "csv")) {
+                format = FORMAT_CSV;
+            } else if (!strcmp(argv[i], "json")) {
+                format = FORMAT_JSON;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-m") && i < argc-1) {
+            max_payload = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-p") && i < argc-1) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "-u") && i < argc-1) {
+            utf8 = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-c")) {
+            check_only = 1;
+        } else {
+            usage();
+        }
+    }
+    if (seconds <= 0 || (vsn != MQTT_PROTO_V4 && vsn != MQTT_PROTO_V5) || max_payload < 0)
+        usage();
+}
+
+static double
+__now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+__malloc(void *ud, size_t size) {
+    (void)ud;
+
+    allocs++;
+    return malloc(size);
+}
+
+static void *
+__realloc(void *ud, void *ptr, size_t size) {
+    (void)ud;
+
+    allocs++;
+    return realloc(ptr, size);
+}
+
+static void
+__free(void *ud, void *ptr) {
+    (void)ud;
+
+    free(ptr);
+}
+
+static int
+__on_packet(void *ud, struct mqtt_packet *pkt) {
+    (void)ud;
+    (void)pkt;
+
+    packets++;
+    return 0;
+}
+
+/* does the packet type carry a topic or a payload worth sweeping. */
+static int
+__has_topic(enum mqtt_p_type type) {
+    return type == CONNECT || type == PUBLISH || type == SUBSCRIBE || type == UNSUBSCRIBE;
+}
+
+static void
+__build(struct mqtt_packet *p, enum mqtt_p_type type, int topic_n, int payload_n) {
+    memset(p, 0, sizeof *p);
+    p->h.type = type;
+    p->vsn = vsn;
+    switch (type) {
+    case CONNECT:
+        p->v.connect.proto_ver = vsn;
+        p->v.connect.proto_name.s = (char *)MQTT_PROTOCOL_NAMES[vsn];
+        p->v.connect.proto_name.n = strlen(p->v.connect.proto_name.s);
+        p->v.connect.client_id.s = "libmqtt_bench_codec";
+        p->v.connect.client_id.n = strlen(p->v.connect.client_id.s);
+        p->v.connect.clean_sess = 1;
+        p->v.connect.keep_alive = 30;
+        p->v.connect.will_flag = 1;
+        p->v.connect.will_qos = MQTT_QOS_1;
+        p->v.connect.will_topic.s = topic;
+        p->v.connect.will_topic.n = topic_n;
+        p->v.connect.will_payload.s = payload;
+        p->v.connect.will_payload.n = 16;
+        p->v.connect.username.s = "user";
+        p->v.connect.username.n = 4;
+        p->v.connect.password.s = "password";
+        p->v.connect.password.n = 8;
+        break;
+    case PUBLISH:
+        p->h.qos = MQTT_QOS_1;
+        p->v.publish.topic_name.s = topic;
+        p->v.publish.topic_name.n = topic_n;
+        p->v.publish.packet_id = 1;
+        p->payload.s = payload;
+        p->payload.n = payload_n;
+        break;
+    case PUBACK:
+    case PUBREC:
+    case PUBREL:
+    case PUBCOMP:
+        p->v.puback.packet_id = 1;
+        break;
+    case SUBSCRIBE:
+        p->v.subscribe.packet_id = 1;
+        p->v.subscribe.topic_name[0].s = topic;
+        p->v.subscribe.topic_name[0].n = topic_n;
+        p->v.subscribe.qos[0] = MQTT_QOS_1;
+        p->v.subscribe.n = 1;
+        break;
+    case SUBACK:
+        p->v.suback.packet_id = 1;
+        p->v.suback.qos[0] = MQTT_QOS_1;
+        p->v.suback.n = 1;
+        break;
+    case UNSUBSCRIBE:
+        p->v.unsubscribe.packet_id = 1;
+        p->v.unsubscribe.topic_name[0].s = topic;
+        p->v.unsubscribe.topic_name[0].n = topic_n;
+        p->v.unsubscribe.n = 1;
+        break;
+    case UNSUBACK:
+        p->v.unsuback.packet_id = 1;
+        p->v.unsuback.reason_code[0] = 0;
+        p->v.unsuback.n = 1;
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+__report(const char *op, enum mqtt_p_type type, int topic_n, int payload_n, int read,
+         long long ops, double t, long long bytes, long long n_allocs) {
+    double ns, mbs, apo;
+
+    ns = t * 1e9 / ops;
+    mbs = bytes / t / 1e6;
+    apo = (double)n_allocs / ops;
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("%-9s %-11s %5d %9d %5d %10lld %12.1f %10.1f %9.2f\n",
+               op, MQTT_TYPE_NAMES[type], topic_n, payload_n, read, ops, ns, mbs, apo);
+        break;
+    case FORMAT_CSV:
+        printf("%s,%s,%d,%d,%d,%d,%lld,%.2f,%.2f,%.3f\n",
+               op, MQTT_TYPE_NAMES[type], vsn, topic_n, payload_n, read, ops, ns, mbs, apo);
+        break;
+    case FORMAT_JSON:
+        printf("{\"op\":\"%s\",\"type\":\"%s\",\"vsn\":%d,\"topic\":%d,\"payload\":%d,\"read\":%d,"
+               "\"ops\":%lld,\"ns_op\":%.2f,\"mb_s\":%.2f,\"allocs_op\":%.3f}\n",
+               op, MQTT_TYPE_NAMES[type], vsn, topic_n, payload_n, read, ops, ns, mbs, apo);
+        break;
+    }
+    fflush(stdout);
+}
+
+static void
+bench_serialize(enum mqtt_p_type type, int topic_n, int payload_n) {
+    struct mqtt_packet p;
+    struct mqtt_b b;
+    long long ops, batch, bytes, i;
+    double t, e;
+
+    __build(&p, type, topic_n, payload_n);
+    ops = 0;
+    bytes = 0;
+    allocs = 0;
+    batch = 1;
+    t = __now();
+    do {
+        for (i = 0; i < batch; i++) {
+            if (mqtt__serialize(&p, &b)) {
+                fprintf(stderr, "serialize %s: error\n", MQTT_TYPE_NAMES[type]);
+                exit(1);
+            }
+            bytes += b.n;
+            mqtt_b_free(&b);
+        }
+        ops += batch;
+        if (batch < (1 << 16))
+            batch *= 2;
+        e = __now() - t;
+    } while (e < seconds);
+    __report("serialize", type, __has_topic(type) ? topic_n : 0, type == PUBLISH ? payload_n : 0,
+             0, ops, e, bytes, allocs);
+}
+
+/* parse back to back copies of one packet, handed over read bytes at a time. */
+static void
+bench_parse(enum mqtt_p_type type, int topic_n, int payload_n, int read) {
+    struct mqtt_packet p;
+    struct mqtt_parser parser;
+    struct mqtt_b b, in;
+    char *stream;
+    long long ops, batch, bytes, per, i;
+    int n, k, o, t_i;
+    double t, e;
+
+    __build(&p, type, topic_n, payload_n);
+    if (mqtt__serialize(&p, &b)) {
+        fprintf(stderr, "serialize %s: error\n", MQTT_TYPE_NAMES[type]);
+        exit(1);
+    }
+    per = b.n < STREAM ? (STREAM + b.n - 1) / b.n : 1;
+    n = (int)(per * b.n);
+    stream = malloc(n);
+    if (!stream) {
+        fprintf(stderr, "parse %s: out of memory\n", MQTT_TYPE_NAMES[type]);
+        exit(1);
+    }
+    for (i = 0; i < per; i++)
+        memcpy(stream + i * b.n, b.s, b.n);
+    mqtt_b_free(&b);
+
+    mqtt__parse_init(&parser);
+    parser.auth = type != CONNECT;
+    parser.vsn = vsn;
+    for (t_i = CONNECT; t_i < MQTT_MAX_TYPE; t_i++)
+        mqtt__parse_cb(&parser, t_i, __on_packet);
+
+    ops = 0;
+    bytes = 0;
+    packets = 0;
+    allocs = 0;
+    batch = 1;
+    t = __now();
+    do {
+        for (i = 0; i < batch; i++) {
+            for (o = 0; o < n; o += k) {
+                k = read > 0 && read < n - o ? read : n - o;
+                in.s = stream + o;
+                in.n = k;
+                if (mqtt__parse(&parser, 0, &in)) {
+                    fprintf(stderr, "parse %s: error\n", MQTT_TYPE_NAMES[type]);
+                    exit(1);
+                }
+            }
+            bytes += n;
+        }
+        ops += batch * per;
+        if (batch * per < (1 << 16))
+            batch *= 2;
+        e = __now() - t;
+    } while (e < seconds);
+    if (packets != ops) {
+        fprintf(stderr, "parse %s: %lld packets for %lld ops\n", MQTT_TYPE_NAMES[type], packets, ops);
+        exit(1);
+    }
+    __report("parse", type, __has_topic(type) ? topic_n : 0, type == PUBLISH ? payload_n : 0,
+             read, ops, e, bytes, allocs);
+    mqtt__parse_free(&parser);
+    free(stream);
+}
+
+/* append code point c, returns its length. */
+static int
+__utf8_put(char *s, uint32_t c) {
+    if (c < 0x80) {
+        s[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        s[0] = (char)(0xc0 | c >> 6);
+        s[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000) {
+        s[0] = (char)(0xe0 | c >> 12);
+        s[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        s[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    s[0] = (char)(0xf0 | c >> 18);
+    s[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    s[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    s[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+/* well formed utf-8 of at most len bytes, wide of every 16 characters above ascii on average. */
+static int
+__utf8_gen(char *s, int len, int wide) {
+    static const uint32_t edges[] = {0x01, 0x7f, 0x80, 0x7ff, 0x800, 0xfff, 0x1000, 0xd7ff, 0xe000,
+                                     0xffff, 0x10000, 0x3ffff, 0x40000, 0xfffff, 0x100000, 0x10ffff};
+    char c[4];
+    uint32_t cp;
+    int n, k;
+
+    n = 0;
+    for (;;) {
+        switch (rand() % 16 < wide ? rand() % 4 : -1) {
+        case 0: cp = 0x80 + rand() % 0x780; break;
+        case 1: cp = 0x800 + rand() % 0xf800; if (cp >= 0xd800 && cp < 0xe000) cp -= 0x800; break;
+        case 2: cp = 0x10000 + rand() % 0x100000; break;
+        case 3: cp = edges[rand() % (sizeof edges / sizeof edges[0])]; break;
+        default: cp = 'a' + rand() % 26; break;
+        }
+        k = __utf8_put(c, cp);
+        if (n + k > len)
+            return n;
+        memcpy(s + n, c, k);
+        n += k;
+    }
+}
+
+/* break s the ways the kernels must catch: bad leads, lone or missing continuations, overlongs,
+ * surrogates, code points above U+10FFFF and U+0000. */
+static void
+__utf8_mutate(char *s, int n) {
+    static const char *bad[] = {"\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf", "\xed\xa0\x80",
+                                "\xed\xbf\xbf", "\xf0\x80\x80\x80", "\xf0\x8f\xbf\xbf", "\xf4\x90\x80\x80",
+                                "\xf5\x80\x80\x80", "\xf8\x88\x80\x80", "\xff", "\xfe", "\xc2", "\xe1\x80",
+                                "\xf1\x80\x80", "\x80", "\xbf"};
+    const char *b;
+    int i, k;
+
+    if (n == 0)
+        return;
+    i = rand() % n;
+    switch (rand() % 6) {
+    case 0:
+        s[i] = (char)(rand() % 256);
+        break;
+    case 1:
+        s[i] = 0;
+        break;
+    case 2:
+        s[i] ^= (char)0x80;
+        break;
+    case 3:
+        s[i] = (char)(0x80 + rand() % 0x40);
+        break;
+    default:
+        b = bad[rand() % (sizeof bad / sizeof bad[0])];
+        k = strlen(b);
+        if (i + k > n)
+            i = n - k > 0 ? n - k : 0;
+        memcpy(s + i, b, i + k > n ? n - i : k);
+        break;
+    }
+}
+
+/* compare every kernel with __utf8_scalar on valid and mutated strings, each at every
+ * alignment and cut to every length, so all vector tails and sequences split across them run. */
+static int
+check_utf8(void) {
+    char src[256], buf[32 + 256];
+    int sse2, avx2, strings, len, n, off, i, ref, got, s;
+
+    sse2 = 0 == mqtt__simd_set(MQTT_SIMD_SSE2);
+    avx2 = 0 == mqtt__simd_set(MQTT_SIMD_AVX2);
+    srand(1);
+    strings = 500;
+    for (i = 0; i < strings; i++) {
+        /* mostly ascii strings leave whole vectors to the fast paths. */
+        len = __utf8_gen(src, rand() % (int)sizeof src, i % 3 ? rand() % 3 : rand() % 17);
+        if (i % 4)
+            __utf8_mutate(src, len);
+        for (n = 0; n <= len; n++) {
+            for (off = 0; off < 32; off++) {
+                memcpy(buf + off, src, n);
+                ref = __utf8_scalar(buf + off, 0, n);
+#ifdef MQTT_SIMD_X86
+                /* the widths __utf8_valid hands each kernel. */
+                if (sse2 && n >= 16 && (got = __utf8_sse2(buf + off, n)) != ref) {
+                    fprintf(stderr, "utf8 sse2 mismatch, len %d, offset %d, string %d: %d != %d\n", n, off, i, got, ref);
+                    return -1;
+                }
+                if (avx2 && n >= 64 && (got = __utf8_avx2(buf + off, n)) != ref) {
+                    fprintf(stderr, "utf8 avx2 mismatch, len %d, offset %d, string %d: %d != %d\n", n, off, i, got, ref);
+                    return -1;
+                }
+#endif
+                for (s = MQTT_SIMD_SCALAR; s <= MQTT_SIMD_AVX2; s++) {
+                    if (mqtt__simd_set(s))
+                        continue;
+                    if ((got = mqtt__utf8_valid(buf + off, n)) != ref) {
+                        fprintf(stderr, "utf8 mqtt__utf8_valid mismatch with simd %d, len %d, offset %d, string %d\n",
+                                s, n, off, i);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+    mqtt__simd_set(MQTT_SIMD_AUTO);
+    printf("utf8 equivalent: scalar%s%s, %d strings at every length and 32 alignments\n",
+           sse2 ? " sse2" : "", avx2 ? " avx2" : "", strings);
+    return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    enum mqtt_p_type type;
+    int i, j, r, topics, payloads;
+
+    config(argc, argv);
+
+    if (check_utf8())
+        return 1;
+    if (check_only)
+        return 0;
+
+    payload = malloc(max_payload > 16 ? max_payload : 16);
+    memset(payload, 'x', max_payload > 16 ? max_payload : 16);
+    memcpy(topic, "bench/", 6);
+    for (i = 6; i < (int)sizeof topic; i++)
+        topic[i] = 'a' + i % 26;
+    mqtt__set_allocator(__malloc, __realloc, __free, 0);
+    mqtt__utf8_check(utf8);
+
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("mqtt v%d, at least %.2fs per case, ns and allocs per packet\n", vsn, seconds);
+        printf("%-9s %-11s %5s %9s %5s %10s %12s %10s %9s\n",
+               "op", "type", "topic", "payload", "read", "ops", "ns/op", "MB/s", "allocs/op");
+        break;
+    case FORMAT_CSV:
+        printf("op,type,vsn,topic,payload,read,ops,ns_op,mb_s,allocs_op\n");
+        break;
+    case FORMAT_JSON:
+        break;
+    }
+
+    for (type = CONNECT; type < MQTT_MAX_TYPE; type++) {
+        if (only && strcmp(only, MQTT_TYPE_NAMES[type]))
+            continue;
+        topics = __has_topic(type) ? COUNT(topic_sizes) : 1;
+        payloads = type == PUBLISH ? COUNT(payload_sizes) : 1;
+        for (i = 0; i < topics; i++) {
+            for (j = 0; j < payloads; j++) {
+                if (payload_sizes[j] > max_payload)
+                    continue;
+                bench_serialize(type, topic_sizes[i], payload_sizes[j]);
+                for (r = 0; r < COUNT(read_sizes); r++)
+                    bench_parse(type, topic_sizes[i], payload_sizes[j], read_sizes[r]);
+            }
+        }
+    }
+
+    mqtt__set_allocator(0, 0, 0, 0);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,413 @@
+/*
+ * libmqtt_bench_topic.c -- benchmark topic split and topic filter match kernels.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "libmqtt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TOPICS  1024
+
+static int count = 1000000;
+static int filter_count = 1000;
+static int check_only = 0;
+
+static volatile int sink = 0;
+
+static const char *simd_names[] = {
+    [MQTT_SIMD_AUTO] = "auto",
+    [MQTT_SIMD_SCALAR] = "scalar",
+    [MQTT_SIMD_SSE2] = "sse2",
+    [MQTT_SIMD_AVX2] = "avx2",
+};
+
+struct corpus {
+    const char *name;
+    const char *filter;
+    char *topic[TOPICS];
+    int n[TOPICS];
+};
+
+static struct corpus corpora[] = {
+    {.name = "iot", .filter = "fleet/+/+/+/sensor/#"},
+    {.name = "sparkplug", .filter = "spBv1.0/+/DDATA/#"},
+    {.name = "short", .filter = "dev/+/cmd"},
+    {.name = "deep", .filter = "l00/l01/+/l03/l04/l05/l06/l07/l08/l09/l10/l11/l12/l13/l14/+/l16/l17/l18/#"},
+};
+
+#define CORPORA (int)(sizeof corpora / sizeof corpora[0])
+
+
+static void
+usage(void) {
+    printf("libmqtt_bench_topic measures topic split and topic filter match kernels.\n\n");
+    printf("Usage: libmqtt_bench_topic [-n count] [-f filters] [-c]\n\n");
+    printf(" -n : iterations for each case. Defaults to 1000000.\n");
+    printf(" -f : filters in the routing case. Defaults to 1000.\n");
+    printf(" -c : only run the equivalence check against the scalar reference.\n");
+    exit(0);
+}
+
+static void
+config(int argc, char *argv[]) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i < argc-1) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-f") && i < argc-1) {
+            filter_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-c")) {
+            check_only = 1;
+        } else {
+            usage();
+        }
+    }
+    if (count < 1 || filter_count < 1)
+        usage();
+}
+
+static double
+__now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* scalar reference, one byte at a time. */
+static int
+__ref_split(const char *s, int n, int *sep, int max) {
+    int i, c;
+
+    c = 0;
+    for (i = 0; i < n; i++) {
+        if (s[i] == '/') {
+            if (c == max) return c + 1;
+            sep[c++] = i;
+        }
+    }
+    return c;
+}
+
+static void
+__count(void *ud, void *value) {
+    (void)value;
+
+    (*(int *)ud)++;
+}
+
+static int
+__check_split(enum mqtt_simd simd) {
+    static const int maxs[] = {0, 3, MQTT_MAX_LEVEL};
+    char buf[512];
+    int sep[512], ref[512];
+    int len, bits, off, i, k, c, r;
+
+    /* every separator pattern up to 14 bytes, at every alignment. */
+    for (len = 0; len <= 14; len++) {
+        for (bits = 0; bits < 1 << len; bits++) {
+            for (off = 0; off < 32; off++) {
+                for (i = 0; i < len; i++)
+                    buf[off + i] = (bits >> i) & 1 ? '/' : 'a';
+                for (k = 0; k < 3; k++) {
+                    c = mqtt__topic_split(buf + off, len, sep, maxs[k]);
+                    r = __ref_split(buf + off, len, ref, maxs[k]);
+                    if (c != r || memcmp(sep, ref, (r < maxs[k] ? r : maxs[k]) * sizeof(int))) {
+                        fprintf(stderr, "%s: split mismatch, len %d, pattern %x, offset %d\n",
+                                simd_names[simd], len, bits, off);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+    /* random patterns across the vector widths and their tails. */
+    srand(1);
+    for (i = 0; i < 100000; i++) {
+        len = rand() % 300;
+        off = rand() % 32;
+        for (k = 0; k < len; k++)
+            buf[off + k] = rand() % 4 ? 'a' + rand() % 26 : '/';
+        c = mqtt__topic_split(buf + off, len, sep, 512);
+        r = __ref_split(buf + off, len, ref, 512);
+        if (c != r || memcmp(sep, ref, r * sizeof(int))) {
+            fprintf(stderr, "%s: split mismatch, random len %d\n", simd_names[simd], len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* every valid filter over "ab/+#" up to 5 bytes, every topic over "ab/$" up to 6 bytes. */
+static int
+__check_match(enum mqtt_simd simd) {
+    static const char falpha[] = "ab/+#";
+    static const char talpha[] = "ab/$";
+    char (*filters)[8], (*topics)[8];
+    struct mqtt_trie *all;
+    int nf, nt, len, i, j, k, x, rc;
+
+    filters = malloc(4096 * sizeof *filters);
+    topics = malloc(8192 * sizeof *topics);
+    nf = nt = 0;
+    for (len = 1; len <= 6; len++) {
+        for (x = 1, k = 0; k < len; k++)
+            x *= 4;
+        for (i = 0; i < x; i++) {
+            for (j = i, k = 0; k < len; k++, j /= 4)
+                topics[nt][k] = talpha[j % 4];
+            topics[nt++][len] = 0;
+        }
+        if (len > 5)
+            continue;
+        for (x = 1, k = 0; k < len; k++)
+            x *= 5;
+        for (i = 0; i < x; i++) {
+            for (j = i, k = 0; k < len; k++, j /= 5)
+                filters[nf][k] = falpha[j % 5];
+            filters[nf][len] = 0;
+            if (mqtt__topic_valid(filters[nf], len, 1))
+                nf++;
+        }
+    }
+
+    rc = 0;
+    all = mqtt__trie_create();
+    for (i = 0; i < nf && !rc; i++) {
+        struct mqtt_filter *f;
+        struct mqtt_trie *t;
+        int fn;
+
+        fn = strlen(filters[i]);
+        f = mqtt__filter_compile(filters[i], fn);
+        t = mqtt__trie_create();
+        mqtt__trie_insert(t, filters[i], fn, filters[i]);
+        mqtt__trie_insert(all, filters[i], fn, filters[i]);
+        for (j = 0; j < nt; j++) {
+            int tn, ref;
+
+            tn = strlen(topics[j]);
+            ref = mqtt__topic_match(filters[i], fn, topics[j], tn);
+            if (mqtt__filter_match(f, topics[j], tn) != ref
+                || mqtt__trie_match(t, topics[j], tn, 0, 0) != ref) {
+                fprintf(stderr, "%s: match mismatch, filter '%s', topic '%s', expected %d\n",
+                        simd_names[simd], filters[i], topics[j], ref);
+                rc = -1;
+                break;
+            }
+        }
+        mqtt__trie_destroy(t);
+        mqtt__filter_free(f);
+    }
+    for (j = 0; j < nt && !rc; j++) {
+        int tn, ref, got;
+
+        tn = strlen(topics[j]);
+        for (ref = 0, i = 0; i < nf; i++)
+            ref += mqtt__topic_match(filters[i], strlen(filters[i]), topics[j], tn);
+        got = 0;
+        if (mqtt__trie_match(all, topics[j], tn, __count, &got) != ref || got != ref) {
+            fprintf(stderr, "%s: trie mismatch, topic '%s', expected %d matches\n", simd_names[simd], topics[j], ref);
+            rc = -1;
+        }
+    }
+    mqtt__trie_destroy(all);
+    if (!rc)
+        printf("%-8s equivalent: split patterns, %d filters x %d topics\n", simd_names[simd], nf, nt);
+    free(filters);
+    free(topics);
+    return rc;
+}
+
+static void
+__corpus_init(void) {
+    int c, i, k;
+
+    srand(2);
+    for (c = 0; c < CORPORA; c++) {
+        for (i = 0; i < TOPICS; i++) {
+            char buf[256];
+
+            switch (c) {
+            case 0:
+                snprintf(buf, sizeof buf, "fleet/region-%02d/site-%03d/%08x-%04x-%04x-%04x-%012x/sensor/%s",
+                         i % 16, i % 1000, i * 2654435761u, i & 0xffff, 0x4000 | (i & 0x0fff),
+                         0x8000 | (i & 0x3fff), i, i % 3 ? "temperature" : "humidity");
+                break;
+            case 1:
+                snprintf(buf, sizeof buf, "spBv1.0/group-%d/%s/edge-node-%d/device-%d",
+                         i % 8, i % 5 ? "DDATA" : "NDATA", i % 64, i);
+                break;
+            case 2:
+                snprintf(buf, sizeof buf, "dev/%d/%s", i, i % 4 ? "cmd" : "ack");
+                break;
+            default:
+                buf[0] = 0;
+                for (k = 0; k < 20; k++) {
+                    char level[16];
+                    snprintf(level, sizeof level, k == 2 || k == 15 ? "%sx%d" : "%sl%02d", k ? "/" : "", k == 2 || k == 15 ? i : k);
+                    strcat(buf, level);
+                }
+                break;
+            }
+            corpora[c].topic[i] = strdup(buf);
+            corpora[c].n[i] = strlen(buf);
+        }
+    }
+}
+
+static void
+__bench_kernels(struct corpus *cp) {
+    struct mqtt_filter *f;
+    int sep[MQTT_MAX_LEVEL];
+    long long bytes;
+    double t;
+    int i, s, fn, hits;
+
+    for (bytes = 0, i = 0; i < TOPICS; i++)
+        bytes += cp->n[i];
+    printf("\n%s: %d topics, %.1f bytes/topic, filter %s\n", cp->name, TOPICS, (double)bytes / TOPICS, cp->filter);
+
+    fn = strlen(cp->filter);
+    hits = 0;
+    t = __now();
+    for (i = 0; i < count; i++)
+        hits += mqtt__topic_match(cp->filter, fn, cp->topic[i % TOPICS], cp->n[i % TOPICS]);
+    t = __now() - t;
+    sink += hits;
+    printf("  %-8s %-6s %8.1f ns/op %12.0f ops/s\n", "bytewise", "match", t / count * 1e9, count / t);
+
+    f = mqtt__filter_compile(cp->filter, fn);
+    for (s = MQTT_SIMD_SCALAR; s <= MQTT_SIMD_AVX2; s++) {
+        if (mqtt__simd_set(s))
+            continue;
+        t = __now();
+        for (i = 0; i < count; i++)
+            sink += mqtt__topic_split(cp->topic[i % TOPICS], cp->n[i % TOPICS], sep, MQTT_MAX_LEVEL);
+        t = __now() - t;
+        printf("  %-8s %-6s %8.1f ns/op %12.0f ops/s %8.2f GB/s\n", simd_names[s], "split",
+               t / count * 1e9, count / t, (double)bytes / TOPICS * count / t / 1e9);
+        hits = 0;
+        t = __now();
+        for (i = 0; i < count; i++)
+            hits += mqtt__filter_match(f, cp->topic[i % TOPICS], cp->n[i % TOPICS]);
+        t = __now() - t;
+        sink += hits;
+        printf("  %-8s %-6s %8.1f ns/op %12.0f ops/s\n", simd_names[s], "match", t / count * 1e9, count / t);
+    }
+    mqtt__filter_free(f);
+    mqtt__simd_set(MQTT_SIMD_AUTO);
+}
+
+/* route the iot corpus through filter_count filters, linear scan against the trie. */
+static void
+__bench_route(void) {
+    struct corpus *cp;
+    struct mqtt_trie *t;
+    char **filters;
+    int i, j, n, hits;
+    double tl, tt;
+
+    cp = &corpora[0];
+    filters = malloc(filter_count * sizeof(char *));
+    t = mqtt__trie_create();
+    for (i = 0; i < filter_count; i++) {
+        char buf[256];
+
+        switch (i % 4) {
+        case 0:
+            snprintf(buf, sizeof buf, "fleet/region-%02d/site-%03d/#", i % 16, i % 1000);
+            break;
+        case 1:
+            snprintf(buf, sizeof buf, "fleet/+/site-%03d/+/sensor/temperature", i % 1000);
+            break;
+        case 2:
+            snprintf(buf, sizeof buf, "fleet/region-%02d/+/%08x-%04x-%04x-%04x-%012x/#",
+                     i % 16, i * 2654435761u, i & 0xffff, 0x4000 | (i & 0x0fff), 0x8000 | (i & 0x3fff), i);
+            break;
+        default:
+            snprintf(buf, sizeof buf, "fleet/region-%02d/site-%03d/+/sensor/humidity", i % 16, i % 1000);
+            break;
+        }
+        filters[i] = strdup(buf);
+        mqtt__trie_insert(t, buf, strlen(buf), filters[i]);
+    }
+
+    n = count / filter_count > 1000 ? count / filter_count : 1000;
+    hits = 0;
+    tl = __now();
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < filter_count; j++)
+            hits += mqtt__topic_match(filters[j], strlen(filters[j]), cp->topic[i % TOPICS], cp->n[i % TOPICS]);
+    }
+    tl = __now() - tl;
+    sink += hits;
+    hits = 0;
+    tt = __now();
+    for (i = 0; i < n; i++)
+        hits += mqtt__trie_match(t, cp->topic[i % TOPICS], cp->n[i % TOPICS], 0, 0);
+    tt = __now() - tt;
+    sink += hits;
+
+    printf("\nroute: iot topics through %d filters, %.2f matches/topic\n", filter_count, (double)hits / n);
+    printf("  %-8s %10.1f ns/topic %12.0f topics/s\n", "linear", tl / n * 1e9, n / tl);
+    printf("  %-8s %10.1f ns/topic %12.0f topics/s\n", "trie", tt / n * 1e9, n / tt);
+
+    for (i = 0; i < filter_count; i++)
+        free(filters[i]);
+    free(filters);
+    mqtt__trie_destroy(t);
+}
+
+int
+main(int argc, char *argv[]) {
+    int s, c, i;
+
+    config(argc, argv);
+
+    printf("selected simd kernel: %s\n", simd_names[mqtt__simd_get()]);
+    for (s = MQTT_SIMD_SCALAR; s <= MQTT_SIMD_AVX2; s++) {
+        if (mqtt__simd_set(s))
+            continue;
+        if (__check_split(s) || __check_match(s))
+            return 1;
+    }
+    mqtt__simd_set(MQTT_SIMD_AUTO);
+    if (check_only)
+        return 0;
+
+    __corpus_init();
+    for (c = 0; c < CORPORA; c++)
+        __bench_kernels(&corpora[c]);
+    __bench_route();
+
+    for (c = 0; c < CORPORA; c++) {
+        for (i = 0; i < TOPICS; i++)
+            free(corpora[c].topic[i]);
+    }
+    return 0;
+}
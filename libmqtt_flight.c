@@ -0,0 +1,155 @@
+/*
+ * libmqtt_flight.c -- decode libmqtt flight recorder dumps.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "libmqtt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int hex = 0;
+
+static void
+usage(void) {
+    printf("libmqtt_flight prints the packets kept by a libmqtt flight recorder dump, oldest first.\n\n");
+    printf("Usage: libmqtt_flight [-x] file ...\n");
+    printf("       libmqtt_flight --help\n\n");
+    printf(" -x : print kept payload bytes in hex instead of escaped text.\n");
+    printf(" --help : display this message.\n");
+    exit(0);
+}
+
+/* wall clock as local time with microseconds. */
+static const char *
+__time(int64_t us, int date) {
+    static char buf[64];
+    struct tm tm;
+    time_t sec;
+    int n;
+
+    sec = (time_t)(us / 1000000);
+    localtime_r(&sec, &tm);
+    n = strftime(buf, sizeof buf, date ? "%Y-%m-%d %H:%M:%S" : "%H:%M:%S", &tm);
+    snprintf(buf + n, sizeof buf - n, ".%06d", (int)(us % 1000000));
+    return buf;
+}
+
+static void
+__payload(const unsigned char *s, uint32_t n, int32_t size) {
+    uint32_t i;
+
+    if (n == 0) return;
+    printf(hex ? " " : " \"");
+    for (i = 0; i < n; i++) {
+        if (hex)
+            printf("%02x", s[i]);
+        else if (s[i] == '"' || s[i] == '\\')
+            printf("\\%c", s[i]);
+        else if (s[i] >= 0x20 && s[i] < 0x7f)
+            putchar(s[i]);
+        else
+            printf("\\x%02x", s[i]);
+    }
+    printf(hex ? "%s" : "\"%s", (int32_t)n < size ? "..." : "");
+}
+
+static int
+decode(const char *path) {
+    struct libmqtt_recorder_header h;
+    struct libmqtt_record *r;
+    char *id, *buf, line[256];
+    FILE *f;
+    uint32_t i;
+    int rc;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open %s.\n", path);
+        return -1;
+    }
+    rc = -1;
+    id = buf = 0;
+    if (fread(&h, sizeof h, 1, f) != 1 || h.magic != LIBMQTT_RECORDER_MAGIC) {
+        fprintf(stderr, "Error: %s is not a flight recorder dump.\n", path);
+        goto e;
+    }
+    if (h.version != LIBMQTT_RECORDER_VERSION || h.record_size < sizeof *r || h.client_id_n < 0) {
+        fprintf(stderr, "Error: %s has unsupported version %u.\n", path, h.version);
+        goto e;
+    }
+    id = malloc(h.client_id_n + 1);
+    buf = malloc(h.record_size);
+    if (!id || !buf) {
+        fprintf(stderr, "Error: out of memory.\n");
+        goto e;
+    }
+    if (fread(id, 1, h.client_id_n, f) != (size_t)h.client_id_n) {
+        fprintf(stderr, "Error: %s is truncated.\n", path);
+        goto e;
+    }
+    id[h.client_id_n] = '\0';
+    printf("client %s dumped %s on %s, %u records\n", id, __time(h.real_us, 1),
+           h.reason ? libmqtt__strerror(h.reason) : "demand", h.count);
+
+    r = (struct libmqtt_record *)buf;
+    for (i = 0; i < h.count; i++) {
+        if (fread(buf, h.record_size, 1, f) != 1) {
+            fprintf(stderr, "Error: %s is truncated after %u records.\n", path, i);
+            goto e;
+        }
+        if (r->kept > h.record_size - sizeof *r)
+            r->kept = h.record_size - sizeof *r;
+        libmqtt__trace_format(&r->t, line, sizeof line);
+        printf("%s #%u %s", __time(h.real_us - (h.mono_us - r->t.us), 0), r->t.seq, line);
+        __payload((const unsigned char *)(r + 1), r->kept, r->t.size);
+        printf("\n");
+    }
+    rc = 0;
+
+e:
+    free(id);
+    free(buf);
+    fclose(f);
+    return rc;
+}
+
+int
+main(int argc, char *argv[]) {
+    int i, files, rc;
+
+    files = rc = 0;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage();
+        } else if (!strcmp(argv[i], "-x")) {
+            hex = 1;
+        } else {
+            if (files++) printf("\n");
+            if (decode(argv[i])) rc = 1;
+        }
+    }
+    if (!files) usage();
+    return rc;
+}
@@ -38,6 +38,8 @@ static char *host = 0;
 static int port = 1883;
 static int debug = 0;
 static int quiet = 0;
+static char *stats_socket = 0;
+static char *flight = 0;
 static int pub_mode = MSGMODE_NONE;
 
 static char *client_id = 0;
@@ -70,6 +72,7 @@ usage(void) {
     printf("                     [-i id] [-I id_prefix]\n");
     printf("                     [-d] [--quiet]\n");
     printf("                     [-u username [-P password]]\n");
+    printf("                     [--flight path] [--stats-socket path]\n");
     printf("                     [--will-topic [--will-payload payload] [--will-qos qos] [--will-retain]]\n");
     printf("       libmqtt_pub --help\n\n");
     printf(" -d : enable debug messages.\n");
@@ -90,9 +93,13 @@ usage(void) {
     printf(" -t : mqtt topic to publish to.\n");
     printf(" -u : provide a username (requires MQTT 3.1 broker)\n");
     printf(" -V : specify the version of the MQTT protocol to use when connecting.\n");
-    printf("      Can be mqttv31 or mqttv311. Defaults to mqttv31.\n");
+    printf("      Can be mqttv31, mqttv311 or mqttv5. Defaults to mqttv31.\n");
+    printf(" --flight : keep the last 1024 packets in a flight recorder, dumped to this path on a\n");
+    printf("            timeout or parse error for libmqtt_flight to decode.\n");
     printf(" --help : display this message.\n");
     printf(" --quiet : don't print error messages.\n");
+    printf(" --stats-socket : serve client and event loop counters in prometheus text format on this\n");
+    printf("                  unix socket path.\n");
     printf(" --will-payload : payload for the client Will, which is sent by the broker in case of\n");
     printf("                  unexpected disconnection. If not given and will-topic is set, a zero\n");
     printf("                  length message will be sent.\n");
@@ -216,6 +223,8 @@ config(int argc, char *argv[]) {
                     proto_ver = MQTT_PROTO_V3;
                 } else if (!strcmp(argv[i+1], "mqttv311")) {
                     proto_ver = MQTT_PROTO_V4;
+                } else if (!strcmp(argv[i+1], "mqttv5")) {
+                    proto_ver = MQTT_PROTO_V5;
                 } else {
                     fprintf(stderr, "Error: Invalid protocol version argument given.\n\n");
                     goto e;
@@ -236,6 +245,22 @@ config(int argc, char *argv[]) {
             i++;
         } else if (!strcmp(argv[i], "--quiet")) {
             quiet = 1;
+        } else if (!strcmp(argv[i], "--flight")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --flight argument given but no path specified.\n\n");
+                goto e;
+            } else {
+                flight = strdup(argv[i+1]);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--stats-socket")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --stats-socket argument given but no path specified.\n\n");
+                goto e;
+            } else {
+                stats_socket = strdup(argv[i+1]);
+            }
+            i++;
         } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--retain")) {
             retain = 1;
         } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stdin-file")) {
@@ -426,7 +451,12 @@ __connack(struct libmqtt *mqtt, void *ud, int ack_flags, enum mqtt_connack retur
     (void)ack_flags;
 
     if (return_code != CONNACK_ACCEPTED) {
-        if (!quiet) fprintf(stderr, "%s\n", MQTT_CONNACK_NAMES[return_code]);
+        if (!quiet) {
+            if (MQTT_IS_CONNACK(return_code))
+                fprintf(stderr, "%s\n", MQTT_CONNACK_NAMES[return_code]);
+            else
+                fprintf(stderr, "Connection refused (reason code: %d)\n", return_code);
+        }
         return;
     }
     do_publish(mqtt);
@@ -474,6 +504,7 @@ main(int argc, char *argv[]) {
     aeEventLoop *el;
     struct ae_io *io;
 
+    ae_io__use_zmalloc();
     config(argc, argv);
     if (!host) {
         host = strdup("127.0.0.1");
@@ -526,11 +557,17 @@ main(int argc, char *argv[]) {
     if (username) {
         if (!rc) rc = libmqtt__auth(mqtt, username, password);
     }
+    if (flight) {
+        if (!rc) rc = libmqtt__recorder(mqtt, 1024, 64, flight);
+    }
 
     io = ae_io__connect(el, mqtt, host, port, __disconnect);
     if (!io) {
         return 0;
     }
+    if (stats_socket && AE_ERR == ae_io__stats_server(el, stats_socket)) {
+        return 0;
+    }
 
     if (!rc) rc = libmqtt__connect(mqtt, io, ae_io__write);
     if (rc != LIBMQTT_SUCCESS) {
@@ -544,6 +581,8 @@ main(int argc, char *argv[]) {
     libmqtt__destroy(mqtt);
 
     free(host);
+    free(stats_socket);
+    free(flight);
     free(topic);
     if (client_id)
         free(client_id);
@@ -29,6 +29,8 @@ static char *host = 0;
 static int port = 1883;
 static int debug = 0;
 static int quiet = 0;
+static char *stats_socket = 0;
+static char *flight = 0;
 static int verbose = 0;
 static int msg_count = 0;
 static int msg_cnt = 0;
@@ -48,6 +50,7 @@ static int topic_count = 0;
 static char **topics = 0;
 static int filter_out_count = 0;
 static char **filter_outs = 0;
+static struct mqtt_trie *filter_tree = 0;
 
 static int will_qos = 0;
 static int will_retain = 0;
@@ -65,6 +68,7 @@ usage(void) {
     printf("                     [-i id] [-I id_prefix]\n");
     printf("                     [-d] [-N] [--quiet] [-v]\n");
     printf("                     [-u username [-P password]]\n");
+    printf("                     [--flight path] [--stats-socket path]\n");
     printf("                     [--will-topic [--will-payload payload] [--will-qos qos] [--will-retain]]\n");
     printf("       libmqtt_sub --help\n\n");
     printf(" -c : disable 'clean session' (store subscription and pending messages when client disconnects).\n");
@@ -85,9 +89,13 @@ usage(void) {
     printf(" -u : provide a username (requires MQTT 3.1 broker)\n");
     printf(" -v : print published messages verbosely.\n");
     printf(" -V : specify the version of the MQTT protocol to use when connecting.\n");
-    printf("      Can be mqttv31 or mqttv311. Defaults to mqttv31.\n");
+    printf("      Can be mqttv31, mqttv311 or mqttv5. Defaults to mqttv31.\n");
+    printf(" --flight : keep the last 1024 packets in a flight recorder, dumped to this path on a\n");
+    printf("            timeout or parse error for libmqtt_flight to decode.\n");
     printf(" --help : display this message.\n");
     printf(" --quiet : don't print error messages.\n");
+    printf(" --stats-socket : serve client and event loop counters in prometheus text format on this\n");
+    printf("                  unix socket path.\n");
     printf(" --will-payload : payload for the client Will, which is sent by the broker in case of\n");
     printf("                  unexpected disconnection. If not given and will-topic is set, a zero\n");
     printf("                  length message will be sent.\n");
@@ -184,6 +192,8 @@ config(int argc, char *argv[]) {
                     proto_ver = MQTT_PROTO_V3;
                 } else if (!strcmp(argv[i+1], "mqttv311")){
                     proto_ver = MQTT_PROTO_V4;
+                } else if (!strcmp(argv[i+1], "mqttv5")) {
+                    proto_ver = MQTT_PROTO_V5;
                 } else {
                     fprintf(stderr, "Error: Invalid protocol version argument given.\n\n");
                     goto e;
@@ -204,6 +214,22 @@ config(int argc, char *argv[]) {
             i++;
         } else if (!strcmp(argv[i], "--quiet")) {
             quiet = 1;
+        } else if (!strcmp(argv[i], "--flight")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --flight argument given but no path specified.\n\n");
+                goto e;
+            } else {
+                flight = strdup(argv[i+1]);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--stats-socket")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --stats-socket argument given but no path specified.\n\n");
+                goto e;
+            } else {
+                stats_socket = strdup(argv[i+1]);
+            }
+            i++;
         } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--topic")) {
             if (i == argc-1) {
                 fprintf(stderr, "Error: -t argument given but no topic specified.\n\n");
@@ -300,7 +326,12 @@ __connack(struct libmqtt *mqtt, void *ud, int ack_flags, enum mqtt_connack retur
     (void)ack_flags;
 
     if (return_code != CONNACK_ACCEPTED) {
-        if (!quiet) fprintf(stderr, "%s\n", MQTT_CONNACK_NAMES[return_code]);
+        if (!quiet) {
+            if (MQTT_IS_CONNACK(return_code))
+                fprintf(stderr, "%s\n", MQTT_CONNACK_NAMES[return_code]);
+            else
+                fprintf(stderr, "Connection refused (reason code: %d)\n", return_code);
+        }
         return;
     }
     for (i = 0; i < topic_count; i++)
@@ -331,6 +362,7 @@ __publish(struct libmqtt *mqtt, void *ud, uint16_t id, const char *topic, enum m
     (void)qos;
 
     if (retain == 1 && no_retain == 1) return;
+    if (filter_tree && mqtt__trie_match(filter_tree, topic, strlen(topic), 0, 0) > 0) return;
     if (verbose) {
         if (length) {
             printf("%s ", topic);
@@ -387,6 +419,7 @@ main(int argc, char *argv[]) {
     aeEventLoop *el;
     struct ae_io *io;
 
+    ae_io__use_zmalloc();
     config(argc, argv);
     if (!host) {
         host = strdup("127.0.0.1");
@@ -400,6 +433,19 @@ main(int argc, char *argv[]) {
         if (!quiet) fprintf(stderr, "Error: You must specify a topic to subscribe to.\n");
         return 0;
     }
+    if (filter_out_count > 0) {
+        filter_tree = mqtt__trie_create();
+        if (!filter_tree) {
+            if (!quiet) fprintf(stderr, "out of memory\n");
+            return 0;
+        }
+        for (i = 0; i < filter_out_count; i++) {
+            if (mqtt__trie_insert(filter_tree, filter_outs[i], strlen(filter_outs[i]), filter_outs[i])) {
+                if (!quiet) fprintf(stderr, "Error: Invalid filter topic '%s', are all '+' and '#' wildcards correct?\n", filter_outs[i]);
+                return 0;
+            }
+        }
+    }
 
     if (!client_id) {
         if (!client_id_prefix) {
@@ -426,11 +472,17 @@ main(int argc, char *argv[]) {
     if (username) {
         if (!rc) rc = libmqtt__auth(mqtt, username, password);
     }
+    if (flight) {
+        if (!rc) rc = libmqtt__recorder(mqtt, 1024, 64, flight);
+    }
 
     io = ae_io__connect(el, mqtt, host, port, __disconnect);
     if (!io) {
         return 0;
     }
+    if (stats_socket && AE_ERR == ae_io__stats_server(el, stats_socket)) {
+        return 0;
+    }
 
     if (!rc) rc = libmqtt__connect(mqtt, io, ae_io__write);
     if (rc != LIBMQTT_SUCCESS) {
@@ -444,6 +496,8 @@ main(int argc, char *argv[]) {
     libmqtt__destroy(mqtt);
 
     free(host);
+    free(stats_socket);
+    free(flight);
     if (client_id)
         free(client_id);
     if (client_id_prefix)
@@ -456,6 +510,7 @@ main(int argc, char *argv[]) {
         free(will_topic);
     if (will_payload)
         free(will_payload);
+    mqtt__trie_destroy(filter_tree);
     for (i = 0; i < filter_out_count; i++)
         free(filter_outs[i]);
     free(filter_outs);
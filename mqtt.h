@@ -32,6 +32,9 @@ extern "C" {
 /* max topic/qos per subscribe or unsubscribe. */
 #define MQTT_MAX_SUB 128
 
+/* max subscription identifiers carried by a publish. */
+#define MQTT_MAX_SUBID 32
+
 /* generic includes. */
 #include <stdint.h>
 #include <stdio.h>
@@ -47,14 +50,16 @@ extern "C" {
 
 enum mqtt_vsn {
     MQTT_PROTO_V3 = 0x03,
-    MQTT_PROTO_V4 = 0x04
+    MQTT_PROTO_V4 = 0x04,
+    MQTT_PROTO_V5 = 0x05
 };
 
-#define MQTT_IS_VER(v) (v == MQTT_PROTO_V3 || v == MQTT_PROTO_V4)
+#define MQTT_IS_VER(v) (v == MQTT_PROTO_V3 || v == MQTT_PROTO_V4 || v == MQTT_PROTO_V5)
 
 static const char *MQTT_PROTOCOL_NAMES[] __attribute__((unused)) = {
     [MQTT_PROTO_V3] = "MQIsdp",
     [MQTT_PROTO_V4] = "MQTT",
+    [MQTT_PROTO_V5] = "MQTT",
 };
 
 enum mqtt_qos {
@@ -127,6 +132,42 @@ static const char *MQTT_CONNACK_NAMES[] __attribute__((unused)) = {
 };
 
 
+/* mqtt v5 properties. */
+enum mqtt_property {
+    PROPERTY_PAYLOAD_FORMAT_INDICATOR           = 0x01,
+    PROPERTY_MESSAGE_EXPIRY_INTERVAL            = 0x02,
+    PROPERTY_CONTENT_TYPE                       = 0x03,
+    PROPERTY_RESPONSE_TOPIC                     = 0x08,
+    PROPERTY_CORRELATION_DATA                   = 0x09,
+    PROPERTY_SUBSCRIPTION_IDENTIFIER            = 0x0B,
+    PROPERTY_SESSION_EXPIRY_INTERVAL            = 0x11,
+    PROPERTY_ASSIGNED_CLIENT_IDENTIFIER         = 0x12,
+    PROPERTY_SERVER_KEEP_ALIVE                  = 0x13,
+    PROPERTY_AUTHENTICATION_METHOD              = 0x15,
+    PROPERTY_AUTHENTICATION_DATA                = 0x16,
+    PROPERTY_REQUEST_PROBLEM_INFORMATION        = 0x17,
+    PROPERTY_WILL_DELAY_INTERVAL                = 0x18,
+    PROPERTY_REQUEST_RESPONSE_INFORMATION       = 0x19,
+    PROPERTY_RESPONSE_INFORMATION               = 0x1A,
+    PROPERTY_SERVER_REFERENCE                   = 0x1C,
+    PROPERTY_REASON_STRING                      = 0x1F,
+    PROPERTY_RECEIVE_MAXIMUM                    = 0x21,
+    PROPERTY_TOPIC_ALIAS_MAXIMUM                = 0x22,
+    PROPERTY_TOPIC_ALIAS                        = 0x23,
+    PROPERTY_MAXIMUM_QOS                        = 0x24,
+    PROPERTY_RETAIN_AVAILABLE                   = 0x25,
+    PROPERTY_USER_PROPERTY                      = 0x26,
+    PROPERTY_MAXIMUM_PACKET_SIZE                = 0x27,
+    PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE    = 0x28,
+    PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE  = 0x29,
+    PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE      = 0x2A
+};
+
+#define MQTT_MAX_PROPERTY (PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE+1)
+
+#define MQTT_PROPERTY_BIT(id) (((uint64_t)1) << (id))
+#define MQTT_PROPERTY_HAS(props, id) ((props)->mask & MQTT_PROPERTY_BIT(id))
+
 #define MQTT_PINGREQ            {0xc0, 0x00}
 #define MQTT_PINGRESP           {0xd0, 0x00}
 #define MQTT_DISCONNECT         {0xe0, 0x00}
@@ -137,6 +178,24 @@ static const char *MQTT_CONNACK_NAMES[] __attribute__((unused)) = {
 #define MQTT_UNSUBACK(id)       {0xb0, 0x02, (((id)&0xff00)>>8), ((id)&0x00ff)}
 #define MQTT_CONNACK(caf, crc)  {0x20, 0x02, caf, crc}
 
+/* mqtt v5 properties understood by the codec, others are skipped. */
+struct mqtt_p_properties {
+    uint64_t mask;
+    uint32_t session_expiry_interval;
+    uint32_t maximum_packet_size;
+    uint16_t receive_maximum;
+    uint16_t topic_alias_maximum;
+    uint16_t topic_alias;
+    uint16_t server_keep_alive;
+    uint8_t maximum_qos;
+    uint8_t retain_available;
+    uint8_t wildcard_subscription_available;
+    uint8_t subscription_identifier_available;
+    uint8_t shared_subscription_available;
+    uint32_t subscription_identifier[MQTT_MAX_SUBID];
+    int subscription_identifier_n;
+};
+
 struct mqtt_p_header {
     enum mqtt_p_type type;
     enum mqtt_qos qos;
@@ -171,23 +230,28 @@ struct mqtt_p_connack {
 
 struct mqtt_p_publish {
     struct mqtt_b topic_name;
+    const char *topic_enc;  /* topic_name with its length prefix, written as is when set. */
     uint16_t packet_id;
 };
 
 struct mqtt_p_puback {
     uint16_t packet_id;
+    int reason_code;
 };
 
 struct mqtt_p_pubrec {
     uint16_t packet_id;
+    int reason_code;
 };
 
 struct mqtt_p_pubrel {
     uint16_t packet_id;
+    int reason_code;
 };
 
 struct mqtt_p_pubcomp {
     uint16_t packet_id;
+    int reason_code;
 };
 
 struct mqtt_p_subscribe {
@@ -211,6 +275,8 @@ struct mqtt_p_unsubscribe {
 
 struct mqtt_p_unsuback {
     uint16_t packet_id;
+    uint8_t reason_code[MQTT_MAX_SUB];  /* v5 only, one per topic filter. */
+    int n;
 };
 
 struct mqtt_p_pingreq {
@@ -222,7 +288,7 @@ struct mqtt_p_pingresp {
 };
 
 struct mqtt_p_disconnect {
-    void *dummy;
+    int reason_code;
 };
 
 struct mqtt_packet {
@@ -243,43 +309,112 @@ struct mqtt_packet {
         struct mqtt_p_pingresp pingresp;
         struct mqtt_p_disconnect disconnect;
     } v;
+    struct mqtt_p_properties props;
     struct mqtt_b payload;
+    enum mqtt_vsn vsn;
 };
 
 enum mqtt_parser_state {
     MQTT_ST_FIXED,
     MQTT_ST_LENGTH,
-    MQTT_ST_REMAIN
+    MQTT_ST_REMAIN,
+    MQTT_ST_HEADER,
+    MQTT_ST_STREAM,
+    MQTT_ST_SKIP
 };
 
 typedef int (*mqtt_cb)(void *, struct mqtt_packet *);
 
+/* partial packet buffers up to this size are kept for the next packet. */
+#define MQTT_PARSE_KEEP     16384
+
+/* bump allocator for temporaries that live until the next reset. */
+struct mqtt_arena_block;
+
+struct mqtt_arena {
+    char *s;
+    int n;
+    int size;
+    int high;
+    struct mqtt_arena_block *more;
+};
+
+/* receive memory shared by the parsers of one event loop, limit 0 is unlimited. */
+struct mqtt_budget {
+    int64_t limit;
+    int64_t used;
+    int64_t peak;
+    uint64_t dropped;
+};
+
+struct mqtt_parse_stats {
+    uint64_t packets;       /* packets received. */
+    uint64_t oversize;      /* packets above the maximum packet size. */
+    uint64_t over_budget;   /* PUBLISH packets dropped for the shared budget. */
+    uint64_t skipped;       /* bytes discarded with dropped packets. */
+    uint64_t type[16];      /* packets received by 4 bit packet type. */
+    uint64_t bytes[16];     /* bytes received by 4 bit packet type, fixed header included. */
+};
+
 struct mqtt_parser {
     int auth;
+    enum mqtt_vsn vsn;
     enum mqtt_parser_state state;
     int require;
     int multiplier;
     struct mqtt_b remaining;
     struct mqtt_packet p;
     mqtt_cb cb[MQTT_MAX_TYPE];
+    struct {
+        char *s;
+        int size;
+    } buf;
+    struct {
+        int size;
+        mqtt_cb begin;
+        mqtt_cb chunk;
+        mqtt_cb end;
+    } stream;
+    int max_size;
+    int skip;
+    int charged;
+    struct mqtt_budget *budget;
+    struct mqtt_parse_stats stats;
 };
 
+/* allocator behind mqtt.h, mqtt_topic.h and libmqtt, ud is passed to every call.
+ * set it before anything is allocated, 0 restores the libc functions. */
+typedef void *(* mqtt_malloc_fn)(void *ud, size_t size);
+typedef void *(* mqtt_realloc_fn)(void *ud, void *ptr, size_t size);
+typedef void (* mqtt_free_fn)(void *ud, void *ptr);
 
-static inline void
+extern MQTT_API void mqtt__set_allocator(mqtt_malloc_fn m, mqtt_realloc_fn r, mqtt_free_fn f, void *ud);
+extern MQTT_API void *mqtt__malloc(size_t size);
+extern MQTT_API void *mqtt__realloc(void *ptr, size_t size);
+extern MQTT_API void mqtt__free(void *ptr);
+extern MQTT_API char *mqtt__strdup(const char *s);
+extern MQTT_API char *mqtt__strndup(const char *s, size_t n);
+
+/* -1 when the allocator fails, b is left empty. */
+static inline int
 mqtt_b_dup(struct mqtt_b *b, const char *s) {
     if (s) {
-        b->s = strdup(s);
-        b->n = strlen(s);
+        b->s = mqtt__strdup(s);
+        b->n = b->s ? strlen(s) : 0;
+        if (!b->s) return -1;
     }
+    return 0;
 }
 
-static inline void
+static inline int
 mqtt_b_copy(struct mqtt_b *b, struct mqtt_b *s) {
     if (s->s && s->n > 0) {
-        b->s = malloc(s->n);
+        b->s = mqtt__malloc(s->n);
+        b->n = b->s ? s->n : 0;
+        if (!b->s) return -1;
         memcpy(b->s, s->s, s->n);
-        b->n = s->n;
     }
+    return 0;
 }
 
 static inline int
@@ -290,7 +425,7 @@ mqtt_b_empty(struct mqtt_b *b) {
 static inline void
 mqtt_b_free(struct mqtt_b *b) {
     if (b->s) {
-        free(b->s);
+        mqtt__free(b->s);
         b->s = 0;
         b->n = 0;
     }
@@ -298,7 +433,7 @@ mqtt_b_free(struct mqtt_b *b) {
 
 static inline void
 mqtt_b_read_utf(struct mqtt_b *b, struct mqtt_b *r) {
-    r->n = ((*(b->s) << 8) + *(b->s + 1));
+    r->n = (((uint8_t)*(b->s) << 8) + (uint8_t)*(b->s + 1));
     b->s += 2;
     b->n -= 2;
     if (r->n > 0) {
@@ -311,7 +446,7 @@ mqtt_b_read_utf(struct mqtt_b *b, struct mqtt_b *r) {
 static inline int
 mqtt_b_read_u8(struct mqtt_b *b) {
     int u8;
-    u8 = *(b->s);
+    u8 = (uint8_t)*(b->s);
     b->s += 1;
     b->n -= 1;
     return u8;
@@ -320,12 +455,42 @@ mqtt_b_read_u8(struct mqtt_b *b) {
 static inline int
 mqtt_b_read_u16(struct mqtt_b *b) {
     int u16;
-    u16 = ((*b->s << 8) + *(b->s + 1));
+    u16 = (((uint8_t)*b->s << 8) + (uint8_t)*(b->s + 1));
     b->s += 2;
     b->n -= 2;
     return u16;
 }
 
+static inline uint32_t
+mqtt_b_read_u32(struct mqtt_b *b) {
+    uint32_t u32;
+    u32 = ((uint32_t)(uint8_t)*b->s << 24) + ((uint32_t)(uint8_t)*(b->s + 1) << 16)
+        + ((uint32_t)(uint8_t)*(b->s + 2) << 8) + (uint8_t)*(b->s + 3);
+    b->s += 4;
+    b->n -= 4;
+    return u32;
+}
+
+static inline int
+mqtt_b_read_varint(struct mqtt_b *b, uint32_t *r) {
+    uint32_t multiplier;
+    int i;
+
+    *r = 0;
+    multiplier = 1;
+    for (i = 0; i < 4 && b->n > 0; i++) {
+        uint8_t c;
+        c = (uint8_t)*(b->s);
+        b->s += 1;
+        b->n -= 1;
+        *r += (c & 127) * multiplier;
+        if ((c & 128) == 0)
+            return 0;
+        multiplier *= 128;
+    }
+    return -1;
+}
+
 static inline void
 mqtt_b_write_utf(struct mqtt_b *b, struct mqtt_b *r) {
     b->s[b->n++] = (r->n & 0xff00) >> 8;
@@ -347,12 +512,76 @@ mqtt_b_write_u16(struct mqtt_b *b, uint16_t r) {
     b->s[b->n++] = r & 0x00ff;
 }
 
+static inline void
+mqtt_b_write_u32(struct mqtt_b *b, uint32_t r) {
+    b->s[b->n++] = (r >> 24) & 0xff;
+    b->s[b->n++] = (r >> 16) & 0xff;
+    b->s[b->n++] = (r >> 8) & 0xff;
+    b->s[b->n++] = r & 0xff;
+}
+
+static inline void
+mqtt_b_write_varint(struct mqtt_b *b, uint32_t r) {
+    do {
+        uint8_t c;
+        c = r % 128;
+        r /= 128;
+        if (r > 0)
+            c |= 128;
+        b->s[b->n++] = c;
+    } while (r > 0);
+}
+
+/* simd kernels, MQTT_SIMD_AUTO selects the best one the cpu supports. */
+enum mqtt_simd {
+    MQTT_SIMD_AUTO,
+    MQTT_SIMD_SCALAR,
+    MQTT_SIMD_SSE2,
+    MQTT_SIMD_AVX2
+};
+
+extern MQTT_API int mqtt__simd_set(enum mqtt_simd simd);
+extern MQTT_API enum mqtt_simd mqtt__simd_get(void);
+
+/* 1 if s is well formed utf-8 without U+0000, as mqtt requires of its strings. */
+extern MQTT_API int mqtt__utf8_valid(const char *s, int n);
+
+/* check topics, topic filters, client ids and usernames with mqtt__utf8_valid
+ * on parse and serialize, on by default. */
+extern MQTT_API void mqtt__utf8_check(int on);
+
 extern MQTT_API int mqtt__serialize(struct mqtt_packet *pkt, struct mqtt_b *b);
 
+/* encode a PUBLISH into a caller buffer with mqtt__publish_size bytes free at b->s + b->n. */
+extern MQTT_API int mqtt__publish_size(struct mqtt_packet *pkt);
+extern MQTT_API void mqtt__publish_write(struct mqtt_packet *pkt, struct mqtt_b *b);
+
 extern MQTT_API void mqtt__parse_init(struct mqtt_parser *p);
 extern MQTT_API void mqtt__parse_cb(struct mqtt_parser *p, enum mqtt_p_type t, mqtt_cb cb);
 extern MQTT_API int mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b);
 
+/* deliver PUBLISH packets with a remaining length of at least size in pieces, 0 turns it off.
+ * begin runs after the variable header with payload.n the payload length, chunk once per slice
+ * of the input buffer in payload, end after the last slice. */
+extern MQTT_API void mqtt__parse_stream(struct mqtt_parser *p, int size, mqtt_cb begin, mqtt_cb chunk, mqtt_cb end);
+
+/* packets above size bytes, fixed header included, are discarded when skip is set and fail
+ * the parse otherwise, before anything is allocated for them. size 0 is the protocol limit. */
+extern MQTT_API void mqtt__parse_limit(struct mqtt_parser *p, int size, int skip);
+
+/* charge buffered packets to budget, PUBLISH packets that do not fit are discarded. */
+extern MQTT_API void mqtt__parse_budget(struct mqtt_parser *p, struct mqtt_budget *budget);
+
+/* free a partially received packet and return its memory to the budget. */
+extern MQTT_API void mqtt__parse_free(struct mqtt_parser *p);
+
+/* n bytes aligned for any type from the arena, 0 when out of memory. */
+extern MQTT_API void *mqtt__arena_alloc(struct mqtt_arena *a, int n);
+
+/* drop every allocation, keeping one block as large as the busiest period since the last reset. */
+extern MQTT_API void mqtt__arena_reset(struct mqtt_arena *a);
+extern MQTT_API void mqtt__arena_free(struct mqtt_arena *a);
+
 #ifdef __cplusplus
 }
 #endif
@@ -361,6 +590,361 @@ extern MQTT_API int mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *
 
 
 #ifdef MQTT_IMPLEMENTATION
+#ifndef _MQTT_IMPLEMENTATION_
+#define _MQTT_IMPLEMENTATION_
+
+/* define MQTT_ROLE_CLIENT or MQTT_ROLE_SERVER to build only the packets that side
+ * receives and sends, both sides are built when neither is defined. */
+#if !defined(MQTT_ROLE_CLIENT) && !defined(MQTT_ROLE_SERVER)
+# define MQTT_ROLE_CLIENT
+# define MQTT_ROLE_SERVER
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define MQTT_SIMD_X86
+# include <immintrin.h>
+#endif
+
+static void *
+__libc_malloc(void *ud, size_t size) {
+    (void)ud;
+    return malloc(size);
+}
+
+static void *
+__libc_realloc(void *ud, void *ptr, size_t size) {
+    (void)ud;
+    return realloc(ptr, size);
+}
+
+static void
+__libc_free(void *ud, void *ptr) {
+    (void)ud;
+    free(ptr);
+}
+
+static struct {
+    mqtt_malloc_fn malloc;
+    mqtt_realloc_fn realloc;
+    mqtt_free_fn free;
+    void *ud;
+} __mqtt_allocator = {__libc_malloc, __libc_realloc, __libc_free, 0};
+
+void
+mqtt__set_allocator(mqtt_malloc_fn m, mqtt_realloc_fn r, mqtt_free_fn f, void *ud) {
+    if (!m || !r || !f) {
+        m = __libc_malloc;
+        r = __libc_realloc;
+        f = __libc_free;
+        ud = 0;
+    }
+    __mqtt_allocator.malloc = m;
+    __mqtt_allocator.realloc = r;
+    __mqtt_allocator.free = f;
+    __mqtt_allocator.ud = ud;
+}
+
+void *
+mqtt__malloc(size_t size) {
+    return __mqtt_allocator.malloc(__mqtt_allocator.ud, size);
+}
+
+void *
+mqtt__realloc(void *ptr, size_t size) {
+    return __mqtt_allocator.realloc(__mqtt_allocator.ud, ptr, size);
+}
+
+void
+mqtt__free(void *ptr) {
+    if (ptr)
+        __mqtt_allocator.free(__mqtt_allocator.ud, ptr);
+}
+
+char *
+mqtt__strndup(const char *s, size_t n) {
+    char *d;
+
+    n = strnlen(s, n);
+    d = (char *)mqtt__malloc(n + 1);
+    if (d) {
+        memcpy(d, s, n);
+        d[n] = '\0';
+    }
+    return d;
+}
+
+char *
+mqtt__strdup(const char *s) {
+    return mqtt__strndup(s, strlen(s));
+}
+
+static enum mqtt_simd __mqtt_simd = MQTT_SIMD_AUTO;
+
+static enum mqtt_simd
+__simd_detect(void) {
+#ifdef MQTT_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return MQTT_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return MQTT_SIMD_SSE2;
+#endif
+    return MQTT_SIMD_SCALAR;
+}
+
+int
+mqtt__simd_set(enum mqtt_simd simd) {
+    enum mqtt_simd best;
+
+    best = __simd_detect();
+    if (simd == MQTT_SIMD_AUTO)
+        simd = best;
+    if (simd > best)
+        return -1;
+    __mqtt_simd = simd;
+    return 0;
+}
+
+enum mqtt_simd
+mqtt__simd_get(void) {
+    if (__mqtt_simd == MQTT_SIMD_AUTO)
+        __mqtt_simd = __simd_detect();
+    return __mqtt_simd;
+}
+
+static int __mqtt_utf8 = 1;
+
+/* no byte of v is U+0000 or above ascii. */
+#define MQTT_UTF8_ASCII(v) \
+    (!(((v) | (((v) - 0x0101010101010101ULL) & ~(v))) & 0x8080808080808080ULL))
+
+/* validate from i, which must start a character, 8 ascii bytes at a time. */
+static int
+__utf8_scalar(const char *str, int i, int n) {
+    const uint8_t *s;
+    uint64_t v;
+    int c, lo, hi;
+
+    s = (const uint8_t *)str;
+    while (i < n) {
+        if (i + 8 <= n) {
+            memcpy(&v, s + i, 8);
+            if (MQTT_UTF8_ASCII(v)) {
+                i += 8;
+                continue;
+            }
+        }
+        c = s[i];
+        if (c < 0x80) {
+            if (c == 0) return 0;
+            i++;
+            continue;
+        }
+        if (c < 0xc2 || c > 0xf4) return 0;
+        if (c < 0xe0) {
+            if (i + 1 >= n || (s[i + 1] & 0xc0) != 0x80) return 0;
+            i += 2;
+            continue;
+        }
+        /* the second byte rules out overlongs, surrogates and code points above U+10FFFF. */
+        lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+        hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+        if (c < 0xf0) {
+            if (i + 2 >= n || s[i + 1] < lo || s[i + 1] > hi || (s[i + 2] & 0xc0) != 0x80) return 0;
+            i += 3;
+            continue;
+        }
+        if (i + 3 >= n || s[i + 1] < lo || s[i + 1] > hi
+            || (s[i + 2] & 0xc0) != 0x80 || (s[i + 3] & 0xc0) != 0x80)
+            return 0;
+        i += 4;
+    }
+    return 1;
+}
+
+#ifdef MQTT_SIMD_X86
+/* bytes above zero as signed are ascii other than U+0000, scalar from the first block with others. */
+__attribute__((target("sse2"))) static int
+__utf8_sse2(const char *s, int n) {
+    __m128i zero, a, b;
+    int i;
+
+    zero = _mm_setzero_si128();
+    for (i = 0; i + 32 <= n; i += 32) {
+        a = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(s + i)), zero);
+        b = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(s + i + 16)), zero);
+        if (_mm_movemask_epi8(_mm_and_si128(a, b)) != 0xffff)
+            break;
+    }
+    if (i + 16 <= n && _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(s + i)), zero)) == 0xffff)
+        i += 16;
+    /* the last 16 bytes overlap what is left. */
+    if (n - i < 16 && _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(s + n - 16)), zero)) == 0xffff)
+        return 1;
+    return __utf8_scalar(s, i, n);
+}
+
+/* lookup tables of the simdutf validator, indexed by the high nibble of a byte, its low nibble
+ * and the high nibble of the next byte. a bit set in all three flags an error, except two
+ * continuations in a row, which must match where a 3 or 4 byte lead is 2 or 3 bytes back. */
+#define MQTT_UTF8_TOO_SHORT     0x01
+#define MQTT_UTF8_TOO_LONG      0x02
+#define MQTT_UTF8_OVERLONG_3    0x04
+#define MQTT_UTF8_TOO_LARGE     0x08
+#define MQTT_UTF8_SURROGATE     0x10
+#define MQTT_UTF8_OVERLONG_2    0x20
+#define MQTT_UTF8_TOO_LARGE_1000 0x40
+#define MQTT_UTF8_OVERLONG_4    0x40
+#define MQTT_UTF8_TWO_CONTS     0x80
+#define MQTT_UTF8_CARRY         (MQTT_UTF8_TOO_SHORT | MQTT_UTF8_TOO_LONG | MQTT_UTF8_TWO_CONTS)
+
+static const uint8_t __utf8_byte_1_high[16] = {
+    MQTT_UTF8_TOO_LONG, MQTT_UTF8_TOO_LONG, MQTT_UTF8_TOO_LONG, MQTT_UTF8_TOO_LONG,
+    MQTT_UTF8_TOO_LONG, MQTT_UTF8_TOO_LONG, MQTT_UTF8_TOO_LONG, MQTT_UTF8_TOO_LONG,
+    MQTT_UTF8_TWO_CONTS, MQTT_UTF8_TWO_CONTS, MQTT_UTF8_TWO_CONTS, MQTT_UTF8_TWO_CONTS,
+    MQTT_UTF8_TOO_SHORT | MQTT_UTF8_OVERLONG_2,
+    MQTT_UTF8_TOO_SHORT,
+    MQTT_UTF8_TOO_SHORT | MQTT_UTF8_OVERLONG_3 | MQTT_UTF8_SURROGATE,
+    MQTT_UTF8_TOO_SHORT | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000 | MQTT_UTF8_OVERLONG_4
+};
+
+static const uint8_t __utf8_byte_1_low[16] = {
+    MQTT_UTF8_CARRY | MQTT_UTF8_OVERLONG_3 | MQTT_UTF8_OVERLONG_2 | MQTT_UTF8_OVERLONG_4,
+    MQTT_UTF8_CARRY | MQTT_UTF8_OVERLONG_2,
+    MQTT_UTF8_CARRY,
+    MQTT_UTF8_CARRY,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000 | MQTT_UTF8_SURROGATE,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000,
+    MQTT_UTF8_CARRY | MQTT_UTF8_TOO_LARGE | MQTT_UTF8_TOO_LARGE_1000
+};
+
+static const uint8_t __utf8_byte_2_high[16] = {
+    MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT,
+    MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT,
+    MQTT_UTF8_TOO_LONG | MQTT_UTF8_OVERLONG_2 | MQTT_UTF8_TWO_CONTS | MQTT_UTF8_OVERLONG_3
+        | MQTT_UTF8_TOO_LARGE_1000 | MQTT_UTF8_OVERLONG_4,
+    MQTT_UTF8_TOO_LONG | MQTT_UTF8_OVERLONG_2 | MQTT_UTF8_TWO_CONTS | MQTT_UTF8_OVERLONG_3 | MQTT_UTF8_TOO_LARGE,
+    MQTT_UTF8_TOO_LONG | MQTT_UTF8_OVERLONG_2 | MQTT_UTF8_TWO_CONTS | MQTT_UTF8_SURROGATE | MQTT_UTF8_TOO_LARGE,
+    MQTT_UTF8_TOO_LONG | MQTT_UTF8_OVERLONG_2 | MQTT_UTF8_TWO_CONTS | MQTT_UTF8_SURROGATE | MQTT_UTF8_TOO_LARGE,
+    MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT, MQTT_UTF8_TOO_SHORT
+};
+
+/* 64 ascii bytes per step up to the first other byte, then 32 bytes per step where whole ascii
+ * blocks only check for a character left open before them. */
+__attribute__((target("avx2"))) static int
+__utf8_avx2(const char *s, int n) {
+    __m256i b1h, b1l, b2h, nibble, zero, max, in, prev, before, prev1, sc, must23, err, incomplete;
+    char tail[32];
+    int i;
+
+    zero = _mm256_setzero_si256();
+    for (i = 0; i + 64 <= n; i += 64) {
+        in = _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), zero),
+                              _mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i *)(s + i + 32)), zero));
+        if (_mm256_movemask_epi8(in) != -1)
+            break;
+    }
+    b1h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)__utf8_byte_1_high));
+    b1l = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)__utf8_byte_1_low));
+    b2h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)__utf8_byte_2_high));
+    nibble = _mm256_set1_epi8(0x0f);
+    /* a lead byte in the last 3 bytes still waiting for its continuations. */
+    max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                           -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                           (char)0xef, (char)0xdf, (char)0xbf);
+    prev = zero;
+    err = zero;
+    incomplete = zero;
+    for (; i < n; i += 32) {
+        if (i + 32 <= n) {
+            in = _mm256_loadu_si256((const __m256i *)(s + i));
+        } else if (_mm256_testz_si256(incomplete, incomplete)) {
+            if (!_mm256_testz_si256(err, err)) return 0;
+            in = _mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i *)(s + n - 32)), zero);
+            return _mm256_movemask_epi8(in) == -1 || __utf8_scalar(s, i, n);
+        } else {
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, s + i, n - i);
+            in = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(in, zero)) == -1) {
+            err = _mm256_or_si256(err, incomplete);
+            incomplete = zero;
+        } else {
+            err = _mm256_or_si256(err, _mm256_cmpeq_epi8(in, zero));
+            before = _mm256_permute2x128_si256(prev, in, 0x21);
+            prev1 = _mm256_alignr_epi8(in, before, 15);
+            sc = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(b1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(b1l, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(b2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+            must23 = _mm256_or_si256(
+                _mm256_subs_epu8(_mm256_alignr_epi8(in, before, 14), _mm256_set1_epi8(0xe0 - 0x80)),
+                _mm256_subs_epu8(_mm256_alignr_epi8(in, before, 13), _mm256_set1_epi8(0xf0 - 0x80)));
+            must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+            err = _mm256_or_si256(err, _mm256_xor_si256(must23, sc));
+            incomplete = _mm256_subs_epu8(in, max);
+        }
+        prev = in;
+    }
+    err = _mm256_or_si256(err, incomplete);
+    return _mm256_testz_si256(err, err);
+}
+#endif /* MQTT_SIMD_X86 */
+
+static inline int
+__utf8_valid(const char *s, int n) {
+    uint64_t a, b;
+
+    /* most topics and client ids are short and ascii, two overlapping words cover them. */
+    if (n >= 8 && n <= 16) {
+        memcpy(&a, s, 8);
+        memcpy(&b, s + n - 8, 8);
+        if (MQTT_UTF8_ASCII(a) && MQTT_UTF8_ASCII(b))
+            return 1;
+    }
+    if (n < 16)
+        return __utf8_scalar(s, 0, n);
+    switch (__mqtt_simd != MQTT_SIMD_AUTO ? __mqtt_simd : mqtt__simd_get()) {
+#ifdef MQTT_SIMD_X86
+    case MQTT_SIMD_AVX2:
+        if (n >= 64)
+            return __utf8_avx2(s, n);
+        /* fall through */
+    case MQTT_SIMD_SSE2:
+        return __utf8_sse2(s, n);
+#endif
+    default:
+        return __utf8_scalar(s, 0, n);
+    }
+}
+
+int
+mqtt__utf8_valid(const char *s, int n) {
+    return __utf8_valid(s, n);
+}
+
+void
+mqtt__utf8_check(int on) {
+    __mqtt_utf8 = on;
+}
+
+/* 0 when checking is off or s is valid, -1 otherwise. */
+static inline int
+__utf8_check(const struct mqtt_b *b) {
+    if (!__mqtt_utf8 || b->n <= 0) return 0;
+    return __utf8_valid(b->s, b->n) ? 0 : -1;
+}
 
 void
 mqtt__parse_init(struct mqtt_parser *p) {
@@ -375,6 +959,257 @@ mqtt__parse_cb(struct mqtt_parser *p, enum mqtt_p_type t, mqtt_cb cb) {
     }
 }
 
+void
+mqtt__parse_stream(struct mqtt_parser *p, int size, mqtt_cb begin, mqtt_cb chunk, mqtt_cb end) {
+    if (size > 0 && (!begin || !chunk || !end))
+        size = 0;
+    p->stream.size = size;
+    p->stream.begin = begin;
+    p->stream.chunk = chunk;
+    p->stream.end = end;
+}
+
+void
+mqtt__parse_limit(struct mqtt_parser *p, int size, int skip) {
+    p->max_size = size > 0 ? size : 0;
+    p->skip = skip;
+}
+
+void
+mqtt__parse_budget(struct mqtt_parser *p, struct mqtt_budget *budget) {
+    if (p->budget)
+        p->budget->used -= p->charged;
+    p->budget = budget;
+    if (budget) {
+        budget->used += p->charged;
+        if (budget->used > budget->peak)
+            budget->peak = budget->used;
+    } else {
+        p->charged = 0;
+    }
+}
+
+enum {
+    MQTT_PT_NONE,
+    MQTT_PT_BYTE,
+    MQTT_PT_U16,
+    MQTT_PT_U32,
+    MQTT_PT_VARINT,
+    MQTT_PT_UTF,
+    MQTT_PT_BINARY,
+    MQTT_PT_PAIR
+};
+
+static const uint8_t __property_types[MQTT_MAX_PROPERTY] = {
+    [PROPERTY_PAYLOAD_FORMAT_INDICATOR]             = MQTT_PT_BYTE,
+    [PROPERTY_MESSAGE_EXPIRY_INTERVAL]              = MQTT_PT_U32,
+    [PROPERTY_CONTENT_TYPE]                         = MQTT_PT_UTF,
+    [PROPERTY_RESPONSE_TOPIC]                       = MQTT_PT_UTF,
+    [PROPERTY_CORRELATION_DATA]                     = MQTT_PT_BINARY,
+    [PROPERTY_SUBSCRIPTION_IDENTIFIER]              = MQTT_PT_VARINT,
+    [PROPERTY_SESSION_EXPIRY_INTERVAL]              = MQTT_PT_U32,
+    [PROPERTY_ASSIGNED_CLIENT_IDENTIFIER]           = MQTT_PT_UTF,
+    [PROPERTY_SERVER_KEEP_ALIVE]                    = MQTT_PT_U16,
+    [PROPERTY_AUTHENTICATION_METHOD]                = MQTT_PT_UTF,
+    [PROPERTY_AUTHENTICATION_DATA]                  = MQTT_PT_BINARY,
+    [PROPERTY_REQUEST_PROBLEM_INFORMATION]          = MQTT_PT_BYTE,
+    [PROPERTY_WILL_DELAY_INTERVAL]                  = MQTT_PT_U32,
+    [PROPERTY_REQUEST_RESPONSE_INFORMATION]         = MQTT_PT_BYTE,
+    [PROPERTY_RESPONSE_INFORMATION]                 = MQTT_PT_UTF,
+    [PROPERTY_SERVER_REFERENCE]                     = MQTT_PT_UTF,
+    [PROPERTY_REASON_STRING]                        = MQTT_PT_UTF,
+    [PROPERTY_RECEIVE_MAXIMUM]                      = MQTT_PT_U16,
+    [PROPERTY_TOPIC_ALIAS_MAXIMUM]                  = MQTT_PT_U16,
+    [PROPERTY_TOPIC_ALIAS]                          = MQTT_PT_U16,
+    [PROPERTY_MAXIMUM_QOS]                          = MQTT_PT_BYTE,
+    [PROPERTY_RETAIN_AVAILABLE]                     = MQTT_PT_BYTE,
+    [PROPERTY_USER_PROPERTY]                        = MQTT_PT_PAIR,
+    [PROPERTY_MAXIMUM_PACKET_SIZE]                  = MQTT_PT_U32,
+    [PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE]      = MQTT_PT_BYTE,
+    [PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE]    = MQTT_PT_BYTE,
+    [PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE]        = MQTT_PT_BYTE,
+};
+
+static int
+__varint_size(uint32_t v) {
+    if (v < 128) return 1;
+    if (v < 16384) return 2;
+    if (v < 2097152) return 3;
+    return 4;
+}
+
+static int
+__parse_properties(struct mqtt_p_properties *props, struct mqtt_b *remaining) {
+    struct mqtt_b b, s;
+    uint32_t len, id, v;
+
+    if (mqtt_b_read_varint(remaining, &len)) return -1;
+    if (len > (uint32_t)remaining->n) return -1;
+    b.s = remaining->s;
+    b.n = len;
+    remaining->s += len;
+    remaining->n -= len;
+
+    while (b.n > 0) {
+        if (mqtt_b_read_varint(&b, &id)) return -1;
+        if (id >= MQTT_MAX_PROPERTY || !__property_types[id]) return -1;
+        if (MQTT_PROPERTY_HAS(props, id) && id != PROPERTY_USER_PROPERTY
+            && id != PROPERTY_SUBSCRIPTION_IDENTIFIER)
+            return -1;
+        v = 0;
+        switch (__property_types[id]) {
+        case MQTT_PT_BYTE:
+            if (b.n < 1) return -1;
+            v = mqtt_b_read_u8(&b);
+            break;
+        case MQTT_PT_U16:
+            if (b.n < 2) return -1;
+            v = mqtt_b_read_u16(&b);
+            break;
+        case MQTT_PT_U32:
+            if (b.n < 4) return -1;
+            v = mqtt_b_read_u32(&b);
+            break;
+        case MQTT_PT_VARINT:
+            if (mqtt_b_read_varint(&b, &v)) return -1;
+            break;
+        case MQTT_PT_PAIR:
+            if (b.n < 2) return -1;
+            mqtt_b_read_utf(&b, &s);
+            /* fall through */
+        case MQTT_PT_UTF:
+        case MQTT_PT_BINARY:
+            if (b.n < 2) return -1;
+            mqtt_b_read_utf(&b, &s);
+            if (b.n < 0) return -1;
+            break;
+        }
+        props->mask |= MQTT_PROPERTY_BIT(id);
+        switch (id) {
+        case PROPERTY_SESSION_EXPIRY_INTERVAL:
+            props->session_expiry_interval = v;
+            break;
+        case PROPERTY_MAXIMUM_PACKET_SIZE:
+            props->maximum_packet_size = v;
+            break;
+        case PROPERTY_RECEIVE_MAXIMUM:
+            props->receive_maximum = v;
+            break;
+        case PROPERTY_TOPIC_ALIAS_MAXIMUM:
+            props->topic_alias_maximum = v;
+            break;
+        case PROPERTY_TOPIC_ALIAS:
+            props->topic_alias = v;
+            break;
+        case PROPERTY_SERVER_KEEP_ALIVE:
+            props->server_keep_alive = v;
+            break;
+        case PROPERTY_MAXIMUM_QOS:
+            props->maximum_qos = v;
+            break;
+        case PROPERTY_RETAIN_AVAILABLE:
+            props->retain_available = v;
+            break;
+        case PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE:
+            props->wildcard_subscription_available = v;
+            break;
+        case PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE:
+            props->subscription_identifier_available = v;
+            break;
+        case PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE:
+            props->shared_subscription_available = v;
+            break;
+        case PROPERTY_SUBSCRIPTION_IDENTIFIER:
+            if (v == 0) return -1;
+            if (props->subscription_identifier_n < MQTT_MAX_SUBID)
+                props->subscription_identifier[props->subscription_identifier_n++] = v;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int
+__properties_size(struct mqtt_p_properties *props) {
+    int n, i;
+
+    n = 0;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SESSION_EXPIRY_INTERVAL)) n += 5;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_MAXIMUM_PACKET_SIZE)) n += 5;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_RECEIVE_MAXIMUM)) n += 3;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_TOPIC_ALIAS_MAXIMUM)) n += 3;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_TOPIC_ALIAS)) n += 3;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SERVER_KEEP_ALIVE)) n += 3;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_MAXIMUM_QOS)) n += 2;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_RETAIN_AVAILABLE)) n += 2;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE)) n += 2;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE)) n += 2;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE)) n += 2;
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SUBSCRIPTION_IDENTIFIER)) {
+        for (i = 0; i < props->subscription_identifier_n; i++)
+            n += 1 + __varint_size(props->subscription_identifier[i]);
+    }
+    return n;
+}
+
+static void
+__properties_write(struct mqtt_b *b, struct mqtt_p_properties *props, int len) {
+    int i;
+
+    mqtt_b_write_varint(b, len);
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SESSION_EXPIRY_INTERVAL)) {
+        mqtt_b_write_u8(b, PROPERTY_SESSION_EXPIRY_INTERVAL);
+        mqtt_b_write_u32(b, props->session_expiry_interval);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_MAXIMUM_PACKET_SIZE)) {
+        mqtt_b_write_u8(b, PROPERTY_MAXIMUM_PACKET_SIZE);
+        mqtt_b_write_u32(b, props->maximum_packet_size);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_RECEIVE_MAXIMUM)) {
+        mqtt_b_write_u8(b, PROPERTY_RECEIVE_MAXIMUM);
+        mqtt_b_write_u16(b, props->receive_maximum);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_TOPIC_ALIAS_MAXIMUM)) {
+        mqtt_b_write_u8(b, PROPERTY_TOPIC_ALIAS_MAXIMUM);
+        mqtt_b_write_u16(b, props->topic_alias_maximum);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_TOPIC_ALIAS)) {
+        mqtt_b_write_u8(b, PROPERTY_TOPIC_ALIAS);
+        mqtt_b_write_u16(b, props->topic_alias);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SERVER_KEEP_ALIVE)) {
+        mqtt_b_write_u8(b, PROPERTY_SERVER_KEEP_ALIVE);
+        mqtt_b_write_u16(b, props->server_keep_alive);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_MAXIMUM_QOS)) {
+        mqtt_b_write_u8(b, PROPERTY_MAXIMUM_QOS);
+        mqtt_b_write_u8(b, props->maximum_qos);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_RETAIN_AVAILABLE)) {
+        mqtt_b_write_u8(b, PROPERTY_RETAIN_AVAILABLE);
+        mqtt_b_write_u8(b, props->retain_available);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE)) {
+        mqtt_b_write_u8(b, PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE);
+        mqtt_b_write_u8(b, props->wildcard_subscription_available);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE)) {
+        mqtt_b_write_u8(b, PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE);
+        mqtt_b_write_u8(b, props->subscription_identifier_available);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE)) {
+        mqtt_b_write_u8(b, PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE);
+        mqtt_b_write_u8(b, props->shared_subscription_available);
+    }
+    if (MQTT_PROPERTY_HAS(props, PROPERTY_SUBSCRIPTION_IDENTIFIER)) {
+        for (i = 0; i < props->subscription_identifier_n; i++) {
+            mqtt_b_write_u8(b, PROPERTY_SUBSCRIPTION_IDENTIFIER);
+            mqtt_b_write_varint(b, props->subscription_identifier[i]);
+        }
+    }
+}
+
+#ifdef MQTT_ROLE_SERVER
 static int
 __process_connect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_connect *c;
@@ -395,17 +1230,20 @@ __process_connect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_connack(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_connack *c;
 
     c = &p->v.connack;
-    if (!MQTT_IS_CONNACK(c->return_code)) {
+    if (p->vsn != MQTT_PROTO_V5 && !MQTT_IS_CONNACK(c->return_code)) {
         return -1;
     }
     return cb(ud, p);
 }
+#endif
 
 static int
 __process_publish(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
@@ -415,7 +1253,7 @@ __process_publish(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     if (!MQTT_IS_QOS(p->h.qos)) {
         return -1;
     }
-    if (mqtt_b_empty(&c->topic_name)) {
+    if (mqtt_b_empty(&c->topic_name) && !MQTT_PROPERTY_HAS(&p->props, PROPERTY_TOPIC_ALIAS)) {
         return -1;
     }
     return cb(ud, p);
@@ -444,6 +1282,7 @@ __process_pubcomp(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __process_subscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_subscribe *c;
@@ -460,12 +1299,16 @@ __process_subscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_suback(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __process_unsubscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_unsubscribe *c;
@@ -482,21 +1325,28 @@ __process_unsubscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_unsuback(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __process_pingreq(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_pingresp(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
 static int
 __process_disconnect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
@@ -504,6 +1354,7 @@ __process_disconnect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
 }
 
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __parse_connect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int flags;
@@ -522,17 +1373,28 @@ __parse_connect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
 
     if (remaining->n < 2) return -1;
     pkt->v.connect.keep_alive = mqtt_b_read_u16(remaining);
+    if (pkt->v.connect.proto_ver == MQTT_PROTO_V5) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+    }
     if (remaining->n < 2) return -1;
     mqtt_b_read_utf(remaining, &pkt->v.connect.client_id);
+    if (remaining->n < 0 || __utf8_check(&pkt->v.connect.client_id)) return -1;
     if (pkt->v.connect.will_flag) {
+        if (pkt->v.connect.proto_ver == MQTT_PROTO_V5) {
+            struct mqtt_p_properties will_props;
+
+            memset(&will_props, 0, sizeof will_props);
+            if (__parse_properties(&will_props, remaining)) return -1;
+        }
         if (remaining->n <= 2) return -1;
         mqtt_b_read_utf(remaining, &pkt->v.connect.will_topic);
-        if (remaining->n <= 2) return -1;
+        if (remaining->n <= 2 || __utf8_check(&pkt->v.connect.will_topic)) return -1;
         mqtt_b_read_utf(remaining, &pkt->v.connect.will_payload);
     }
     if ((flags >> 7) & 0x01) {
         if (remaining->n <= 2) return -1;
         mqtt_b_read_utf(remaining, &pkt->v.connect.username);
+        if (remaining->n < 0 || __utf8_check(&pkt->v.connect.username)) return -1;
         if ((flags >> 6) & 0x01) {
             if (remaining->n <= 2) return -1;
             mqtt_b_read_utf(remaining, &pkt->v.connect.password);
@@ -540,55 +1402,81 @@ __parse_connect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     }
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_connack(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n != 2) return -1;
+    if (remaining->n < 2) return -1;
+    if (pkt->vsn != MQTT_PROTO_V5 && remaining->n != 2) return -1;
     pkt->v.connack.ack_flags = mqtt_b_read_u8(remaining);
     pkt->v.connack.return_code = mqtt_b_read_u8(remaining);
+    if (remaining->n > 0) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+        if (remaining->n != 0) return -1;
+    }
     return 0;
 }
+#endif
+
+static int
+__parse_reason_code(struct mqtt_packet *pkt, struct mqtt_b *remaining, int *reason_code) {
+    *reason_code = 0;
+    if (remaining->n == 0) return 0;
+    if (pkt->vsn != MQTT_PROTO_V5) return -1;
+    *reason_code = mqtt_b_read_u8(remaining);
+    if (remaining->n > 0) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+    }
+    return remaining->n == 0 ? 0 : -1;
+}
 
 static int
 __parse_publish(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n <= 2) return -1;
+    if (remaining->n < 2) return -1;
+    if (((uint8_t)remaining->s[0] << 8) + (uint8_t)remaining->s[1] > remaining->n - 2) return -1;
     mqtt_b_read_utf(remaining, &pkt->v.publish.topic_name);
+    if (__utf8_check(&pkt->v.publish.topic_name)) return -1;
     if (pkt->h.qos > MQTT_QOS_0) {
-        if (remaining->n <= 2) return -1;
+        if (remaining->n < 2) return -1;
         pkt->v.publish.packet_id = mqtt_b_read_u16(remaining);
     }
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+    }
     pkt->payload = *remaining;
     return 0;
 }
 
 static int
 __parse_puback(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n != 2) return -1;
+    if (remaining->n < 2) return -1;
     pkt->v.puback.packet_id = mqtt_b_read_u16(remaining);
-    return 0;
+    return __parse_reason_code(pkt, remaining, &pkt->v.puback.reason_code);
 }
 
 static int
 __parse_pubrec(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n != 2) return -1;
-    pkt->v.puback.packet_id = mqtt_b_read_u16(remaining);
-    return 0;
+    if (remaining->n < 2) return -1;
+    pkt->v.pubrec.packet_id = mqtt_b_read_u16(remaining);
+    return __parse_reason_code(pkt, remaining, &pkt->v.pubrec.reason_code);
 }
 
 static int
 __parse_pubrel(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n != 2) return -1;
-    pkt->v.puback.packet_id = mqtt_b_read_u16(remaining);
-    return 0;
+    if (remaining->n < 2) return -1;
+    pkt->v.pubrel.packet_id = mqtt_b_read_u16(remaining);
+    return __parse_reason_code(pkt, remaining, &pkt->v.pubrel.reason_code);
 }
 
 static int
 __parse_pubcomp(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n != 2) return -1;
-    pkt->v.puback.packet_id = mqtt_b_read_u16(remaining);
-    return 0;
+    if (remaining->n < 2) return -1;
+    pkt->v.pubcomp.packet_id = mqtt_b_read_u16(remaining);
+    return __parse_reason_code(pkt, remaining, &pkt->v.pubcomp.reason_code);
 }
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __parse_subscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int rc;
@@ -596,6 +1484,9 @@ __parse_subscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
 
     if (remaining->n <= 2) return -1;
     pkt->v.subscribe.packet_id = mqtt_b_read_u16(remaining);
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+    }
 
     n = 0;
     rc = 0;
@@ -606,7 +1497,9 @@ __parse_subscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
         }
         mqtt_b_read_utf(remaining, &pkt->v.subscribe.topic_name[n]);
         pkt->v.subscribe.qos[n] = mqtt_b_read_u8(remaining);
-        if (remaining->n < 0) {
+        if (pkt->vsn == MQTT_PROTO_V5)
+            pkt->v.subscribe.qos[n] &= 0x03;
+        if (remaining->n < 0 || __utf8_check(&pkt->v.subscribe.topic_name[n])) {
             rc = -1;
             break;
         }
@@ -615,14 +1508,19 @@ __parse_subscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     pkt->v.subscribe.n = n;
     return rc;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_suback(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int rc;
     int n;
 
     if (remaining->n <= 2) return -1;
-    pkt->v.subscribe.packet_id = mqtt_b_read_u16(remaining);
+    pkt->v.suback.packet_id = mqtt_b_read_u16(remaining);
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+    }
 
     n = 0;
     rc = 0;
@@ -633,7 +1531,9 @@ __parse_suback(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     pkt->v.suback.n = n;
     return rc;
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int rc;
@@ -641,6 +1541,9 @@ __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
 
     if (remaining->n <= 2) return -1;
     pkt->v.unsubscribe.packet_id = mqtt_b_read_u16(remaining);
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+    }
 
     n = 0;
     rc = 0;
@@ -650,7 +1553,7 @@ __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
             break;
         }
         mqtt_b_read_utf(remaining, &pkt->v.unsubscribe.topic_name[n]);
-        if (remaining->n < 0) {
+        if (remaining->n < 0 || __utf8_check(&pkt->v.unsubscribe.topic_name[n])) {
             rc = -1;
             break;
         }
@@ -659,14 +1562,31 @@ __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     pkt->v.unsubscribe.n = n;
     return rc;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_unsuback(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    if (remaining->n != 2) return -1;
+    int n;
+
+    if (remaining->n < 2) return -1;
     pkt->v.unsuback.packet_id = mqtt_b_read_u16(remaining);
-    return 0;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        if (__parse_properties(&pkt->props, remaining)) return -1;
+
+        n = 0;
+        while (remaining->n > 0 && n < MQTT_MAX_SUB) {
+            pkt->v.unsuback.reason_code[n] = mqtt_b_read_u8(remaining);
+            n++;
+        }
+        pkt->v.unsuback.n = n;
+        return 0;
+    }
+    return remaining->n == 0 ? 0 : -1;
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __parse_pingreq(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     (void)pkt;
@@ -674,7 +1594,9 @@ __parse_pingreq(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 0) return -1;
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_pingresp(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     (void)pkt;
@@ -682,16 +1604,39 @@ __parse_pingresp(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 0) return -1;
     return 0;
 }
+#endif
 
 static int
 __parse_disconnect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
-    (void)pkt;
-
-    if (remaining->n != 0) return -1;
-    return 0;
+    return __parse_reason_code(pkt, remaining, &pkt->v.disconnect.reason_code);
 }
 
 
+/* packets this role receives, validated by process before the callback. */
+static const struct {
+    int (*parse)(struct mqtt_packet *, struct mqtt_b *);
+    int (*process)(struct mqtt_packet *, void *, mqtt_cb);
+} __parsers[MQTT_MAX_TYPE] = {
+#ifdef MQTT_ROLE_SERVER
+    [CONNECT] = {__parse_connect, __process_connect},
+    [SUBSCRIBE] = {__parse_subscribe, __process_subscribe},
+    [UNSUBSCRIBE] = {__parse_unsubscribe, __process_unsubscribe},
+    [PINGREQ] = {__parse_pingreq, __process_pingreq},
+#endif
+#ifdef MQTT_ROLE_CLIENT
+    [CONNACK] = {__parse_connack, __process_connack},
+    [SUBACK] = {__parse_suback, __process_suback},
+    [UNSUBACK] = {__parse_unsuback, __process_unsuback},
+    [PINGRESP] = {__parse_pingresp, __process_pingresp},
+#endif
+    [PUBLISH] = {__parse_publish, __process_publish},
+    [PUBACK] = {__parse_puback, __process_puback},
+    [PUBREC] = {__parse_pubrec, __process_pubrec},
+    [PUBREL] = {__parse_pubrel, __process_pubrel},
+    [PUBCOMP] = {__parse_pubcomp, __process_pubcomp},
+    [DISCONNECT] = {__parse_disconnect, __process_disconnect},
+};
+
 static int
 __process(struct mqtt_parser *p, void *ud) {
     int rc;
@@ -700,6 +1645,9 @@ __process(struct mqtt_parser *p, void *ud) {
     struct mqtt_b b;
 
     type = p->p.h.type;
+    if (!MQTT_IS_TYPE(type) || !__parsers[type].parse) {
+        return -1;
+    }
     if (p->auth == 0 && (type != CONNECT && type != CONNACK)) {
         return -1;
     }
@@ -709,89 +1657,288 @@ __process(struct mqtt_parser *p, void *ud) {
     }
     b.s = p->remaining.s;
     b.n = p->remaining.n;
-    switch (type) {
-    case CONNECT:
-        rc = __parse_connect(&p->p, &b);
-        if (!rc) rc = __process_connect(&p->p, ud, cb);
-        break;
-    case CONNACK:
-        rc = __parse_connack(&p->p, &b);
-        if (!rc) rc = __process_connack(&p->p, ud, cb);
-        break;
-    case PUBLISH:
-        rc = __parse_publish(&p->p, &b);
-        if (!rc) rc = __process_publish(&p->p, ud, cb);
-        break;
-    case PUBACK:
-        rc = __parse_puback(&p->p, &b);
-        if (!rc) rc = __process_puback(&p->p, ud, cb);
-        break;
-    case PUBREC:
-        rc = __parse_pubrec(&p->p, &b);
-        if (!rc) rc = __process_pubrec(&p->p, ud, cb);
-        break;
-    case PUBREL:
-        rc = __parse_pubrel(&p->p, &b);
-        if (!rc) rc = __process_pubrel(&p->p, ud, cb);
-        break;
-    case PUBCOMP:
-        rc = __parse_pubcomp(&p->p, &b);
-        if (!rc) rc = __process_pubcomp(&p->p, ud, cb);
-        break;
-    case SUBSCRIBE:
-        rc = __parse_subscribe(&p->p, &b);
-        if (!rc) rc = __process_subscribe(&p->p, ud, cb);
-        break;
-    case SUBACK:
-        rc = __parse_suback(&p->p, &b);
-        if (!rc) rc = __process_suback(&p->p, ud, cb);
-        break;
-    case UNSUBSCRIBE:
-        rc = __parse_unsubscribe(&p->p, &b);
-        if (!rc) rc = __process_unsubscribe(&p->p, ud, cb);
-        break;
-    case UNSUBACK:
-        rc = __parse_unsuback(&p->p, &b);
-        if (!rc) rc = __process_unsuback(&p->p, ud, cb);
-        break;
-    case PINGREQ:
-        rc = __parse_pingreq(&p->p, &b);
-        if (!rc) rc = __process_pingreq(&p->p, ud, cb);
-        break;
-    case PINGRESP:
-        rc = __parse_pingresp(&p->p, &b);
-        if (!rc) rc = __process_pingresp(&p->p, ud, cb);
-        break;
-    case DISCONNECT:
-        rc = __parse_disconnect(&p->p, &b);
-        if (!rc) rc = __process_disconnect(&p->p, ud, cb);
-        break;
-    default:
-        rc = -1;
-    }
+    p->p.vsn = p->vsn;
+    rc = __parsers[type].parse(&p->p, &b);
+    if (!rc) rc = __parsers[type].process(&p->p, ud, cb);
     if (rc) {
         return rc;
     }
+    if (type == CONNECT) {
+        p->vsn = p->p.v.connect.proto_ver;
+    }
     if (type == CONNECT || type == CONNACK) {
         p->auth = 1;
     }
     return 0;
 }
 
+/* whole packet size for a remaining length. */
+static int
+__packet_size(int remaining) {
+    return 2 + remaining + (remaining >= 128) + (remaining >= 16384) + (remaining >= 2097152);
+}
+
+/* size of a PUBLISH variable header known from its first n bytes, more than n while incomplete. */
+static int
+__publish_header(struct mqtt_parser *p, const char *s, int n) {
+    uint32_t len, m;
+    int need, i;
+
+    need = 2;
+    if (n < need) return need;
+    need += ((uint8_t)s[0] << 8) + (uint8_t)s[1];
+    if (p->p.h.qos > MQTT_QOS_0) need += 2;
+    if (p->vsn == MQTT_PROTO_V5) {
+        len = 0;
+        m = 1;
+        for (i = 0; i < 4; i++) {
+            if (n < need + i + 1) return need + i + 1;
+            len += (s[need + i] & 127) * m;
+            m *= 128;
+            if ((s[need + i] & 128) == 0) break;
+        }
+        if (i == 4) return -1;
+        need += i + 1 + len;
+    }
+    return need;
+}
+
+struct mqtt_arena_block {
+    struct mqtt_arena_block *next;
+    char s[] __attribute__((aligned(16)));
+};
+
+void *
+mqtt__arena_alloc(struct mqtt_arena *a, int n) {
+    struct mqtt_arena_block *m;
+    char *s;
+
+    n = (n + 15) & ~15;
+    a->high += n;
+    if (a->n + n <= a->size) {
+        s = a->s + a->n;
+        a->n += n;
+        return s;
+    }
+    /* spill into its own block, reset grows the main block to fit next time. */
+    m = (struct mqtt_arena_block *)mqtt__malloc(sizeof *m + n);
+    if (!m) return 0;
+    m->next = a->more;
+    a->more = m;
+    return m->s;
+}
+
+void
+mqtt__arena_reset(struct mqtt_arena *a) {
+    struct mqtt_arena_block *m;
+
+    if (a->more) {
+        while ((m = a->more) != 0) {
+            a->more = m->next;
+            mqtt__free(m);
+        }
+        mqtt__free(a->s);
+        a->s = mqtt__malloc(a->high);
+        a->size = a->s ? a->high : 0;
+    }
+    a->n = 0;
+    a->high = 0;
+}
+
+void
+mqtt__arena_free(struct mqtt_arena *a) {
+    mqtt__arena_reset(a);
+    mqtt__free(a->s);
+    a->s = 0;
+    a->size = 0;
+}
+
+static int
+__charge(struct mqtt_parser *p, int n) {
+    struct mqtt_budget *b;
+
+    b = p->budget;
+    if (!b) return 0;
+    if (b->limit > 0 && b->used + n > b->limit && p->p.h.type == PUBLISH) {
+        p->stats.over_budget++;
+        b->dropped++;
+        return -1;
+    }
+    b->used += n;
+    if (b->used > b->peak)
+        b->peak = b->used;
+    p->charged += n;
+    return 0;
+}
+
+static void
+__release(struct mqtt_parser *p) {
+    p->remaining.s = 0;
+    p->remaining.n = 0;
+    if (p->buf.size > MQTT_PARSE_KEEP) {
+        mqtt__free(p->buf.s);
+        p->buf.s = 0;
+        p->buf.size = 0;
+    }
+    if (p->budget)
+        p->budget->used -= p->charged;
+    p->charged = 0;
+}
+
+void
+mqtt__parse_free(struct mqtt_parser *p) {
+    __release(p);
+    mqtt__free(p->buf.s);
+    p->buf.s = 0;
+    p->buf.size = 0;
+    p->state = MQTT_ST_FIXED;
+}
+
+/* room for n bytes of the current packet, keeping what is already buffered. */
+static char *
+__parse_buffer(struct mqtt_parser *p, int n) {
+    char *s;
+
+    if (n > p->buf.size) {
+        s = mqtt__realloc(p->buf.s, n);
+        if (!s) return 0;
+        p->buf.s = s;
+        p->buf.size = n;
+    }
+    return p->buf.s;
+}
+
+/* discard the rest of the current packet. */
+static void
+__skip(struct mqtt_parser *p) {
+    p->stats.skipped += p->remaining.n + p->require;
+    __release(p);
+    p->state = MQTT_ST_SKIP;
+}
+
+static int
+__stream_end(struct mqtt_parser *p, void *ud) {
+    int rc;
+
+    p->state = MQTT_ST_FIXED;
+    p->p.payload.s = 0;
+    p->p.payload.n = 0;
+    rc = p->stream.end(ud, &p->p);
+    __release(p);
+    return rc;
+}
+
+/* buffer the variable header of a streamed PUBLISH, then hand it to begin. */
+static int
+__stream_header(struct mqtt_parser *p, void *ud, const char **c, const char *e) {
+    struct mqtt_b b;
+    char *s;
+    int need, k, rc;
+
+    while ((need = __publish_header(p, p->remaining.s, p->remaining.n)) != p->remaining.n) {
+        if (need < 0 || need > p->remaining.n + p->require) return -1;
+        if (*c == e) return 0;
+        if (need > p->charged && __charge(p, need - p->charged)) {
+            __skip(p);
+            return 0;
+        }
+        s = __parse_buffer(p, need);
+        if (!s) return -1;
+        p->remaining.s = s;
+        k = need - p->remaining.n;
+        if (k > e - *c) k = e - *c;
+        memcpy(p->remaining.s + p->remaining.n, *c, k);
+        p->remaining.n += k;
+        p->require -= k;
+        *c += k;
+    }
+    b.s = p->remaining.s;
+    b.n = p->remaining.n;
+    p->p.vsn = p->vsn;
+    rc = __parse_publish(&p->p, &b);
+    if (rc) return rc;
+    p->p.payload.s = 0;
+    p->p.payload.n = p->require;
+    rc = __process_publish(&p->p, ud, p->stream.begin);
+    if (rc) return rc;
+    if (p->require == 0)
+        return __stream_end(p, ud);
+    p->state = MQTT_ST_STREAM;
+    return 0;
+}
+
+static void
+__parse_fixed(struct mqtt_parser *p, char c) {
+    p->p.h.type = ((c >> 4) & 0x0F);
+    p->p.h.dup = ((c >> 3) & 0x01);
+    p->p.h.qos = ((c >> 1) & 0x03);
+    p->p.h.retain = ((c >> 0) & 0x01);
+    p->p.props.mask = 0;
+    p->p.props.subscription_identifier_n = 0;
+    p->stats.packets++;
+    p->stats.type[p->p.h.type]++;
+}
+
+/* decode a remaining length with one load, bytes used, 0 when it runs past n, -1 when malformed. */
+static inline int
+__parse_length(const uint8_t *s, int n, int *length) {
+    uint32_t w, stop;
+    int i, k;
+
+    if (n >= 4) {
+        w = s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+    } else {
+        w = 0x80808080;
+        for (i = 0; i < n; i++)
+            w = (w & ~((uint32_t)0xff << (i * 8))) | (uint32_t)s[i] << (i * 8);
+    }
+    stop = ~w & 0x80808080;
+    if (!stop) return n >= 4 ? -1 : 0;
+    k = __builtin_ctz(stop) / 8 + 1;
+    w = (w & 0x7f) | ((w >> 1) & 0x3f80) | ((w >> 2) & 0x1fc000) | ((w >> 3) & 0xfe00000);
+    *length = w & ((1u << (7 * k)) - 1);
+    return k;
+}
+
+/* parse a packet that is whole in the input in place, bytes used, 0 to take the state machine. */
+static int
+__parse_fast(struct mqtt_parser *p, void *ud, const char *c, const char *e) {
+    int k, n, rc;
+
+    if (e - c < 2) return 0;
+    k = __parse_length((const uint8_t *)c + 1, e - c - 1, &n);
+    if (k <= 0) return k;
+    if (n > e - c - 1 - k) return 0;
+    if (p->max_size > 0 && __packet_size(n) > p->max_size) return 0;
+    if (((*c >> 4) & 0x0F) == PUBLISH && p->stream.size > 0 && p->auth && n >= p->stream.size) return 0;
+    __parse_fixed(p, *c);
+    p->stats.bytes[p->p.h.type] += 1 + k + n;
+    p->remaining.s = (char *)c + 1 + k;
+    p->remaining.n = n;
+    rc = __process(p, ud);
+    p->remaining.s = 0;
+    p->remaining.n = 0;
+    return rc ? rc : 1 + k + n;
+}
+
 int
 mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
     const char *c, *e;
-    int offset;
+    int offset, rc;
 
     e = b->s + b->n;
     c = b->s;
     while (c < e) {
         switch (p->state) {
         case MQTT_ST_FIXED:
-            p->p.h.type = (((*c) >> 4) & 0x0F);
-            p->p.h.dup = (((*c) >> 3) & 0x01);
-            p->p.h.qos = (((*c) >> 1) & 0x03);
-            p->p.h.retain = (((*c) >> 0) & 0x01);
+            rc = __parse_fast(p, ud, c, e);
+            if (rc < 0)
+                return rc;
+            if (rc > 0) {
+                c += rc;
+                break;
+            }
+            __parse_fixed(p, *c);
             p->state = MQTT_ST_LENGTH;
             p->multiplier = 1;
             p->remaining.n = 0;
@@ -802,23 +1949,37 @@ mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
         case MQTT_ST_LENGTH:
             p->remaining.n += ((*c) & 127) * p->multiplier;
             p->multiplier *= 128;
-            if (p->multiplier > 128 * 128 * 128) {
+            if (((*c) & 128) && p->multiplier > 128 * 128 * 128) {
                 return -1;
             }
             if (((*c) & 128) == 0) {
                 p->require = p->remaining.n;
-                if (p->require > 0) {
-                    p->state = MQTT_ST_REMAIN;
-                    p->remaining.s = malloc(p->remaining.n);
-                    if (!p->remaining.s) {
+                p->remaining.n = 0;
+                p->stats.bytes[p->p.h.type] += __packet_size(p->require);
+                if (p->max_size > 0 && __packet_size(p->require) > p->max_size) {
+                    p->stats.oversize++;
+                    if (!p->skip) {
                         return -1;
                     }
+                    __skip(p);
+                } else if (p->p.h.type == PUBLISH && p->stream.size > 0 && p->auth
+                    && p->require >= p->stream.size) {
+                    p->state = MQTT_ST_HEADER;
+                } else if (p->require > 0) {
+                    if (__charge(p, p->require)) {
+                        __skip(p);
+                    } else {
+                        p->state = MQTT_ST_REMAIN;
+                        p->remaining.n = p->require;
+                        p->remaining.s = __parse_buffer(p, p->remaining.n);
+                        if (!p->remaining.s) {
+                            return -1;
+                        }
+                    }
                 } else {
-                    int rc;
-
                     p->state = MQTT_ST_FIXED;
                     rc = __process(p, ud);
-                    mqtt_b_free(&p->remaining);
+                    __release(p);
                     if (rc)
                         return rc;
                 }
@@ -828,13 +1989,11 @@ mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
         case MQTT_ST_REMAIN:
             offset = p->remaining.n - p->require;
             if (e - c >= p->require) {
-                int rc;
-
                 memcpy(p->remaining.s + offset, c, p->require);
                 c += p->require;
                 p->state = MQTT_ST_FIXED;
                 rc = __process(p, ud);
-                mqtt_b_free(&p->remaining);
+                __release(p);
                 if (rc)
                     return rc;
             } else {
@@ -843,6 +2002,30 @@ mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
                 c = e;
             }
             break;
+        case MQTT_ST_HEADER:
+            rc = __stream_header(p, ud, &c, e);
+            if (rc)
+                return rc;
+            break;
+        case MQTT_ST_STREAM:
+            offset = e - c < p->require ? e - c : p->require;
+            p->p.payload.s = (char *)c;
+            p->p.payload.n = offset;
+            c += offset;
+            p->require -= offset;
+            rc = p->stream.chunk(ud, &p->p);
+            if (!rc && p->require == 0)
+                rc = __stream_end(p, ud);
+            if (rc)
+                return rc;
+            break;
+        case MQTT_ST_SKIP:
+            offset = e - c < p->require ? e - c : p->require;
+            c += offset;
+            p->require -= offset;
+            if (p->require == 0)
+                p->state = MQTT_ST_FIXED;
+            break;
         }
     }
     return 0;
@@ -862,16 +2045,28 @@ __pack_remain_length(int length, char l[]) {
     return n;
 }
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
     int r_l;
+    int p_l;
     int flags;
     int l_len;
     char l[4];
     int i;
 
+    if (__utf8_check(&pkt->v.connect.client_id) || __utf8_check(&pkt->v.connect.username)
+        || (pkt->v.connect.will_flag && __utf8_check(&pkt->v.connect.will_topic)))
+        return -1;
     flags = 0;
+    p_l = 0;
     r_l = 8 + pkt->v.connect.proto_name.n;
+    if (pkt->v.connect.proto_ver == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+        if (pkt->v.connect.will_flag)
+            r_l += 1;
+    }
     r_l += pkt->v.connect.client_id.n;
     r_l += pkt->v.connect.username.n;
     r_l += pkt->v.connect.password.n;
@@ -895,7 +2090,7 @@ __serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
         flags |= (1 << 1);
     l_len = __pack_remain_length(r_l, l);
     b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
+    b->s = mqtt__malloc(b->n);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x10);
@@ -905,8 +2100,12 @@ __serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
     mqtt_b_write_u8(b, (uint8_t)pkt->v.connect.proto_ver);
     mqtt_b_write_u8(b, (uint8_t)flags);
     mqtt_b_write_u16(b, pkt->v.connect.keep_alive);
+    if (pkt->v.connect.proto_ver == MQTT_PROTO_V5)
+        __properties_write(b, &pkt->props, p_l);
     mqtt_b_write_utf(b, &pkt->v.connect.client_id);
     if (pkt->v.connect.will_flag) {
+        if (pkt->v.connect.proto_ver == MQTT_PROTO_V5)
+            mqtt_b_write_varint(b, 0);
         mqtt_b_write_utf(b, &pkt->v.connect.will_topic);
         mqtt_b_write_utf(b, &pkt->v.connect.will_payload);
     }
@@ -917,22 +2116,53 @@ __serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
     }
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __serialize_connack(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
+    int r_l;
+    int p_l;
+
+    p_l = 0;
+    r_l = 2;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+    }
+    b->s = mqtt__malloc(1 + __varint_size(r_l) + r_l);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x20);
-    mqtt_b_write_u8(b, 0x02);
+    mqtt_b_write_varint(b, r_l);
     mqtt_b_write_u8(b, (uint8_t)pkt->v.connack.ack_flags);
     mqtt_b_write_u8(b, (uint8_t)pkt->v.connack.return_code);
+    if (pkt->vsn == MQTT_PROTO_V5)
+        __properties_write(b, &pkt->props, p_l);
     return 0;
 }
+#endif
 
-static int
-__serialize_publish(struct mqtt_packet *pkt, struct mqtt_b *b) {
+int
+mqtt__publish_size(struct mqtt_packet *pkt) {
+    char l[4];
     int r_l;
+
+    r_l = 2 + pkt->v.publish.topic_name.n + pkt->payload.n;
+    if (pkt->h.qos > MQTT_QOS_0)
+        r_l += 2;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        int p_l;
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+    }
+    return 1 + __pack_remain_length(r_l, l) + r_l;
+}
+
+void
+mqtt__publish_write(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    int r_l;
+    int p_l;
     int l_len;
     char l[4];
     uint8_t h;
@@ -947,25 +2177,44 @@ __serialize_publish(struct mqtt_packet *pkt, struct mqtt_b *b) {
     r_l = 2 + pkt->v.publish.topic_name.n + pkt->payload.n;
     if (pkt->h.qos > MQTT_QOS_0)
         r_l += 2;
+    p_l = 0;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+    }
     l_len = __pack_remain_length(r_l, l);
-    b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
-    if (!b->s) return -1;
-    b->n = 0;
     mqtt_b_write_u8(b, h);
     for (i = 0; i < l_len; i++)
         mqtt_b_write_u8(b, l[i]);
-    mqtt_b_write_utf(b, &pkt->v.publish.topic_name);
+    if (pkt->v.publish.topic_enc && pkt->v.publish.topic_name.n > 0) {
+        memcpy(&b->s[b->n], pkt->v.publish.topic_enc, 2 + pkt->v.publish.topic_name.n);
+        b->n += 2 + pkt->v.publish.topic_name.n;
+    } else {
+        mqtt_b_write_utf(b, &pkt->v.publish.topic_name);
+    }
     if (pkt->h.qos > MQTT_QOS_0)
         mqtt_b_write_u16(b, pkt->v.publish.packet_id);
-    memcpy(&b->s[b->n], pkt->payload.s, pkt->payload.n);
-    b->n += pkt->payload.n;
+    if (pkt->vsn == MQTT_PROTO_V5)
+        __properties_write(b, &pkt->props, p_l);
+    if (pkt->payload.n > 0) {
+        memcpy(&b->s[b->n], pkt->payload.s, pkt->payload.n);
+        b->n += pkt->payload.n;
+    }
+}
+
+static int
+__serialize_publish(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    if (!pkt->v.publish.topic_enc && __utf8_check(&pkt->v.publish.topic_name)) return -1;
+    b->s = mqtt__malloc(mqtt__publish_size(pkt));
+    if (!b->s) return -1;
+    b->n = 0;
+    mqtt__publish_write(pkt, b);
     return 0;
 }
 
 static int
 __serialize_puback(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
+    b->s = mqtt__malloc(4);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x40);
@@ -976,7 +2225,7 @@ __serialize_puback(struct mqtt_packet *pkt, struct mqtt_b *b) {
 
 static int
 __serialize_pubrec(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
+    b->s = mqtt__malloc(4);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x50);
@@ -987,7 +2236,7 @@ __serialize_pubrec(struct mqtt_packet *pkt, struct mqtt_b *b) {
 
 static int
 __serialize_pubrel(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
+    b->s = mqtt__malloc(4);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x62);
@@ -998,7 +2247,7 @@ __serialize_pubrel(struct mqtt_packet *pkt, struct mqtt_b *b) {
 
 static int
 __serialize_pubcomp(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
+    b->s = mqtt__malloc(4);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x70);
@@ -1007,119 +2256,179 @@ __serialize_pubcomp(struct mqtt_packet *pkt, struct mqtt_b *b) {
     return 0;
 }
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __serialize_subscribe(struct mqtt_packet *pkt, struct mqtt_b *b) {
     int r_l;
+    int p_l;
     int l_len;
     char l[4];
     int i;
 
     r_l = 2;
-    for (i = 0; i < pkt->v.subscribe.n; i++)
+    for (i = 0; i < pkt->v.subscribe.n; i++) {
+        if (__utf8_check(&pkt->v.subscribe.topic_name[i])) return -1;
         r_l += 2 + pkt->v.subscribe.topic_name[i].n + 1;
+    }
+    p_l = 0;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+    }
     l_len = __pack_remain_length(r_l, l);
     b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
+    b->s = mqtt__malloc(b->n);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x82);
     for (i = 0; i < l_len; i++)
         mqtt_b_write_u8(b, l[i]);
     mqtt_b_write_u16(b, pkt->v.subscribe.packet_id);
+    if (pkt->vsn == MQTT_PROTO_V5)
+        __properties_write(b, &pkt->props, p_l);
     for (i = 0; i < pkt->v.subscribe.n; i++) {
         mqtt_b_write_utf(b, &pkt->v.subscribe.topic_name[i]);
         mqtt_b_write_u8(b, pkt->v.subscribe.qos[i]);
     }
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __serialize_suback(struct mqtt_packet *pkt, struct mqtt_b *b) {
     int r_l;
+    int p_l;
     int l_len;
     char l[4];
     int i;
 
     r_l = pkt->v.suback.n + 2;
+    p_l = 0;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+    }
     l_len = __pack_remain_length(r_l, l);
     b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
+    b->s = mqtt__malloc(b->n);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0x90);
     for (i = 0; i < l_len; i++)
         mqtt_b_write_u8(b, l[i]);
     mqtt_b_write_u16(b, pkt->v.suback.packet_id);
+    if (pkt->vsn == MQTT_PROTO_V5)
+        __properties_write(b, &pkt->props, p_l);
     for (i = 0; i < pkt->v.suback.n; i++)
         mqtt_b_write_u8(b, pkt->v.suback.qos[i]);
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __serialize_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *b) {
     int r_l;
+    int p_l;
     int l_len;
     char l[4];
     int i;
 
     r_l = 2;
-    for (i = 0; i < pkt->v.unsubscribe.n; i++)
+    for (i = 0; i < pkt->v.unsubscribe.n; i++) {
+        if (__utf8_check(&pkt->v.unsubscribe.topic_name[i])) return -1;
         r_l += 2 + pkt->v.unsubscribe.topic_name[i].n;
+    }
+    p_l = 0;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l;
+    }
     l_len = __pack_remain_length(r_l, l);
     b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
+    b->s = mqtt__malloc(b->n);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0xa2);
     for (i = 0; i < l_len; i++)
         mqtt_b_write_u8(b, l[i]);
     mqtt_b_write_u16(b, pkt->v.unsubscribe.packet_id);
+    if (pkt->vsn == MQTT_PROTO_V5)
+        __properties_write(b, &pkt->props, p_l);
     for (i = 0; i < pkt->v.unsubscribe.n; i++) {
         mqtt_b_write_utf(b, &pkt->v.unsubscribe.topic_name[i]);
     }
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __serialize_unsuback(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
+    int r_l;
+    int p_l;
+    int l_len;
+    char l[4];
+    int i;
+
+    r_l = 2;
+    p_l = 0;
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        p_l = __properties_size(&pkt->props);
+        r_l += __varint_size(p_l) + p_l + pkt->v.unsuback.n;
+    }
+    l_len = __pack_remain_length(r_l, l);
+    b->n = l_len + r_l + 1;
+    b->s = mqtt__malloc(b->n);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0xb0);
-    mqtt_b_write_u8(b, 0x02);
+    for (i = 0; i < l_len; i++)
+        mqtt_b_write_u8(b, l[i]);
     mqtt_b_write_u16(b, pkt->v.unsuback.packet_id);
+    if (pkt->vsn == MQTT_PROTO_V5) {
+        __properties_write(b, &pkt->props, p_l);
+        for (i = 0; i < pkt->v.unsuback.n; i++)
+            mqtt_b_write_u8(b, pkt->v.unsuback.reason_code[i]);
+    }
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __serialize_pingreq(struct mqtt_packet *pkt, struct mqtt_b *b) {
     (void)pkt;
 
-    b->s = malloc(2);
+    b->s = mqtt__malloc(2);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0xc0);
     mqtt_b_write_u8(b, 0x00);
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_SERVER
 static int
 __serialize_pingresp(struct mqtt_packet *pkt, struct mqtt_b *b) {
     (void)pkt;
 
-    b->s = malloc(2);
+    b->s = mqtt__malloc(2);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0xd0);
     mqtt_b_write_u8(b, 0x00);
     return 0;
 }
+#endif
 
 static int
 __serialize_disconnect(struct mqtt_packet *pkt, struct mqtt_b *b) {
     (void)pkt;
     
-    b->s = malloc(2);
+    b->s = mqtt__malloc(2);
     if (!b->s) return -1;
     b->n = 0;
     mqtt_b_write_u8(b, 0xe0);
@@ -1127,42 +2436,36 @@ __serialize_disconnect(struct mqtt_packet *pkt, struct mqtt_b *b) {
     return 0;
 }
 
+/* packets this role sends. */
+static int (* const __serializers[MQTT_MAX_TYPE])(struct mqtt_packet *, struct mqtt_b *) = {
+#ifdef MQTT_ROLE_CLIENT
+    [CONNECT] = __serialize_connect,
+    [SUBSCRIBE] = __serialize_subscribe,
+    [UNSUBSCRIBE] = __serialize_unsubscribe,
+    [PINGREQ] = __serialize_pingreq,
+#endif
+#ifdef MQTT_ROLE_SERVER
+    [CONNACK] = __serialize_connack,
+    [SUBACK] = __serialize_suback,
+    [UNSUBACK] = __serialize_unsuback,
+    [PINGRESP] = __serialize_pingresp,
+#endif
+    [PUBLISH] = __serialize_publish,
+    [PUBACK] = __serialize_puback,
+    [PUBREC] = __serialize_pubrec,
+    [PUBREL] = __serialize_pubrel,
+    [PUBCOMP] = __serialize_pubcomp,
+    [DISCONNECT] = __serialize_disconnect,
+};
+
 int
 mqtt__serialize(struct mqtt_packet *pkt, struct mqtt_b *b) {
     b->n = 0;
     b->s = 0;
-    switch (pkt->h.type) {
-    case CONNECT:
-        return __serialize_connect(pkt, b);
-    case CONNACK:
-        return __serialize_connack(pkt, b);
-    case PUBLISH:
-        return __serialize_publish(pkt, b);
-    case PUBACK:
-        return __serialize_puback(pkt, b);
-    case PUBREC:
-        return __serialize_pubrec(pkt, b);
-    case PUBREL:
-        return __serialize_pubrel(pkt, b);
-    case PUBCOMP:
-        return __serialize_pubcomp(pkt, b);
-    case SUBSCRIBE:
-        return __serialize_subscribe(pkt, b);
-    case SUBACK:
-        return __serialize_suback(pkt, b);
-    case UNSUBSCRIBE:
-        return __serialize_unsubscribe(pkt, b);
-    case UNSUBACK:
-        return __serialize_unsuback(pkt, b);
-    case PINGREQ:
-        return __serialize_pingreq(pkt, b);
-    case PINGRESP:
-        return __serialize_pingresp(pkt, b);
-    case DISCONNECT:
-        return __serialize_disconnect(pkt, b);
-    default:
+    if (!MQTT_IS_TYPE(pkt->h.type) || !__serializers[pkt->h.type])
         return -1;
-    }
+    return __serializers[pkt->h.type](pkt, b);
 }
 
+#endif /* _MQTT_IMPLEMENTATION_ */
 #endif /* MQTT_IMPLEMENTATION */
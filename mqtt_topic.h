@@ -0,0 +1,673 @@
+/*
+ * mqtt_topic.h -- mqtt topic name and topic filter utils.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _MQTT_TOPIC_H_
+#define _MQTT_TOPIC_H_
+
+#include "mqtt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* levels matched on the stack, deeper topics and filters take a slower path. */
+#define MQTT_MAX_LEVEL 64
+
+/* topic filter trie, split by topic level. */
+struct mqtt_trie;
+
+/* topic filter compiled into its levels. */
+struct mqtt_filter;
+
+typedef void (*mqtt_trie_cb)(void *ud, void *value);
+
+/* check a topic name, or a topic filter when filter is set. */
+extern MQTT_API int mqtt__topic_valid(const char *topic, int n, int filter);
+
+/* match one topic name against one topic filter, 1 if matched. */
+extern MQTT_API int mqtt__topic_match(const char *filter, int fn, const char *topic, int tn);
+
+/* store the offsets of the first max '/' separators of topic in sep, return the separator count.
+ * scanning stops at the separator after the max-th, so a count above max is only a lower bound. */
+extern MQTT_API int mqtt__topic_split(const char *topic, int n, int *sep, int max);
+
+extern MQTT_API struct mqtt_filter *mqtt__filter_compile(const char *filter, int n);
+extern MQTT_API void mqtt__filter_free(struct mqtt_filter *f);
+extern MQTT_API int mqtt__filter_match(const struct mqtt_filter *f, const char *topic, int n);
+
+extern MQTT_API struct mqtt_trie *mqtt__trie_create(void);
+extern MQTT_API void mqtt__trie_destroy(struct mqtt_trie *t);
+
+/* value must not be null, an existing filter has its value replaced. */
+extern MQTT_API int mqtt__trie_insert(struct mqtt_trie *t, const char *filter, int n, void *value);
+extern MQTT_API void *mqtt__trie_remove(struct mqtt_trie *t, const char *filter, int n);
+extern MQTT_API void *mqtt__trie_find(struct mqtt_trie *t, const char *filter, int n);
+
+/* call cb for the value of every filter matching topic, return the matched count. cb may be null. */
+extern MQTT_API int mqtt__trie_match(struct mqtt_trie *t, const char *topic, int n, mqtt_trie_cb cb, void *ud);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MQTT_TOPIC_H_ */
+
+
+#ifdef MQTT_IMPLEMENTATION
+#ifndef _MQTT_TOPIC_IMPLEMENTATION_
+#define _MQTT_TOPIC_IMPLEMENTATION_
+
+struct mqtt_trie_node {
+    char *level;
+    int n;
+    uint32_t hash;
+    void *value;
+    void *multi;
+    int count;
+    int size;
+    struct mqtt_trie_node **child;
+    struct mqtt_trie_node *plus;
+    struct mqtt_trie_node *parent;
+    struct mqtt_trie_node *next;
+};
+
+struct mqtt_trie {
+    struct mqtt_trie_node root;
+};
+
+/* a '+' level, or a run of literal levels compared as one. */
+struct mqtt_filter_seg {
+    int off;
+    int n;
+    int levels;
+};
+
+struct mqtt_filter {
+    char *s;
+    int n;
+    int levels;
+    int multi;
+    int wild;
+    int lead;
+    int lead_n;
+    int segs;
+    struct mqtt_filter_seg seg[1];
+};
+
+int
+mqtt__topic_valid(const char *topic, int n, int filter) {
+    int i;
+
+    if (n <= 0 || n > 65535)
+        return 0;
+    for (i = 0; i < n; i++) {
+        switch (topic[i]) {
+        case '\0':
+            return 0;
+        case '+':
+            if (!filter) return 0;
+            if (i > 0 && topic[i - 1] != '/') return 0;
+            if (i < n - 1 && topic[i + 1] != '/') return 0;
+            break;
+        case '#':
+            if (!filter) return 0;
+            if (i > 0 && topic[i - 1] != '/') return 0;
+            if (i != n - 1) return 0;
+            break;
+        }
+    }
+    return !__mqtt_utf8 || __utf8_valid(topic, n);
+}
+
+int
+mqtt__topic_match(const char *filter, int fn, const char *topic, int tn) {
+    int i, j;
+
+    if (tn > 0 && topic[0] == '$' && fn > 0 && (filter[0] == '+' || filter[0] == '#'))
+        return 0;
+    i = j = 0;
+    for (;;) {
+        if (i < fn && filter[i] == '#')
+            return 1;
+        if (i < fn && filter[i] == '+') {
+            while (j < tn && topic[j] != '/')
+                j++;
+            i++;
+        } else {
+            while (i < fn && filter[i] != '/') {
+                if (j >= tn || topic[j] != filter[i])
+                    return 0;
+                i++;
+                j++;
+            }
+            if (j < tn && topic[j] != '/')
+                return 0;
+        }
+        if (i == fn)
+            return j == tn;
+        if (j == tn)
+            return fn - i == 2 && filter[i + 1] == '#';
+        i++;
+        j++;
+    }
+}
+
+static int
+__split_scalar(const char *s, int i, int n, int *sep, int max, int c) {
+    for (; i < n; i++) {
+        if (s[i] == '/') {
+            if (c == max) return c + 1;
+            sep[c++] = i;
+        }
+    }
+    return c;
+}
+
+#ifdef MQTT_SIMD_X86
+__attribute__((target("sse2"))) static int
+__split_sse2(const char *s, int n, int *sep, int max) {
+    __m128i slash;
+    int i, c;
+
+    slash = _mm_set1_epi8('/');
+    c = 0;
+    for (i = 0; i + 16 <= n; i += 16) {
+        unsigned m;
+
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), slash));
+        for (; m; m &= m - 1) {
+            if (c == max) return c + 1;
+            sep[c++] = i + __builtin_ctz(m);
+        }
+    }
+    return __split_scalar(s, i, n, sep, max, c);
+}
+
+__attribute__((target("avx2"))) static int
+__split_avx2(const char *s, int n, int *sep, int max) {
+    __m256i slash;
+    int i, c;
+
+    slash = _mm256_set1_epi8('/');
+    c = 0;
+    for (i = 0; i + 32 <= n; i += 32) {
+        unsigned m;
+
+        m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), slash));
+        for (; m; m &= m - 1) {
+            if (c == max) return c + 1;
+            sep[c++] = i + __builtin_ctz(m);
+        }
+    }
+    if (i + 16 <= n) {
+        unsigned m;
+
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), _mm256_castsi256_si128(slash)));
+        for (; m; m &= m - 1) {
+            if (c == max) return c + 1;
+            sep[c++] = i + __builtin_ctz(m);
+        }
+        i += 16;
+    }
+    return __split_scalar(s, i, n, sep, max, c);
+}
+#endif /* MQTT_SIMD_X86 */
+
+static inline int
+__topic_split(const char *topic, int n, int *sep, int max) {
+    switch (__mqtt_simd != MQTT_SIMD_AUTO ? __mqtt_simd : mqtt__simd_get()) {
+#ifdef MQTT_SIMD_X86
+    case MQTT_SIMD_AVX2:
+        return __split_avx2(topic, n, sep, max);
+    case MQTT_SIMD_SSE2:
+        return __split_sse2(topic, n, sep, max);
+#endif
+    default:
+        return __split_scalar(topic, 0, n, sep, max, 0);
+    }
+}
+
+int
+mqtt__topic_split(const char *topic, int n, int *sep, int max) {
+    return __topic_split(topic, n, sep, max);
+}
+
+struct mqtt_filter *
+mqtt__filter_compile(const char *filter, int n) {
+    struct mqtt_filter *f;
+    struct mqtt_filter_seg *seg;
+    int levels, i, start;
+
+    if (!mqtt__topic_valid(filter, n, 1))
+        return 0;
+    levels = 1;
+    for (i = 0; i < n; i++) {
+        if (filter[i] == '/') levels++;
+    }
+    f = mqtt__malloc(sizeof *f + levels * sizeof f->seg[0] + n);
+    if (!f) return 0;
+    f->s = (char *)(f->seg + levels);
+    memcpy(f->s, filter, n);
+    f->n = n;
+    f->multi = filter[n - 1] == '#';
+    f->wild = filter[0] == '+' || filter[0] == '#';
+    f->levels = 0;
+    f->segs = 0;
+    start = 0;
+    for (i = 0; i <= n; i++) {
+        if (i < n && filter[i] != '/')
+            continue;
+        if (i - start == 1 && filter[start] == '#')
+            break;
+        seg = f->segs > 0 ? &f->seg[f->segs - 1] : 0;
+        if (i - start == 1 && filter[start] == '+') {
+            seg = &f->seg[f->segs++];
+            seg->off = start;
+            seg->n = -1;
+            seg->levels = 1;
+        } else if (seg && seg->n >= 0) {
+            seg->n = i - seg->off;
+            seg->levels++;
+        } else {
+            seg = &f->seg[f->segs++];
+            seg->off = start;
+            seg->n = i - start;
+            seg->levels = 1;
+        }
+        f->levels++;
+        start = i + 1;
+    }
+    f->lead = 0;
+    f->lead_n = 0;
+    if (f->segs > 0 && f->seg[0].n >= 0) {
+        f->lead = f->seg[0].levels;
+        f->lead_n = f->seg[0].n;
+    }
+    return f;
+}
+
+void
+mqtt__filter_free(struct mqtt_filter *f) {
+    mqtt__free(f);
+}
+
+/* the topic is split past the leading literal levels, each literal run costs one compare. */
+int
+mqtt__filter_match(const struct mqtt_filter *f, const char *topic, int n) {
+    int sep[MQTT_MAX_LEVEL];
+    int m, j, k, want, pos, start, end;
+
+    if (n <= 0)
+        return 0;
+    if (f->wild && topic[0] == '$')
+        return 0;
+    if (n < f->lead_n || memcmp(topic, f->s, f->lead_n))
+        return 0;
+    if (f->lead == f->levels) {
+        if (n == f->lead_n)
+            return 1;
+        return f->multi && (f->lead == 0 || topic[f->lead_n] == '/');
+    }
+    pos = 0;
+    if (f->lead > 0) {
+        if (n == f->lead_n || topic[f->lead_n] != '/')
+            return 0;
+        pos = f->lead_n + 1;
+    }
+    want = f->levels - f->lead;
+    if (want > MQTT_MAX_LEVEL)
+        return mqtt__topic_match(f->s, f->n, topic, n);
+    m = __topic_split(topic + pos, n - pos, sep, want);
+    if (f->multi ? m + 1 < want : m + 1 != want)
+        return 0;
+    start = pos;
+    k = 0;
+    for (j = f->lead > 0; j < f->segs; j++) {
+        const struct mqtt_filter_seg *seg;
+
+        seg = &f->seg[j];
+        k += seg->levels;
+        end = k - 1 < m ? pos + sep[k - 1] : n;
+        if (seg->n >= 0 && (end - start != seg->n || memcmp(topic + start, f->s + seg->off, seg->n)))
+            return 0;
+        start = end + 1;
+    }
+    return 1;
+}
+
+static uint32_t
+__level_hash(const char *s, int n) {
+    uint64_t h, w;
+
+    h = (uint64_t)n * 0x9e3779b97f4a7c15ull;
+    for (; n >= 8; s += 8, n -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    }
+    if (n > 0) {
+        w = 0;
+        memcpy(&w, s, n);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    }
+    return (uint32_t)(h >> 32);
+}
+
+static int
+__level_end(const char *s, int i, int n) {
+    const char *e;
+
+    e = memchr(s + i, '/', n - i);
+    return e ? (int)(e - s) : n;
+}
+
+static struct mqtt_trie_node *
+__node_child(struct mqtt_trie_node *node, const char *level, int n, uint32_t hash) {
+    struct mqtt_trie_node *c;
+
+    if (!node->size) return 0;
+    c = node->child[hash & (node->size - 1)];
+    while (c) {
+        if (c->hash == hash && c->n == n && (!n || 0 == memcmp(c->level, level, n)))
+            return c;
+        c = c->next;
+    }
+    return 0;
+}
+
+static int
+__node_grow(struct mqtt_trie_node *node) {
+    struct mqtt_trie_node **child;
+    int size, i;
+
+    size = node->size ? node->size * 2 : 4;
+    child = mqtt__malloc(size * sizeof *child);
+    if (!child) return -1;
+    memset(child, 0, size * sizeof *child);
+    for (i = 0; i < node->size; i++) {
+        struct mqtt_trie_node *c, *next;
+        for (c = node->child[i]; c; c = next) {
+            next = c->next;
+            c->next = child[c->hash & (size - 1)];
+            child[c->hash & (size - 1)] = c;
+        }
+    }
+    mqtt__free(node->child);
+    node->child = child;
+    node->size = size;
+    return 0;
+}
+
+static struct mqtt_trie_node *
+__node_new(struct mqtt_trie_node *parent, const char *level, int n, uint32_t hash) {
+    struct mqtt_trie_node *c;
+
+    c = mqtt__malloc(sizeof *c);
+    if (!c) return 0;
+    memset(c, 0, sizeof *c);
+    c->parent = parent;
+    if (n == 1 && level[0] == '+') {
+        c->n = -1;
+        parent->plus = c;
+        return c;
+    }
+    if (parent->count >= parent->size && __node_grow(parent)) {
+        mqtt__free(c);
+        return 0;
+    }
+    if (n > 0) {
+        c->level = mqtt__malloc(n);
+        if (!c->level) {
+            mqtt__free(c);
+            return 0;
+        }
+        memcpy(c->level, level, n);
+    }
+    c->n = n;
+    c->hash = hash;
+    c->next = parent->child[hash & (parent->size - 1)];
+    parent->child[hash & (parent->size - 1)] = c;
+    parent->count++;
+    return c;
+}
+
+static void
+__node_free(struct mqtt_trie_node *node) {
+    int i;
+
+    for (i = 0; i < node->size; i++) {
+        struct mqtt_trie_node *c, *next;
+        for (c = node->child[i]; c; c = next) {
+            next = c->next;
+            __node_free(c);
+        }
+    }
+    if (node->plus)
+        __node_free(node->plus);
+    mqtt__free(node->child);
+    mqtt__free(node->level);
+    mqtt__free(node);
+}
+
+/* release empty nodes from a leaf up to the root. */
+static void
+__node_prune(struct mqtt_trie_node *node) {
+    while (node->parent && !node->value && !node->multi && !node->count && !node->plus) {
+        struct mqtt_trie_node *parent;
+
+        parent = node->parent;
+        if (parent->plus == node) {
+            parent->plus = 0;
+        } else {
+            struct mqtt_trie_node **pp;
+
+            pp = &parent->child[node->hash & (parent->size - 1)];
+            while (*pp != node)
+                pp = &(*pp)->next;
+            *pp = node->next;
+            parent->count--;
+        }
+        mqtt__free(node->child);
+        mqtt__free(node->level);
+        mqtt__free(node);
+        node = parent;
+    }
+}
+
+/* walk the literal and '+' levels of filter, the last '#' level is left to the caller. */
+static struct mqtt_trie_node *
+__node_walk(struct mqtt_trie *t, const char *filter, int n, int create, int *multi) {
+    struct mqtt_trie_node *node, *c;
+    int i, e;
+
+    node = &t->root;
+    *multi = 0;
+    i = 0;
+    for (;;) {
+        e = __level_end(filter, i, n);
+        if (e - i == 1 && filter[i] == '#') {
+            *multi = 1;
+            return node;
+        }
+        if (e - i == 1 && filter[i] == '+') {
+            c = node->plus;
+        } else {
+            c = __node_child(node, filter + i, e - i, __level_hash(filter + i, e - i));
+        }
+        if (!c) {
+            if (!create) return 0;
+            c = __node_new(node, filter + i, e - i, __level_hash(filter + i, e - i));
+            if (!c) return 0;
+        }
+        node = c;
+        if (e == n)
+            return node;
+        i = e + 1;
+    }
+}
+
+struct mqtt_trie *
+mqtt__trie_create(void) {
+    struct mqtt_trie *t;
+
+    t = mqtt__malloc(sizeof *t);
+    if (!t) return 0;
+    memset(t, 0, sizeof *t);
+    return t;
+}
+
+void
+mqtt__trie_destroy(struct mqtt_trie *t) {
+    int i;
+
+    if (!t) return;
+    for (i = 0; i < t->root.size; i++) {
+        struct mqtt_trie_node *c, *next;
+        for (c = t->root.child[i]; c; c = next) {
+            next = c->next;
+            __node_free(c);
+        }
+    }
+    if (t->root.plus)
+        __node_free(t->root.plus);
+    mqtt__free(t->root.child);
+    mqtt__free(t);
+}
+
+int
+mqtt__trie_insert(struct mqtt_trie *t, const char *filter, int n, void *value) {
+    struct mqtt_trie_node *node;
+    int multi;
+
+    if (!value || !mqtt__topic_valid(filter, n, 1))
+        return -1;
+    node = __node_walk(t, filter, n, 1, &multi);
+    if (!node) return -1;
+    if (multi)
+        node->multi = value;
+    else
+        node->value = value;
+    return 0;
+}
+
+void *
+mqtt__trie_find(struct mqtt_trie *t, const char *filter, int n) {
+    struct mqtt_trie_node *node;
+    int multi;
+
+    if (n <= 0) return 0;
+    node = __node_walk(t, filter, n, 0, &multi);
+    if (!node) return 0;
+    return multi ? node->multi : node->value;
+}
+
+void *
+mqtt__trie_remove(struct mqtt_trie *t, const char *filter, int n) {
+    struct mqtt_trie_node *node;
+    void *value;
+    int multi;
+
+    if (n <= 0) return 0;
+    node = __node_walk(t, filter, n, 0, &multi);
+    if (!node) return 0;
+    if (multi) {
+        value = node->multi;
+        node->multi = 0;
+    } else {
+        value = node->value;
+        node->value = 0;
+    }
+    __node_prune(node);
+    return value;
+}
+
+/* level k of topic spans from sep[k-1]+1 to sep[k] and hashes to hash[k], the topic has m separators. */
+static int
+__trie_match(struct mqtt_trie_node *node, const char *topic, int n, const int *sep, const uint32_t *hash,
+             int m, int k, mqtt_trie_cb cb, void *ud) {
+    struct mqtt_trie_node *c;
+    int start, end, count;
+
+    count = 0;
+    if (node->multi) {
+        if (cb) cb(ud, node->multi);
+        count++;
+    }
+    if (k > m) {
+        if (node->value) {
+            if (cb) cb(ud, node->value);
+            count++;
+        }
+        return count;
+    }
+    start = k > 0 ? sep[k - 1] + 1 : 0;
+    end = k < m ? sep[k] : n;
+    c = __node_child(node, topic + start, end - start, hash[k]);
+    if (c)
+        count += __trie_match(c, topic, n, sep, hash, m, k + 1, cb, ud);
+    if (node->plus)
+        count += __trie_match(node->plus, topic, n, sep, hash, m, k + 1, cb, ud);
+    return count;
+}
+
+int
+mqtt__trie_match(struct mqtt_trie *t, const char *topic, int n, mqtt_trie_cb cb, void *ud) {
+    int sep_buf[MQTT_MAX_LEVEL];
+    uint32_t hash_buf[MQTT_MAX_LEVEL + 1];
+    uint32_t *hash;
+    int *sep, m, k, start, end, count;
+
+    if (n <= 0) return 0;
+    sep = sep_buf;
+    hash = hash_buf;
+    m = __topic_split(topic, n, sep, MQTT_MAX_LEVEL);
+    if (m > MQTT_MAX_LEVEL) {
+        for (m = 0, k = 0; k < n; k++)
+            m += topic[k] == '/';
+        sep = mqtt__malloc(m * sizeof *sep + (m + 1) * sizeof *hash);
+        if (!sep) return 0;
+        hash = (uint32_t *)(sep + m);
+        __topic_split(topic, n, sep, m);
+    }
+    start = 0;
+    for (k = 0; k <= m; k++) {
+        end = k < m ? sep[k] : n;
+        hash[k] = __level_hash(topic + start, end - start);
+        start = end + 1;
+    }
+    if (topic[0] != '$') {
+        count = __trie_match(&t->root, topic, n, sep, hash, m, 0, cb, ud);
+    } else {
+        struct mqtt_trie_node *c;
+
+        /* wildcards at the first level do not match topics beginning with '$'. */
+        c = __node_child(&t->root, topic, m > 0 ? sep[0] : n, hash[0]);
+        count = c ? __trie_match(c, topic, n, sep, hash, m, 1, cb, ud) : 0;
+    }
+    if (sep != sep_buf)
+        mqtt__free(sep);
+    return count;
+}
+
+#endif /* _MQTT_TOPIC_IMPLEMENTATION_ */
+#endif /* MQTT_IMPLEMENTATION */